@@ -1,13 +1,24 @@
 #include <assert.h>
 
+#include <atomic>
 #include <chrono>
 #include <iostream>
+#include <mutex>
+#include <thread>
 
 #include "tgc2.h"
 
 using namespace tgc2;
 using namespace std;
 
+// With TGC_CONSERVATIVE_ROOTS a stale word on the stack may keep any object
+// alive, so the exact counts of the freed ones are not checked.
+#if TGC_CONSERVATIVE_ROOTS
+#define assert_freed(e) (void)sizeof(e)
+#else
+#define assert_freed(e) assert(e)
+#endif
+
 struct b1 {
   b1(const string& s) : name(s) {
     cout << "Creating b1(" << name << ")." << endl;
@@ -107,6 +118,58 @@ void testMoveCtor() {
   }
 }
 
+void testRef() {
+  static int dctorCnt = 0;
+  struct Node {
+    gc<Node> next;
+    int v = 0;
+    ~Node() { dctorCnt++; }
+  };
+  auto sum = [](gc_ref<Node> n) {
+    int s = 0;
+    for (; n; n = n->next)
+      s += n->v;
+    return s;
+  };
+  auto head = gc_new<Node>();
+  head->v = 1;
+  head->next = gc_new<Node>();
+  head->next->v = 2;
+  assert(sum(head) == 3);
+  gc_ref<Node> r = head->next;
+  gc<Node> p = r;
+  assert(p == head->next && r == p);
+  p = nullptr;
+  p = r;
+  assert(p->v == 2);
+
+  // moves and swaps keep the roots and the barrier.
+  for (int i = 0; i < 3; i++)
+    gc_collector()->minorCollect();
+  auto a = gc_new<Node>();
+  a->v = 3;
+  auto b = std::move(a);
+  assert(!a && b->v == 3);
+  b = std::move(b);
+  head->next = std::move(b);
+  assert(!b);
+  swap(head->next, p);
+  swap(p, p);
+  auto n = gc_new<int>(4);
+  auto m = std::move(n);
+  n = std::move(m);
+  for (int i = 0; i < 3; i++)
+    gc_collector()->minorCollect();
+  gc_collector()->fullCollect();
+  assert(head->next->v == 2 && p->v == 3 && *n == 4);
+
+  dctorCnt = 0;
+  head = nullptr;
+  p = nullptr;
+  gc_collector()->fullCollect();
+  assert_freed(dctorCnt == 3);
+}
+
 void testMakeGcObj() {
   { auto a = gc_new<b1>("test"); }
 }
@@ -132,8 +195,13 @@ struct ArrayTest {
 
     b->find(1);
     bar(b);
+    barRef(b);
+    assert(b->size() == 3);
   }
   void bar(gc_map<int, rc> cc) { cc->insert(std::make_pair(1, gc_new<rc>())); }
+  // borrowed, b keeps it alive.
+  using Map = gc_map<int, rc>::element_type;
+  void barRef(gc_ref<Map> cc) { cc->insert(std::make_pair(2, gc_new<rc>())); }
 };
 
 void testArray() {
@@ -145,6 +213,76 @@ void testArray() {
   gc_delete(a);
 }
 
+struct DeleteNode {
+  static int dctorCnt;
+  gc<DeleteNode> next;
+  ~DeleteNode() {
+    dctorCnt++;
+    // deleting from a destructor frees it only once, after this one.
+    gc_delete(next);
+  }
+};
+int DeleteNode::dctorCnt = 0;
+
+void testDelete() {
+  gc_collect();
+  auto& heap = gc_collector()->getHeap();
+  auto newGen = gc_collector()->getNewGenSize();
+  auto used = heap.getStats().usedBytes;
+  DeleteNode::dctorCnt = 0;
+
+  // freed at once, without a gc.
+  auto a = gc_new<DeleteNode>();
+  a->next = gc_new<DeleteNode>();
+  gc_delete(a);
+  assert(!a && DeleteNode::dctorCnt == 2);
+  assert(gc_collector()->getNewGenSize() == newGen);
+  assert(heap.getStats().usedBytes == used);
+
+  // an old one leaves its generation too.
+  auto o = gc_new<DeleteNode>();
+  for (int i = 0; i < 3; i++)
+    gc_collector()->minorCollect();
+  auto oldGen = gc_collector()->getOldGenSize();
+  gc_delete(o);
+  assert(gc_collector()->getOldGenSize() == oldGen - 1);
+
+#if !TGC_IMMEDIATE_BOXES
+  auto leaf = gc_new<int>(1);
+  auto leafUsed = heap.getStats().usedBytes;
+  gc_delete(leaf);
+  assert(heap.getStats().usedBytes < leafUsed);
+#endif
+
+  // the elements of a container, even the ones in it twice.
+  DeleteNode::dctorCnt = 0;
+  auto v = gc_new_vector<DeleteNode>();
+  auto e = gc_new<DeleteNode>();
+  v->push_back(e);
+  v->push_back(e);
+  v->push_back(gc_new<DeleteNode>());
+  e = nullptr;
+  auto withVector = heap.getStats().usedBytes;
+  gc_delete(v);
+  assert(v->empty() && DeleteNode::dctorCnt == 2);
+  assert(heap.getStats().usedBytes < withVector);
+
+#if TGC_CHECK_DELETE
+  // still referenced, so it is only destroyed and left to the gc.
+  DeleteNode::dctorCnt = 0;
+  auto holder = gc_new<DeleteNode>();
+  holder->next = gc_new<DeleteNode>();
+  auto alias = holder->next;
+  auto withShell = heap.getStats().usedBytes;
+  gc_delete(alias);
+  assert(DeleteNode::dctorCnt == 1);
+  assert(heap.getStats().usedBytes == withShell);
+  holder->next = nullptr;
+  gc_collect();
+  assert(DeleteNode::dctorCnt == 1);
+#endif
+}
+
 static int unref = 0;
 struct Val {
   ~Val() { unref++; }
@@ -160,7 +298,119 @@ void testContinusVector() {
   gc_new<Obj>();  // force registering of Obj
   { auto c = gc_new<vector<Obj>>(cnt); }
   gc_collector()->fullCollect();
-  assert(unref == cnt + 1);
+  assert_freed(unref == cnt + 1);
+}
+
+struct RunTarget {
+  static int dctorCnt;
+  ~RunTarget() { dctorCnt++; }
+};
+int RunTarget::dctorCnt = 0;
+
+struct RunSlot {
+  gc<RunTarget> p;
+};
+
+void testPtrRun() {
+  gc_collect();
+  RunTarget::dctorCnt = 0;
+  // dense slots are scanned as runs, with the nulls between skipped.
+  int cnt = 1003;
+  auto v = gc_new_vector<RunTarget>(cnt);
+  auto a = gc_new_array<RunSlot>(cnt);
+  auto* slots = &*a;
+  for (int i = 0; i < cnt; i++) {
+    if (i % 3 == 0)
+      (*v)[i] = gc_new<RunTarget>();
+    if (i % 5 == 0)
+      slots[i].p = gc_new<RunTarget>();
+  }
+  int kept = (cnt + 2) / 3 + (cnt + 4) / 5;
+  gc_collector()->minorCollect();
+  gc_collector()->fullCollect();
+  for (int i = 0; i < 3; i++)
+    gc_collector()->minorCollect();
+  assert_freed(RunTarget::dctorCnt == 0);
+
+  // old runs keep their targets through the remembered set.
+  (*v)[cnt - 2] = gc_new<RunTarget>();
+  slots[cnt - 2].p = gc_new<RunTarget>();
+  gc_collector()->minorCollect();
+  assert_freed(RunTarget::dctorCnt == 0);
+
+  for (int i = 0; i < cnt / 2; i++) {
+    (*v)[i] = nullptr;
+    slots[i].p = nullptr;
+  }
+  int dropped = (cnt / 2 + 2) / 3 + (cnt / 2 + 4) / 5;
+  gc_collector()->fullCollect();
+  assert_freed(RunTarget::dctorCnt == dropped);
+  v = nullptr;
+  a = nullptr;
+  gc_collector()->fullCollect();
+  assert_freed(RunTarget::dctorCnt == kept + 2);
+}
+
+void testAllocator() {
+  gc_collector()->fullCollect();
+  RunTarget::dctorCnt = 0;
+  auto v = gc_new_vector<RunTarget>();
+  auto m = gc_new_map<int, RunTarget>();
+  for (int i = 0; i < 1000; i++) {
+    v->push_back(gc_new<RunTarget>());
+    (*m)[i] = gc_new<RunTarget>();
+  }
+  // the storage is in the gc heap and the elements are traced from it.
+  assert(gc_collector()->getHeap().contains(v->data()));
+  gc_collector()->minorCollect();
+  gc_collector()->fullCollect();
+  assert_freed(RunTarget::dctorCnt == 0);
+
+  // the ones added to an old container are old as well.
+  for (int i = 0; i < 3; i++)
+    gc_collector()->minorCollect();
+  for (int i = 0; i < 1000; i++) {
+    v->push_back(gc_new<RunTarget>());
+    (*m)[1000 + i] = gc_new<RunTarget>();
+  }
+  gc_collector()->minorCollect();
+  assert_freed(RunTarget::dctorCnt == 0);
+
+  // moved element by element between young and old storage.
+  m->clear();
+  v->clear();
+  gc_collector()->fullCollect();
+  assert_freed(RunTarget::dctorCnt == 4000);
+  auto young = gc_new_vector<RunTarget>();
+  young->push_back(gc_new<RunTarget>());
+  *v = std::move(*young);
+  gc_collector()->minorCollect();
+  gc_collector()->fullCollect();
+  assert_freed(RunTarget::dctorCnt == 4000);
+
+  // swapped storage is flagged for the owner it goes to.
+  auto other = gc_new_vector<RunTarget>();
+  other->push_back(gc_new<RunTarget>());
+  other->push_back(gc_new<RunTarget>());
+  v->swap(*other);
+  gc_collector()->minorCollect();
+  assert_freed(RunTarget::dctorCnt == 4000);
+  assert(v->size() == 2 && other->size() == 1);
+  other = nullptr;
+  gc_collector()->fullCollect();
+  assert_freed(RunTarget::dctorCnt == 4001);
+
+  // outside of a gc object its elements are roots.
+  {
+    vector<gc<RunTarget>, gc_allocator<gc<RunTarget>>> local;
+    local.push_back(gc_new<RunTarget>());
+    gc_collector()->fullCollect();
+    assert_freed(RunTarget::dctorCnt == 4001);
+  }
+
+  v = nullptr;
+  gc_collector()->fullCollect();
+  assert_freed(RunTarget::dctorCnt == 4004);
 }
 
 void testContinusList() {
@@ -169,7 +419,51 @@ void testContinusList() {
   gc_new<Obj>();  // force registering of Obj
   { auto c = gc_new<list<Obj>>(cnt); }
   gc_collector()->fullCollect();
-  assert(unref == cnt + 1);
+  assert_freed(unref == cnt + 1);
+}
+
+void testCollectInCtor() {
+  static int dctorCnt = 0;
+  struct Node {
+    gc<Node> next;
+    Node(int depth) {
+      if (depth)
+        next = gc_new<Node>(depth - 1);
+      // neither this one nor the ones it holds are referenced yet.
+      gc_collector()->minorCollect();
+      gc_collector()->fullCollect();
+    }
+    ~Node() { dctorCnt++; }
+  };
+  dctorCnt = 0;
+  auto n = gc_new<Node>(2);
+  assert(dctorCnt == 0 && n->next->next && !n->next->next->next);
+  for (int i = 0; i < 3; i++)
+    gc_collector()->minorCollect();
+  assert(dctorCnt == 0);
+  n = nullptr;
+  gc_collector()->fullCollect();
+  assert_freed(dctorCnt == 3);
+}
+
+void testArrayDiscovery() {
+  static int dctorCnt = 0;
+  struct Item {
+    gc<Item> next;
+    ~Item() { dctorCnt++; }
+  };
+  dctorCnt = 0;
+  // the class is discovered while its first array is constructed.
+  auto a = gc_new_array<Item>(3);
+  auto* items = &*a;
+  for (int i = 0; i < 3; i++)
+    items[i].next = gc_new<Item>();
+  gc_collector()->fullCollect();
+  assert(dctorCnt == 0);
+  a = nullptr;
+  items = nullptr;
+  gc_collector()->fullCollect();
+  assert_freed(dctorCnt == 6);
 }
 
 void testCircledContainer() {
@@ -183,7 +477,7 @@ void testCircledContainer() {
     node->childs[0] = node;
   }
   gc_collect();
-  assert(delCnt == 1);
+  assert_freed(delCnt == 1);
 }
 
 bool operator<(rc& a, rc& b) {
@@ -234,6 +528,53 @@ void testHashMap() {
   gc_delete(ll);
 }
 
+void testFlatHashMap() {
+  static int dctorCnt = 0;
+  struct Val {
+    int v;
+    Val(int i) : v(i) {}
+    ~Val() { dctorCnt++; }
+  };
+
+  int cnt = 10000;
+  {
+    auto m = gc_new_flat_hash_map<int, Val>();
+    for (int i = 0; i < cnt; i++)
+      m[i] = gc_new<Val>(i);
+    for (int i = 0; i < cnt; i += 2)
+      assert(m->erase(i) == 1);
+    assert(m->size() == size_t(cnt / 2));
+    gc_collector()->fullCollect();
+    assert_freed(dctorCnt == cnt / 2);
+    for (int i = 0; i < cnt; i++)
+      assert(m->count(i) == size_t(i % 2));
+    for (auto& i : *m)
+      assert(i.second->v == i.first);
+
+    // gc objects as keys, by identity.
+    auto keys = gc_new_flat_hash_map<gc<Val>, Val>();
+    auto k1 = gc_new<Val>(1), k2 = gc_new<Val>(1);
+    keys[k1] = k2;
+    keys[k2] = k1;
+    assert(keys->size() == 2);
+    assert(keys[k1] == k2);
+    auto k3 = gc_new<Val>(1);
+    assert(keys->find(k3) == keys->end());
+
+    // young values in an old table.
+    gc_collect();
+    gc_collect();
+    for (int i = 0; i < cnt; i++)
+      m[i + cnt] = gc_new<Val>(i);
+    gc_collect();
+    for (int i = 0; i < cnt; i++)
+      assert(m[i + cnt]->v == i);
+  }
+  dctorCnt = 0;
+  gc_collector()->fullCollect();
+  assert_freed(dctorCnt == cnt / 2 + cnt + 3);
+}
+
 void testLambda() {
   gc_function<int()> ff;
   {
@@ -275,6 +616,7 @@ void testGcFromThis() {
   };
 
   auto makeLowerBoundHasElemToCompare = gc_new<int>();
+  (void)makeLowerBoundHasElemToCompare;
   auto p = gc_new<Base>();
 }
 
@@ -345,6 +687,1066 @@ void testCollection() {
   }
 }
 
+void testHeapRelease() {
+  auto& heap = gc_collector()->getHeap();
+  auto oldPolicy = heap.getPolicy();
+  auto policy = oldPolicy;
+  policy.retainedEmptyPages = 0;
+  policy.hugePages = true;
+  policy.prefault = true;
+  heap.setPolicy(policy);
+
+  gc_collector()->fullCollect();
+  auto before = heap.getStats();
+  {
+    vector<gc<int>> small;
+    for (int i = 0; i < 1024 * 100; i++)
+      small.push_back(gc_new<int>(i));
+    auto large = gc_new_array<char>(1024 * 1024 * 4);
+    assert(heap.getStats().usedBytes > before.usedBytes);
+  }
+  gc_collector()->fullCollect();
+  auto after = heap.getStats();
+  assert_freed(after.usedBytes <= before.usedBytes);
+  assert_freed(after.releasedBytes > before.releasedBytes);
+
+  // a span joined to released pages gives back only its own.
+  {
+    auto large = gc_new_array<char>(1024 * 1024);
+  }
+  gc_collector()->fullCollect();
+  auto released = heap.getStats().releasedBytes - after.releasedBytes;
+  assert_freed(released <= 1024 * 1024 + details::Heap::PageSize);
+
+  heap.setPolicy(oldPolicy);
+}
+
+void testHeapLimit() {
+  auto& heap = gc_collector()->getHeap();
+  auto oldPolicy = heap.getPolicy();
+  gc_collector()->fullCollect();
+
+  const size_t chunk = 60 * 1024;
+  auto policy = oldPolicy;
+  policy.heapLimit = heap.getStats().pageBytes + chunk * 64;
+  heap.setPolicy(policy);
+
+  // garbage is collected before the limit is reached.
+  for (int i = 0; i < 1000; i++) {
+    gc_new_array<char>(chunk);
+    assert(heap.getStats().pageBytes <= policy.heapLimit);
+  }
+
+  // caches are dropped before an allocation fails.
+  vector<gc<char>> cache, kept;
+  int calls = 0;
+  auto id = gc_collector()->addMemoryPressureHandler([&](MemoryPressure) {
+    calls++;
+    cache.clear();
+  });
+  for (int i = 0; i < 32; i++)
+    cache.push_back(gc_new_array<char>(chunk));
+  bool failed = false;
+  try {
+    for (int i = 0; i < 1000; i++)
+      kept.push_back(gc_new_array<char>(chunk));
+  } catch (std::bad_alloc&) {
+    failed = true;
+  }
+  assert(failed && calls > 0 && cache.empty());
+  assert(kept.size() > 32 && heap.getStats().pageBytes <= policy.heapLimit);
+
+  kept.clear();
+  calls = 0;
+  gc_memory_pressure();
+  assert(calls == 1);
+  gc_collector()->removeMemoryPressureHandler(id);
+  heap.setPolicy(oldPolicy);
+}
+
+void testImmediateBoxes() {
+#if TGC_IMMEDIATE_BOXES
+  struct Point {
+    gc_int x, y;
+    gc_double w;
+  };
+  static_assert(details::is_gc_leaf<Point>::value, "holds no gc pointer");
+
+  gc_collector()->fullCollect();
+  auto& heap = gc_collector()->getHeap();
+  auto objs = gc_collector()->getNewGenSize() + heap.getLeafCount();
+
+  gc_int a = 1;
+  auto b = gc_new<int>(2);
+  // a copy holds its own value.
+  gc_int c = a;
+  *c = 3;
+  gc_double d;
+  assert(a == 1 && *b == 2 && c == 3 && !d && a);
+  d = gc_new<double>(0.5);
+  assert(d && *d == 0.5);
+  d = nullptr;
+  assert(!d);
+  gc_delete(b);
+  assert(!b);
+
+  auto batch = gc_new_batch<int>(3, 7);
+  assert(batch.size() == 3 && *batch[2] == 7);
+  // only the storage of the containers is allocated.
+  auto v = gc_new_vector<int>();
+  for (int i = 0; i < 1000; i++)
+    v->push_back(i);
+  auto m = gc_new_flat_hash_map<int, int>();
+  for (int i = 0; i < 100; i++)
+    (*m)[i] = i * 2;
+  assert(gc_collector()->getNewGenSize() + heap.getLeafCount() == objs + 2);
+
+  gc_collector()->fullCollect();
+  assert(v[999] == 999 && *(*m)[99] == 198);
+  for (int i = 0; i < 100; i += 2)
+    m->erase(i);
+  assert(m->size() == 50 && *(*m)[1] == 2);
+#endif
+}
+
+void testCompressedPtrs() {
+#if TGC_COMPRESSED_PTRS && !TGC_IMMEDIATE_BOXES
+  assert(sizeof(gc<int>) == 4);
+#endif
+  auto v = gc_new_vector<int>();
+  for (int i = 0; i < 1000; i++)
+    v->push_back(gc_new<int>(i));
+  gc_collector()->fullCollect();
+  for (int i = 0; i < 1000; i++)
+    assert(*v[i] == i);
+}
+
+void testReusedPtrAddress() {
+  static int freed = 0;
+  struct Item {
+    int v;
+    Item(int v) : v(v) {}
+    ~Item() { freed |= 1 << v; }
+  };
+
+  // the second p reuses the stack slot of the first one before the gc.
+  for (int i = 0; i < 2; i++) {
+    gc<Item> p = gc_new<Item>(i);
+    if (i == 1) {
+      gc_collect();
+      gc_collect();
+      assert(!(freed & 2) && p->v == 1);
+    }
+  }
+}
+
+struct TracedPair {
+  gc<int> a, b;
+};
+TGC_TRACE(TracedPair, a, b)
+
+static int tracedCtorCnt = 0, tracedDctorCnt = 0;
+struct TracedNode {
+  TracedNode() { tracedCtorCnt++; }
+  ~TracedNode() { tracedDctorCnt++; }
+
+  string name;
+  gc<TracedNode> next;
+  TracedPair pair;
+  gc<int> vals[2];
+};
+TGC_TRACE(TracedNode, next, pair, vals)
+
+void testTrace() {
+  // registered at static init, before any instance exists.
+  auto* klass = details::ClassMeta::get<TracedNode>();
+  assert(klass->registered);
+#if TGC_IMMEDIATE_BOXES
+  // the ints are held in place.
+  assert(klass->subPtrOffsets->size() == 1);
+#else
+  assert(klass->subPtrOffsets->size() == 5);
+#endif
+
+  tracedCtorCnt = tracedDctorCnt = 0;
+  {
+    auto v = gc_new<vector<TracedNode>>(3);
+    auto& nodes = *v;
+    nodes[0].next = gc_new<TracedNode>();
+    nodes[0].next->next = nodes[0].next;
+    nodes[1].pair.b = gc_new<int>(1);
+    nodes[2].vals[1] = gc_new<int>(2);
+    gc_collector()->fullCollect();
+    assert(*nodes[1].pair.b == 1);
+    assert(*nodes[2].vals[1] == 2);
+    assert(nodes[0].next->next == nodes[0].next);
+  }
+  gc_collector()->fullCollect();
+  // no throwaway instance is constructed to learn the layout.
+  assert(tracedCtorCnt == 4);
+  assert_freed(tracedDctorCnt == 4);
+
+  // traced objects made while an untraced one is discovered.
+  struct Holder {
+    gc<TracedNode> a = gc_new<TracedNode>();
+    gc<TracedNode> b = gc_new<TracedNode>();
+  };
+  auto h = gc_new<Holder>();
+  assert(details::ClassMeta::get<Holder>()->subPtrOffsets->size() == 2);
+  gc_collector()->fullCollect();
+  assert(h->a && h->b);
+}
+
+static int imageDctorCnt = 0;
+struct ImageNode {
+  ~ImageNode() { imageDctorCnt++; }
+
+  int v = 0;
+  gc<ImageNode> next;
+  gc<int> val;
+};
+TGC_TRACE(ImageNode, next, val)
+
+namespace tgc2::details {
+template <>
+struct is_gc_image_safe<ImageNode> : true_type {};
+}  // namespace tgc2::details
+
+void testHeapImage() {
+  const char* path = "tgc2_test.img";
+  gc_collector()->fullCollect();
+  auto& heap = gc_collector()->getHeap();
+  auto usedBefore = heap.getStats().usedBytes;
+  auto oldGenBefore = gc_collector()->getOldGenSize();
+  // the int array and boxes, held in the nodes with TGC_IMMEDIATE_BOXES.
+  const size_t intObjs = TGC_IMMEDIATE_BOXES ? 0 : 1000;
+
+  imageDctorCnt = 0;
+  {
+    // a chain ending in an array that refers back to its head, and a large
+    // array of ints.
+    auto root = gc_new<ImageNode>();
+    root->v = -1;
+#if TGC_IMMEDIATE_BOXES
+    root->val = -2;
+#else
+    root->val = gc_new_array<int>(100000);
+    for (int i = 0; i < 100000; i++)
+      (&*root->val)[i] = i;
+#endif
+    auto n = root->next = gc_new<ImageNode>();
+    for (int i = 1; i < 1000; i++) {
+      n = n->next = gc_new<ImageNode>();
+      n->v = i;
+      n->val = gc_new<int>(i * 2);
+    }
+    auto arr = n->next = gc_new_array<ImageNode>(3);
+    (&*arr)[2].next = root->next;
+    auto saved = gc_save_image(path, root);
+    auto unsafeSaved = gc_save_image(path, gc_new<TracedNode>());
+    assert(saved && !unsafeSaved);
+  }
+  gc_collector()->fullCollect();
+  assert_freed(imageDctorCnt == 1004);
+
+  assert(!gc_load_image<ImageNode>("no such file"));
+  assert(!gc_load_image<TracedPair>(path));
+  auto root = gc_load_image<ImageNode>(path);
+  remove(path);
+  assert(root && root->v == -1);
+#if TGC_IMMEDIATE_BOXES
+  assert(*root->val == -2);
+#else
+  assert((&*root->val)[99999] == 99999);
+#endif
+  assert(gc_collector()->getOldGenSize() == oldGenBefore + 1002 + intObjs);
+
+  // loaded objects are old, so young ones are kept by the barrier.
+  root->next->val = gc_new<int>(7);
+  for (int i = 0; i < 3; i++)
+    gc_collector()->minorCollect();
+  gc_collector()->fullCollect();
+  assert(*root->next->val == 7);
+  auto n = root->next;
+  for (int i = 1; i < 1000; i++) {
+    n = n->next;
+    assert(n->v == i && *n->val == i * 2);
+  }
+  assert((&*n->next)[2].next == root->next);
+
+  imageDctorCnt = 0;
+  root = nullptr;
+  n = nullptr;
+  gc_collector()->fullCollect();
+  assert_freed(imageDctorCnt == 1004);
+  assert_freed(heap.getStats().usedBytes == usedBefore);
+}
+
+void testFreeze() {
+  static int dctorCnt = 0;
+  struct Node {
+    gc<Node> next;
+    gc<Node> extra;
+    gc<int> val;
+    ~Node() { dctorCnt++; }
+  };
+  gc_collector()->fullCollect();
+  auto genSize = [] {
+    return gc_collector()->getNewGenSize() + gc_collector()->getOldGenSize();
+  };
+  auto sizeBefore = genSize();
+  auto& heap = gc_collector()->getHeap();
+  auto usedBefore = heap.getStats().usedBytes;
+
+  auto head = gc_new<Node>();
+  auto n = head;
+  for (int i = 0; i < 100; i++) {
+    n->val = gc_new<int>(i);
+    n = n->next = gc_new<Node>();
+  }
+  auto list = gc_new_vector<Node>();
+  list->push_back(head);
+  gc_collector()->minorCollect();
+#if TGC_THREADS && !TGC_IMMEDIATE_BOXES
+  // the ints are not leaves with threads.
+  const size_t frozenCnt = 202;
+#else
+  const size_t frozenCnt = 102;
+#endif
+  assert(gc_freeze(list) == frozenCnt);
+  assert(gc_freeze(head) == 0);
+  assert(gc_collector()->getFrozenSize() == frozenCnt);
+  assert_freed(genSize() == sizeBefore);
+
+  // the young objects stored into them are kept by the barrier.
+  head->next->extra = gc_new<Node>();
+  head->next->extra->val = gc_new<int>(-1);
+  head->val = gc_new<int>(-2);
+  list->push_back(gc_new<Node>());
+
+  // kept without being referenced, and not walked.
+  list = nullptr;
+  n = nullptr;
+  dctorCnt = 0;
+  for (int i = 0; i < 3; i++)
+    gc_collector()->minorCollect();
+  gc_collector()->fullCollect();
+  assert(dctorCnt == 0);
+  assert(*head->next->val == 1);
+  assert(*head->next->extra->val == -1 && *head->val == -2);
+
+  assert(gc_thaw() == frozenCnt);
+  assert(gc_collector()->getFrozenSize() == 0);
+  head = nullptr;
+  gc_collector()->fullCollect();
+  assert_freed(dctorCnt == 103);
+  assert_freed(genSize() == sizeBefore);
+  assert_freed(heap.getStats().usedBytes == usedBefore);
+}
+
+void testMixedGc() {
+#if TGC_MIXED_GC
+  static int dctorCnt = 0;
+  struct Node {
+    gc<Node> next;
+    int v = 0;
+    char pad[1000];
+    ~Node() { dctorCnt++; }
+  };
+  auto* c = gc_collector();
+  auto promote = [c] {
+    for (int i = 0; i < TGC_TENURE_SCANS; i++)
+      c->minorCollect();
+  };
+  c->fullCollect();
+  auto oldBefore = c->getOldGenSize();
+  assert(c->getOldGenGrowth() == 0);
+
+  // some MB of old nodes, so over many regions.
+  const int n = 4000;
+  auto nodes = gc_new_vector<Node>();
+  for (int i = 0; i < n; i++) {
+    nodes->push_back(gc_new<Node>());
+    nodes->back()->v = i;
+  }
+  auto garbage = gc_new_vector<Node>();
+  for (int i = 0; i < 1000; i++)
+    garbage->push_back(gc_new<Node>());
+  auto lone = gc_new<Node>();
+  promote();
+  assert(c->getOldGenGrowth() >= n + 1000);
+  details::GcCondition_ObjCnt cond;
+  cond.oldGenObjCntToFullGc = n;
+  assert(cond.needMixedGc(c) && !cond.needFullGc(c));
+
+  // the odd ones are then only kept by the even ones, old to old pointers
+  // written by the barrier, or a young one that is promoted later.
+  for (int i = 0; i < n; i += 2)
+    (*nodes)[i]->next = (*nodes)[(i + 1 + n / 2) % n];
+  (*nodes)[0]->next->next = gc_new<Node>();
+  (*nodes)[0]->next->next->v = -1;
+  promote();
+  for (int i = 1; i < n; i += 2)
+    (*nodes)[i] = nullptr;
+  garbage = nullptr;
+  // freed without a gc, it leaves its region.
+  gc_delete(lone);
+
+  // one region a gc, the others keep what they point to.
+  dctorCnt = 0;
+  c->setMixedGcBudget(1);
+  auto mixedGcs = c->getMixedGcCount();
+  for (int i = 0; i < 64; i++)
+    c->mixedCollect();
+  assert(c->getMixedGcCount() == mixedGcs + 64);
+  assert_freed(dctorCnt == 1000);
+  for (int i = 0; i < n; i += 2)
+    assert((*nodes)[i]->next->v == (i + 1 + n / 2) % n);
+  assert((*nodes)[0]->next->next->v == -1);
+  assert_freed(c->getOldGenSize() == oldBefore + n + 2);
+
+  nodes = nullptr;
+  c->setMixedGcBudget(size_t(4) << 20);
+  c->fullCollect();
+  assert_freed(dctorCnt == 1000 + n + 1);
+  assert_freed(c->getOldGenSize() == oldBefore);
+#endif
+}
+
+void testThreads() {
+#if TGC_THREADS
+  static atomic<int> dctorCnt{0};
+  struct Node {
+    int v;
+    gc<Node> next;
+    Node(int i) : v(i) {}
+    ~Node() { dctorCnt++; }
+  };
+  auto* c = gc_collector();
+  c->fullCollect();
+  dctorCnt = 0;
+  auto shared = gc_new<Node>(-1);
+  for (int i = 0; i < TGC_TENURE_SCANS; i++)
+    c->minorCollect();
+  auto minorGcs = c->getMinorGcCount();
+
+  // lists built by the workers, with garbage in between, handed over to
+  // this thread.
+  const int threadCnt = 4, len = 20000;
+  vector<gc<Node>> lists(threadCnt);
+  mutex lock;
+  vector<thread> workers;
+  for (int t = 0; t < threadCnt; t++) {
+    workers.emplace_back([&, t] {
+      gc<Node> head;
+      for (int i = 0; i < len; i++) {
+        auto n = gc_new<Node>(i);
+        n->next = head;
+        head = n;
+        gc_new<Node>(0);
+        if (i % 1000 == 0)
+          gc_safepoint();
+      }
+      if (t == 0)
+        c->fullCollect();
+      {
+        // the holder of the lock may be parked by a gc.
+        gc_blocking_region blocking;
+        lock.lock();
+      }
+      shared->next = head;
+      lock.unlock();
+      lists[t] = head;
+    });
+  }
+  {
+    gc_blocking_region blocking;
+    for (auto& w : workers)
+      w.join();
+  }
+  assert(c->getThreadCount() == 1);
+  assert(c->getMinorGcCount() > minorGcs);
+
+  c->fullCollect();
+  assert(dctorCnt == threadCnt * len);
+  for (auto& head : lists) {
+    int i = len;
+    for (auto n = head; n; n = n->next)
+      assert(n->v == --i);
+    assert(i == 0);
+  }
+  assert(shared->next->v == len - 1);
+  lists.clear();
+  shared->next = nullptr;
+  c->fullCollect();
+  assert(dctorCnt == threadCnt * len * 2);
+
+  // a thread in a blocking region may still run gcs, the others stop for
+  // them.
+  atomic<bool> done{false};
+  thread worker([&] {
+    gc<Node> head;
+    for (int i = 0; i < len; i++) {
+      auto n = gc_new<Node>(i);
+      n->next = head;
+      head = n;
+    }
+    int i = len;
+    for (auto n = head; n; n = n->next)
+      assert(n->v == --i);
+    assert(i == 0);
+    done = true;
+  });
+  {
+    gc_blocking_region blocking;
+    while (!done)
+      c->fullCollect();
+    worker.join();
+  }
+  c->fullCollect();
+  assert(dctorCnt == threadCnt * len * 2 + len);
+#endif
+}
+
+struct RcValue {
+  static int dctorCnt;
+  gc<int> v;
+  gc_string name;
+  ~RcValue() { dctorCnt++; }
+};
+int RcValue::dctorCnt = 0;
+// its gc pointers point to leaf classes, so it is acyclic.
+TGC_TRACE(RcValue, v, name)
+
+void testHybridRc() {
+#if TGC_HYBRID_RC
+  struct Node {
+    gc<Node> next;
+    gc<RcValue> val;
+  };
+  auto* c = gc_collector();
+  auto& heap = c->getHeap();
+  c->fullCollect();
+  auto used = heap.getStats().usedBytes;
+  RcValue::dctorCnt = 0;
+
+  // freed once the releases are applied, without a gc.
+  {
+    auto a = gc_new<RcValue>();
+    a->v = gc_new<int>(1);
+    a->name = string("rc");
+    auto b = a;
+    auto moved = std::move(b);
+  }
+  c->flushReleases();
+  assert(RcValue::dctorCnt == 1);
+  assert(heap.getStats().usedBytes == used);
+
+  // kept by a container and by a cyclic object.
+  auto vec = gc_new_vector<int>();
+  vec->push_back(gc_new<int>(2));
+  auto n = gc_new<Node>();
+  n->val = gc_new<RcValue>();
+  c->flushReleases();
+  assert(RcValue::dctorCnt == 1 && *(*vec)[0] == 2);
+
+  // the cycle is left to the gc, which releases what it holds.
+  n->next = n;
+  n = nullptr;
+  c->flushReleases();
+  assert(RcValue::dctorCnt == 1);
+  c->fullCollect();
+  assert(RcValue::dctorCnt == 2);
+
+  // deleted ones are freed once.
+  auto d = gc_new<RcValue>();
+  gc_delete(d);
+  c->flushReleases();
+  assert(RcValue::dctorCnt == 3);
+
+  // the dead ones of a region go with it.
+  {
+    gc_region region;
+    gc_new<RcValue>();
+  }
+  c->flushReleases();
+  assert(RcValue::dctorCnt == 4);
+  vec = nullptr;
+  c->fullCollect();
+  assert(heap.getStats().usedBytes == used);
+#endif
+}
+
+void testIString() {
+  gc_collector()->fullCollect();
+#if TGC_STRING_DEDUP
+  auto before = gc_collector()->getStringStats();
+#endif
+  gc_istring a = "content-type";
+  gc_istring b = string("content-type");
+  gc_istring c = "accept";
+  assert(*a == *b && *a != *c);
+  assert(a->data() != b->data());
+  assert(a->view() == "content-type" && !strcmp(c->c_str(), "accept"));
+  // copies share the characters.
+  istring copy = *c;
+  assert(copy.data() == c->data());
+
+  for (int i = 0; i < TGC_TENURE_SCANS; i++)
+    gc_collector()->minorCollect();
+#if TGC_STRING_DEDUP
+  // promoted, the duplicates share one buffer.
+  assert(a->data() == b->data());
+  assert(c->data() == copy.data());
+  auto st = gc_collector()->getStringStats();
+  assert(st.strings == before.strings + 2);
+  assert(st.savedBytes > before.savedBytes);
+#endif
+  assert(b->view() == "content-type");
+
+  // the interned ones outlive the objects holding them.
+  a = b = c = nullptr;
+  gc_collector()->fullCollect();
+  assert(copy == istring("accept"));
+#if TGC_STRING_DEDUP
+  assert_freed(gc_collector()->getStringStats().strings == before.strings + 1);
+#endif
+}
+
+void testRecorder() {
+#if TGC_RECORDER
+  // not freed by the reference counts either.
+  struct Node {
+    gc<Node> next;
+  };
+  auto& rec = gc_collector()->getRecorder();
+  rec.start(1024);
+  rec.clear();
+  gc_collector()->minorCollect();
+  gc_new<Node>();
+  gc_collector()->fullCollect();
+  rec.stop();
+  gc_collector()->minorCollect();
+
+  // nested begins and ends, in order.
+  auto es = rec.events();
+  assert(es.size() && es.front().begin);
+  assert(es.front().name == string("minor gc"));
+  assert(es.back().name == string("full gc"));
+  assert_freed(es.back().objs >= 1);
+  vector<const char*> open;
+  for (size_t i = 0; i < es.size(); i++) {
+    assert(!i || es[i - 1].time <= es[i].time);
+    if (es[i].begin) {
+      open.push_back(es[i].name);
+    } else {
+      assert(open.size() && open.back() == string(es[i].name));
+      open.pop_back();
+    }
+  }
+  assert(open.empty());
+
+  // only the last ones are kept.
+  rec.start(8);
+  for (int i = 0; i < 3; i++)
+    gc_collector()->minorCollect();
+  rec.stop();
+  assert(rec.events().size() == 8);
+
+  rec.start(1024);
+  gc_collector()->fullCollect();
+  rec.stop();
+  const char* path = "tgc2_test.json";
+  assert(rec.writeChromeTrace(path));
+  string json;
+  if (auto* f = fopen(path, "r")) {
+    for (int c; (c = fgetc(f)) != EOF;)
+      json += char(c);
+    fclose(f);
+  }
+  remove(path);
+  assert(json.find("{\"traceEvents\":[") == 0);
+  assert(json.find("\"name\":\"full gc\"") != string::npos);
+  assert(json.find("\"args\":{\"objects\":") != string::npos);
+  path = "tgc2_test.pftrace";
+  assert(rec.writePerfetto(path));
+  if (auto* f = fopen(path, "rb")) {
+    // the first field of the first packet.
+    assert(fgetc(f) == 0x0a);
+    fclose(f);
+  }
+  remove(path);
+#endif
+}
+
+void testAllocTrace() {
+#if TGC_ALLOC_TRACE
+  struct Node {
+    gc<Node> next;
+  };
+  const char* path = "tgc2_test.trc";
+  auto& trace = gc_collector()->getTrace();
+  assert(trace.start(path));
+  {
+    auto a = gc_new<Node>();
+    a->next = gc_new<Node>();
+    auto s = gc_new<int>(1);
+    gc_collector()->minorCollect();
+  }
+  gc_collector()->fullCollect();
+  assert(trace.stop());
+  assert(!trace.isRecording());
+
+  using Kind = details::GcTrace::Kind;
+  vector<details::GcTrace::Record> rs;
+  bool magic = false;
+  if (auto* f = fopen(path, "rb")) {
+    char m[sizeof(details::GcTrace::Magic)];
+    magic = fread(m, sizeof(m), 1, f) == 1 &&
+            !memcmp(m, details::GcTrace::Magic, sizeof(m));
+    details::GcTrace::Record r;
+    while (fread(&r, sizeof(r), 1, f) == 1)
+      rs.push_back(r);
+    fclose(f);
+  }
+  remove(path);
+  assert(magic);
+  auto count = [&](Kind k) {
+    return count_if(rs.begin(), rs.end(), [&](auto& r) { return r.kind == k; });
+  };
+  assert(count(Kind::Alloc) + count(Kind::AllocLeaf) == 3);
+  // the local, the member and the leaf one.
+  assert(count(Kind::Store) >= 3);
+  assert(count(Kind::Drop) >= 3);
+  assert(count(Kind::MinorGc) == 1 && count(Kind::FullGc) == 1);
+  // the nodes, the leaf one is freed by its bitmap.
+  assert_freed(count(Kind::Free) == 2);
+  // the member points at the second node.
+  auto second = find_if(rs.begin(), rs.end(), [](auto& r) {
+    return r.kind == Kind::Alloc;
+  });
+  assert(second != rs.end());
+  second = find_if(second + 1, rs.end(),
+                   [](auto& r) { return r.kind == Kind::Alloc; });
+  assert(find_if(rs.begin(), rs.end(), [&](auto& r) {
+           return r.kind == Kind::Store && r.arg == second->id;
+         }) != rs.end());
+  for (size_t i = 1; i < rs.size(); i++)
+    assert(rs[i - 1].time <= rs[i].time);
+
+#ifdef __linux__
+  // a failed write ends the trace.
+  if (trace.start("/dev/full")) {
+    for (int i = 0; i < 64 * 1024 && trace.isRecording(); i++)
+      gc_new<int>(i);
+    assert(!trace.isRecording());
+    assert(!trace.stop());
+  }
+#endif
+#endif
+}
+
+void testBatch() {
+  static int ctorCnt = 0, dctorCnt = 0;
+  struct Node {
+    Node(int v) : v(v) { ctorCnt++; }
+    ~Node() { dctorCnt++; }
+    int v;
+    gc<Node> next;
+  };
+
+  int cnt = 1000;
+  {
+    auto nodes = gc_new_batch<Node>(cnt, 7);
+    assert(ctorCnt == cnt);
+    for (int i = 0; i < cnt; i++) {
+      assert(nodes[i]->v == 7);
+      nodes[i]->next = nodes[(i + 1) % cnt];
+    }
+    gc_collector()->fullCollect();
+    assert(dctorCnt == 0);
+    // every object dies on its own.
+    nodes.resize(1);
+    nodes[0]->next = nullptr;
+    gc_collector()->fullCollect();
+    assert_freed(dctorCnt == cnt - 1);
+  }
+  gc_collector()->fullCollect();
+  assert_freed(dctorCnt == cnt);
+}
+
+void testLeaf() {
+#if !TGC_THREADS
+  // no leaf space with threads.
+  static int dctorCnt = 0;
+  struct Leaf {
+    int v;
+    Leaf(int i) : v(i) {}
+    ~Leaf() { dctorCnt++; }
+  };
+  struct Holder {
+    gc<Leaf> leaf;
+    gc<int> i;
+  };
+
+  gc_collector()->fullCollect();
+  auto& heap = gc_collector()->getHeap();
+  auto leafBefore = heap.getLeafCount();
+  auto newGenBefore = gc_collector()->getNewGenSize();
+
+  gc_int i = 1;
+  gc_string str = string("leaf");
+  auto arr = gc_new_array<char>(10);
+  auto holder = gc_new<Holder>();
+#if TGC_IMMEDIATE_BOXES
+  // held in place, not in the leaf space.
+  const size_t intObjs = 0;
+#else
+  const size_t intObjs = 1;
+  assert(i.getMeta()->isLeaf);
+#endif
+  assert(str.getMeta()->isLeaf && arr.getMeta()->isLeaf);
+  assert(!holder.getMeta()->isLeaf);
+  assert(heap.getLeafCount() == leafBefore + 2 + intObjs);
+  assert(gc_collector()->getNewGenSize() == newGenBefore + 1);
+
+  // kept through an old object.
+  dctorCnt = 0;
+  for (int n = 0; n < 3; n++)
+    gc_collector()->minorCollect();
+  holder->leaf = gc_new<Leaf>(1);
+  holder->i = gc_new<int>(2);
+  for (int n = 0; n < 3; n++) {
+    gc_collector()->minorCollect();
+    gc_new<Leaf>(0);
+  }
+  assert_freed(dctorCnt == 2);
+  gc_collector()->fullCollect();
+  assert_freed(dctorCnt == 3);
+  assert(holder->leaf->v == 1 && *holder->i == 2);
+  assert(*i == 1 && (string&)str == "leaf");
+
+  holder = nullptr;
+  i = nullptr;
+  str = nullptr;
+  arr = nullptr;
+  gc_collector()->fullCollect();
+  assert_freed(dctorCnt == 4);
+  assert_freed(heap.getLeafCount() == leafBefore);
+
+  // old after TGC_TENURE_SCANS minor gcs, like the other objects.
+  dctorCnt = 0;
+  auto young = gc_new<Leaf>(0);
+  auto old = gc_new<Leaf>(1);
+  for (int n = 0; n < TGC_TENURE_SCANS - 1; n++)
+    gc_collector()->minorCollect();
+  young = nullptr;
+  gc_collector()->minorCollect();
+  assert_freed(dctorCnt == 1);
+  old = nullptr;
+  gc_collector()->minorCollect();
+  // the counts free it at once.
+  assert_freed(dctorCnt == (TGC_HYBRID_RC ? 2 : 1));
+  gc_collector()->fullCollect();
+  assert_freed(dctorCnt == 2);
+#endif
+}
+
+#if TGC_COROUTINES
+static int taskNodeDctorCnt = 0;
+
+struct TaskNode {
+  int v;
+  gc<TaskNode> next;
+  gc_task<int> task;
+  TaskNode(int i) : v(i) {}
+  ~TaskNode() { taskNodeDctorCnt++; }
+};
+
+static vector<gc_resumer> pendingTasks;
+
+gc_task<int> leafTask(int i) {
+  co_return i;
+}
+
+gc_task<int> sumTask(int n) {
+  int sum = 0;
+  for (int i = 0; i < n; i++)
+    sum += co_await leafTask(1);
+  co_return sum;
+}
+
+void leafCallback(int i, const gc_function<void(int)>& k) {
+  k(i);
+}
+
+gc_task<gc<TaskNode>> suspendedTask(int v) {
+  auto n = gc_new<TaskNode>(v);
+  co_await gc_suspend([](gc_resumer r) { pendingTasks.push_back(r); });
+  n->next = gc_new<TaskNode>(v + 1);
+  co_return n;
+}
+
+gc_task<int> awaitingTask(gc<TaskNode> n) {
+  auto r = co_await suspendedTask(n->v);
+  co_return r->v + r->next->v;
+}
+
+gc_task<> throwingTask() {
+  co_await leafTask(0);
+  throw 1;
+}
+
+gc_task<int> catchingTask() {
+  try {
+    co_await throwingTask();
+  } catch (int i) {
+    co_return i;
+  }
+  co_return 0;
+}
+#endif
+
+void testTask() {
+#if TGC_COROUTINES
+  auto t = sumTask(100);
+  assert(!t.done());
+  t.resume();
+  assert(t.done() && t.result() == 100);
+
+  // locals of suspended frames are kept.
+  taskNodeDctorCnt = 0;
+  auto a = awaitingTask(gc_new<TaskNode>(1));
+  a.resume();
+  assert(!a.done() && pendingTasks.size() == 1);
+  gc_collector()->fullCollect();
+  assert(taskNodeDctorCnt == 0);
+  auto r = pendingTasks.back();
+  pendingTasks.clear();
+  r();
+  assert(a.done() && a.result() == 3);
+
+  // a suspended task referenced only by its own locals is reclaimed.
+  {
+    auto n = gc_new<TaskNode>(10);
+    n->task = awaitingTask(n);
+    n->task.resume();
+  }
+  pendingTasks.clear();
+  a = {};
+  t = {};
+  gc_collector()->fullCollect();
+  assert_freed(taskNodeDctorCnt == 5);
+
+  auto c = catchingTask();
+  c.resume();
+  assert(c.result() == 1);
+#endif
+}
+
+void testConservativeRoots() {
+  static int dctorCnt = 0;
+  struct Node {
+    int v;
+    gc<Node> next;
+    Node(int i) : v(i) {}
+    ~Node() { dctorCnt++; }
+  };
+
+  dctorCnt = 0;
+  auto a = gc_new<Node>(1);
+  a->next = gc_new<Node>(2);
+  gc_int i = 3;
+  auto large = gc_new_array<char>(128 * 1024);
+  (&*large)[64 * 1024] = 'x';
+  gc<Node> escaped;
+  {
+    gc_region region;
+    escaped = gc_new<Node>(4);
+  }
+#if TGC_CONSERVATIVE_ROOTS
+  // raw pointers to the inside of the objects keep them as well.
+  Node* raw = &*gc_new<Node>(5);
+  Node* rawInRegion;
+  {
+    gc_region region;
+    rawInRegion = &*gc_new<Node>(6);
+  }
+#endif
+  for (int n = 0; n < 3; n++)
+    gc_collector()->minorCollect();
+  gc_collector()->fullCollect();
+  assert(dctorCnt == 0);
+  assert(a->v == 1 && a->next->v == 2 && *i == 3 && escaped->v == 4);
+  assert((&*large)[64 * 1024] == 'x');
+#if TGC_CONSERVATIVE_ROOTS
+  assert(raw->v == 5 && rawInRegion->v == 6);
+#endif
+}
+
+void testRegion() {
+  static int dctorCnt = 0;
+  struct Node {
+    int v;
+    gc<Node> next;
+    Node(int i) : v(i) {}
+    ~Node() { dctorCnt++; }
+  };
+
+  gc_collector()->fullCollect();
+  auto& heap = gc_collector()->getHeap();
+  auto usedBefore = heap.getStats().usedBytes;
+  auto newGenBefore = gc_collector()->getNewGenSize();
+
+  // escapes through a heap object created before the region.
+  auto holder = gc_new<Node>(-1);
+  auto onHeap = gc_new<Node>(4);
+  gc<Node> escaped;
+  int cnt = 10000;
+  dctorCnt = 0;
+  {
+    gc_region region;
+    gc<Node> head;
+    for (int i = 0; i < cnt; i++) {
+      auto n = gc_new<Node>(i);
+      n->next = head;
+      head = n;
+    }
+    // a cycle that dies with the region.
+    auto a = gc_new<Node>(0), b = gc_new<Node>(0);
+    a->next = b;
+    b->next = a;
+
+    escaped = gc_new<Node>(1);
+    escaped->next = gc_new<Node>(2);
+    holder->next = gc_new<Node>(3);
+    assert(gc_collector()->getNewGenSize() == newGenBefore + 2);
+
+    // heap objects are kept by the region objects during a gc.
+    gc<Node> r;
+    {
+      gc_region nested;
+      r = gc_new<Node>(0);
+    }
+    r->next = onHeap;
+    onHeap = nullptr;
+    gc_collector()->fullCollect();
+    gc_collect();
+    assert(r->next->v == 4);
+  }
+  assert_freed(dctorCnt == cnt + 3);
+  assert(escaped->v == 1 && escaped->next->v == 2);
+  assert(holder->next->v == 3);
+
+  gc_collector()->fullCollect();
+  assert(escaped->next->v == 2);
+  escaped = nullptr;
+  holder = nullptr;
+  gc_collector()->fullCollect();
+  assert_freed(dctorCnt == cnt + 3 + 5);
+  assert_freed(heap.getStats().usedBytes == usedBefore);
+}
+
 const int profilingCounts = 1024 * 1024;
 
 auto profiled = [](const char* tag, auto cb) {
@@ -356,6 +1758,40 @@ auto profiled = [](const char* tag, auto cb) {
   printf("[%10s] elapsed time: %fs\n", tag, elapsed_seconds.count());
 };
 
+// the seconds one call of cb takes.
+auto elapsed = [](auto cb) {
+  auto start = std::chrono::high_resolution_clock::now();
+  cb();
+  auto end = std::chrono::high_resolution_clock::now();
+  std::chrono::duration<double> elapsed_seconds = end - start;
+  return elapsed_seconds.count();
+};
+
+auto profiledOnce = [](const char* tag, auto cb) {
+  printf("[%10s] elapsed time: %fs\n", tag, elapsed(cb));
+};
+
+void profileTask() {
+#if TGC_COROUTINES && !defined(_DEBUG)
+  gc_collector()->fullCollect();
+  profiledOnce("callback", [] {
+    gc<TaskNode> sum = gc_new<TaskNode>(0);
+    for (int i = 0; i < profilingCounts; i++) {
+      gc_function<void(int)> k = [sum](int v) { sum->v += v; };
+      leafCallback(1, k);
+    }
+    assert(sum->v == profilingCounts);
+  });
+  gc_collector()->fullCollect();
+  profiledOnce("await", [] {
+    auto t = sumTask(profilingCounts);
+    t.resume();
+    assert(t.result() == profilingCounts);
+  });
+  gc_collector()->fullCollect();
+#endif
+}
+
 void profileAlloc() {
 #ifndef _DEBUG
   vector<int*> rawPtrs;
@@ -368,8 +1804,445 @@ void profileAlloc() {
 #endif
 }
 
+void profileLocalPtrs() {
+#ifndef _DEBUG
+  auto p = gc_new<int>(111);
+  int* volatile raw = &*p;
+  // immediate boxes are plain values, nothing to time.
+#if !TGC_IMMEDIATE_BOXES
+  profiled("gc copy", [&] { gc<int> q = p; });
+  profiled("gc move", [&] {
+    gc<int> q = p;
+    gc<int> r = std::move(q);
+  });
+  profiled("gc_ref copy", [&] {
+    volatile gc_ref<int> q = p;
+    (void)q;
+  });
+#endif
+  profiled("raw copy", [&] {
+    int* volatile q = raw;
+    (void)q;
+  });
+  gc_collector()->fullCollect();
+#endif
+}
+
+void profileBarrier() {
+#ifndef _DEBUG
+  struct Node {
+    gc<Node> next;
+  };
+  auto a = gc_new<Node>();
+  auto b = gc_new<Node>();
+  // fields count as roots until a gc sees their owner.
+  gc_collector()->minorCollect();
+  profiled("young write", [&] { a->next = b; });
+  for (int i = 0; i < 2; i++)
+    gc_collector()->minorCollect();
+  profiled("old write", [&] { a->next = b; });
+  gc_collector()->fullCollect();
+#endif
+}
+
+void profilePtrRun() {
+#ifndef _DEBUG
+  struct Node {
+    gc<Node> next;
+  };
+  // full gcs over dense slots, a quarter of them set, all to a few targets.
+  // The vector is scanned in runs and the deque slot by slot.
+  auto profiledEdges = [](const char* tag, size_t edges) {
+    gc_collector()->fullCollect();
+    auto secs = elapsed([] {
+      for (int i = 0; i < 100; i++)
+        gc_collector()->fullCollect();
+    });
+    printf("[%10s] %.1fM edges/s\n", tag, edges * 100 / secs / 1e6);
+  };
+  int cnt = profilingCounts / 16;
+  vector<gc<Node>> targets;
+  for (int i = 0; i < 1024; i++)
+    targets.push_back(gc_new<Node>());
+  {
+    auto v = gc_new_vector<Node>(cnt);
+    for (int i = 0; i < cnt; i += 4)
+      (*v)[i] = targets[i % 1024];
+    profiledEdges("vector", cnt / 4);
+  }
+  {
+    auto d = gc_new_deque<Node>(cnt);
+    for (int i = 0; i < cnt; i += 4)
+      (*d)[i] = targets[i % 1024];
+    profiledEdges("deque", cnt / 4);
+  }
+  targets.clear();
+  gc_collector()->fullCollect();
+#endif
+}
+
+void profileContainerFill() {
+#ifndef _DEBUG
+  // the same pushes into std and gc_allocator storage, gcs included.
+  auto t = gc_new<int>(1);
+  profiledOnce("std vector", [&] {
+    auto v = gc_new<vector<gc<int>>>();
+    for (int i = 0; i < profilingCounts; i++)
+      v->push_back(t);
+    gc_collector()->fullCollect();
+  });
+  profiledOnce("gc vector", [&] {
+    auto v = gc_new_vector<int>();
+    for (int i = 0; i < profilingCounts; i++)
+      v->push_back(t);
+    gc_collector()->fullCollect();
+  });
+  profiledOnce("std map", [&] {
+    auto m = gc_new<map<int, gc<int>>>();
+    for (int i = 0; i < profilingCounts / 4; i++)
+      m->emplace(i, t);
+    gc_collector()->fullCollect();
+  });
+  profiledOnce("gc map", [&] {
+    auto m = gc_new_map<int, int>();
+    for (int i = 0; i < profilingCounts / 4; i++)
+      m->emplace(i, t);
+    gc_collector()->fullCollect();
+  });
+  gc_collector()->fullCollect();
+#endif
+}
+
+void profileBatchAlloc() {
+#ifndef _DEBUG
+  struct Node {
+    gc<Node> next;
+    int v = 0;
+  };
+  profiledOnce("gc_new", [] {
+    vector<gc<Node>> nodes;
+    nodes.reserve(profilingCounts);
+    for (int i = 0; i < profilingCounts; i++)
+      nodes.push_back(gc_new<Node>());
+  });
+  gc_collector()->fullCollect();
+  profiledOnce("batch",
+               [] { auto nodes = gc_new_batch<Node>(profilingCounts); });
+  gc_collector()->fullCollect();
+#endif
+}
+
+void profileFlatHashMap() {
+#ifndef _DEBUG
+  // pseudo random keys, so that neither table gets sequential access.
+  vector<int> keys(profilingCounts);
+  unsigned seed = 1;
+  for (auto& k : keys)
+    k = int((seed = seed * 1103515245 + 12345) >> 1);
+  auto bench = [&](const char* name, auto m) {
+    auto v = gc_new<int>(1);
+    char tag[32];
+    snprintf(tag, sizeof(tag), "%s ins", name);
+    profiledOnce(tag, [&] {
+      for (auto k : keys)
+        m[k] = v;
+    });
+    snprintf(tag, sizeof(tag), "%s get", name);
+    profiledOnce(tag, [&] {
+      size_t found = 0;
+      for (auto k : keys)
+        found += m->count(k) + m->count(~k);
+      assert(found == keys.size());
+    });
+    snprintf(tag, sizeof(tag), "%s gc", name);
+    profiledOnce(tag, [&] { gc_collector()->fullCollect(); });
+  };
+  bench("hash", gc_new_unordered_map<int, int>());
+  gc_collector()->fullCollect();
+  bench("flat", gc_new_flat_hash_map<int, int>());
+  gc_collector()->fullCollect();
+#endif
+}
+
+void profileRegion() {
+#ifndef _DEBUG
+  struct Node {
+    gc<Node> next;
+    int v = 0;
+  };
+  // requests that allocate a list and drop it.
+  auto request = [] {
+    gc<Node> head;
+    for (int i = 0; i < 1000; i++) {
+      auto n = gc_new<Node>();
+      n->next = head;
+      head = n;
+    }
+  };
+  auto cnt = profilingCounts / 1000;
+  profiledOnce("no region", [&] {
+    for (int i = 0; i < cnt; i++)
+      request();
+    gc_collector()->fullCollect();
+  });
+  profiledOnce("region", [&] {
+    for (int i = 0; i < cnt; i++) {
+      gc_region r;
+      request();
+    }
+    gc_collector()->fullCollect();
+  });
+#endif
+}
+
+void profileLeaf() {
+#ifndef _DEBUG
+  gc_collector()->fullCollect();
+  {
+    // boxed values and strings held by a gc container.
+    auto ints = gc_new_vector<int>();
+    auto strs = gc_new_vector<string>();
+    profiledOnce("leaf alloc", [&] {
+      for (int i = 0; i < profilingCounts; i++)
+        ints->push_back(gc_new<int>(i));
+      for (int i = 0; i < profilingCounts / 4; i++)
+        strs->push_back(gc_new<string>("leaf"));
+    });
+    profiledOnce("leaf gc", [&] {
+      for (int i = 0; i < 10; i++) {
+        gc_collector()->minorCollect();
+        gc_collector()->fullCollect();
+      }
+    });
+  }
+  gc_collector()->fullCollect();
+#endif
+}
+
+void profileHeapImage() {
+#ifndef _DEBUG
+  const char* path = "tgc2_profile.img";
+  gc<ImageNode> root;
+  profiledOnce("build", [&] {
+    root = gc_new<ImageNode>();
+    auto n = root;
+    for (int i = 0; i < profilingCounts; i++) {
+      n = n->next = gc_new<ImageNode>();
+      n->v = i;
+    }
+  });
+  gc_save_image(path, root);
+  root = nullptr;
+  gc_collector()->fullCollect();
+  profiledOnce("load", [&] {
+    root = gc_load_image<ImageNode>(path);
+    assert(root);
+  });
+  remove(path);
+  root = nullptr;
+  gc_collector()->fullCollect();
+#endif
+}
+
+void profileFreeze() {
+#ifndef _DEBUG
+  struct Node {
+    gc<Node> next;
+    gc<int> v;
+  };
+  // reference data built once, then full gcs over a small mutable part.
+  auto root = gc_new<Node>();
+  auto n = root;
+  for (int i = 0; i < profilingCounts; i++) {
+    n = n->next = gc_new<Node>();
+    n->v = gc_new<int>(i);
+  }
+  n = nullptr;
+  auto fullGcs = [] {
+    for (int i = 0; i < 10; i++) {
+      auto v = gc_new_vector<int>();
+      for (int j = 0; j < 1000; j++)
+        v->push_back(gc_new<int>(j));
+      gc_collector()->fullCollect();
+    }
+  };
+  gc_collector()->fullCollect();
+  profiledOnce("full gc", fullGcs);
+  gc_freeze(root);
+  profiledOnce("frozen gc", fullGcs);
+  gc_thaw();
+  root = nullptr;
+  gc_collector()->fullCollect();
+#endif
+}
+
+void profileMixedGc() {
+#ifndef _DEBUG
+#if TGC_MIXED_GC
+  struct Node {
+    gc<Node> next;
+    gc<int> v;
+  };
+  auto* c = gc_collector();
+  // a long lived table, a slice of it replaced between the gcs.
+  auto table = gc_new_vector<Node>();
+  for (int i = 0; i < profilingCounts; i++)
+    table->push_back(gc_new<Node>());
+  auto pauses = [&](const char* tag, auto collect) {
+    double total = 0, most = 0;
+    for (int r = 0; r < 10; r++) {
+      for (int i = 0; i < profilingCounts / 100; i++)
+        (*table)[(r * 7919 + i * 104729) % profilingCounts] = gc_new<Node>();
+      for (int i = 0; i < TGC_TENURE_SCANS; i++)
+        c->minorCollect();
+      auto secs = elapsed(collect);
+      total += secs;
+      most = max(most, secs);
+    }
+    printf("[%10s] elapsed time: %fs, longest pause: %fs\n", tag, total, most);
+  };
+  c->fullCollect();
+  pauses("full gcs", [c] { c->fullCollect(); });
+  pauses("mixed gcs", [c] { c->mixedCollect(); });
+  table = nullptr;
+  c->fullCollect();
+#endif
+#endif
+}
+
+void profileThreads() {
+#if TGC_THREADS && !defined(_DEBUG)
+  struct Node {
+    gc<Node> next;
+    int v = 0;
+  };
+  gc_collector()->fullCollect();
+  // the same allocations by each thread, short lists kept alive.
+  for (int threadCnt : {1, 2, 4}) {
+    auto secs = elapsed([threadCnt] {
+      vector<thread> workers;
+      for (int t = 0; t < threadCnt; t++) {
+        workers.emplace_back([] {
+          gc<Node> head;
+          for (int i = 0; i < profilingCounts; i++) {
+            auto n = gc_new<Node>();
+            n->next = i % 64 ? head : nullptr;
+            head = n;
+          }
+        });
+      }
+      gc_blocking_region blocking;
+      for (auto& w : workers)
+        w.join();
+    });
+    printf("[%d threads] elapsed time: %fs, %.1fM allocations/s\n", threadCnt,
+           secs, threadCnt * profilingCounts / secs / 1e6);
+  }
+  gc_collector()->fullCollect();
+#endif
+}
+
+void profileIString() {
+#ifndef _DEBUG
+  // header names repeated over many messages.
+  const char* names[] = {"content-type", "content-length", "accept-encoding",
+                         "x-request-id"};
+  auto v = gc_new_vector<istring>();
+  profiledOnce("istring", [&] {
+    for (int i = 0; i < profilingCounts; i++)
+      v->push_back(names[i % 4]);
+    for (int i = 0; i < TGC_TENURE_SCANS; i++)
+      gc_collector()->minorCollect();
+  });
+  auto st = gc_collector()->getStringStats();
+  printf("[%10s] %zu interned, %zuK saved\n", "istring", st.strings,
+         st.savedBytes / 1024);
+  // a stale word on the stack may keep the vector, not the strings.
+  v->clear();
+  v = nullptr;
+  gc_collector()->fullCollect();
+#endif
+}
+
+void profileRecorder() {
+#if TGC_RECORDER && !defined(_DEBUG)
+  // every minor gc walks the remembered set of the old objects, which stale
+  // words on the stack may have kept from the profiles above.
+  const int gcs = TGC_CONSERVATIVE_ROOTS ? 1000 : 100000;
+  auto collect = [&] {
+    for (int i = 0; i < gcs; i++) {
+      gc_new<int>(i);
+      gc_collector()->minorCollect();
+    }
+  };
+  auto& rec = gc_collector()->getRecorder();
+  profiledOnce("gc", collect);
+  rec.start();
+  profiledOnce("gc rec", collect);
+  rec.stop();
+#endif
+}
+
+void profileHybridRc() {
+#ifndef _DEBUG
+  auto* c = gc_collector();
+#ifndef TGC_GC_CONDITION
+  c->setGcCondition(new details::GcCondition_ObjCnt);
+#endif
+  c->fullCollect();
+  auto minorGcs = c->getMinorGcCount();
+  profiled("temp values", [] {
+    auto v = gc_new<RcValue>();
+    v->v = gc_new<int>(1);
+  });
+  printf("[%10s] minor gc cnt: %d\n", "temp values",
+         c->getMinorGcCount() - minorGcs);
+#ifndef TGC_GC_CONDITION
+  c->setGcCondition(new details::GcCondition_Time);
+#endif
+  c->fullCollect();
+#endif
+}
+
+void profileHeapSize() {
+#ifndef _DEBUG
+  struct Small {
+    int a = 0, b = 0;
+  };
+  gc_collector()->fullCollect();
+  auto& heap = gc_collector()->getHeap();
+  auto before = heap.getStats().usedBytes;
+  {
+    vector<gc<Small>> objs(profilingCounts);
+    for (auto& i : objs)
+      i = gc_new<Small>();
+    auto used = heap.getStats().usedBytes - before;
+    printf("[heap size ] %zu bytes per object of size %zu\n",
+           used / profilingCounts, sizeof(Small));
+  }
+  gc_collector()->fullCollect();
+#endif
+}
+
 int main() {
   profileAlloc();
+  profileLocalPtrs();
+  profileBarrier();
+  profilePtrRun();
+  profileContainerFill();
+  profileHeapSize();
+  profileHeapImage();
+  profileFreeze();
+  profileMixedGc();
+  profileThreads();
+  profileIString();
+  profileRecorder();
+  profileHybridRc();
+  profileLeaf();
+  profileBatchAlloc();
+  profileFlatHashMap();
+  profileRegion();
+  profileTask();
   testCollection();
   testException();
 
@@ -384,15 +2257,41 @@ int main() {
   testPointerCast();
 
   testMoveCtor();
+  testRef();
   testCirc();
   testArray();
+  testDelete();
 
   testContinusVector();
+  testPtrRun();
+  testAllocator();
   testContinusList();
+  testCollectInCtor();
+  testArrayDiscovery();
   testList();
   testDeque();
   testHashMap();
+  testFlatHashMap();
   testLambda();
+  testHeapRelease();
+  testHeapLimit();
+  testCompressedPtrs();
+  testImmediateBoxes();
+  testReusedPtrAddress();
+  testTrace();
+  testBatch();
+  testHeapImage();
+  testFreeze();
+  testMixedGc();
+  testThreads();
+  testIString();
+  testRecorder();
+  testAllocTrace();
+  testHybridRc();
+  testRegion();
+  testConservativeRoots();
+  testLeaf();
+  testTask();
 
   // there are some objects leaked from the upper tests, just dump them
   // out.
@@ -403,5 +2302,6 @@ int main() {
 
   // leaking test, you should not see leaks in the output of VS.
   auto i = gc_new<int>(100);
+  (void)i;
   return 0;
 }
@@ -1,19 +1,51 @@
 #include "tgc2.h"
 
 #include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+#include <thread>
+
+#ifdef _MSC_VER
+#include <csetjmp>
+#include <intrin.h>
+#endif
 
 #ifdef _WIN32
 #include <crtdbg.h>
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sys/mman.h>
+#endif
+
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define TGC_X64 1
+#include <immintrin.h>
 #endif
 
 namespace tgc2 {
 namespace details {
 
-int ClassMeta::isCreatingObj = 0;
+TGC_THREAD_LOCAL int ClassMeta::isCreatingObj = 0;
+ClassMeta** ClassMeta::classes = nullptr;
+#if TGC_ALLOC_HOOKS
 ClassMeta::Alloc ClassMeta::alloc = nullptr;
 ClassMeta::Dealloc ClassMeta::dealloc = nullptr;
+#endif
 Collector* Collector::inst = nullptr;
-vector<char*> IPtrEnumerator::buf;
+TGC_THREAD_LOCAL IPtrEnumerator::Pool IPtrEnumerator::buf;
+TGC_THREAD_LOCAL vector<ObjMeta*> Collector::creatingObjs;
+char* Heap::regionBase = nullptr;
+#if TGC_CONSERVATIVE_ROOTS
+char* Collector::stackLo = nullptr;
+char* Collector::stackHi = nullptr;
+#endif
 
 //////////////////////////////////////////////////////////////////////////
 
@@ -22,23 +54,116 @@ void vector_remove(C& c, typename C::value_type& v) {
   c.erase(remove(c.begin(), c.end(), v), c.end());
 }
 
+static unsigned countTrailingZeros(uint64_t v) {
+#ifdef _MSC_VER
+  unsigned long i;
+  _BitScanForward64(&i, v);
+  return (unsigned)i;
+#else
+  return (unsigned)__builtin_ctzll(v);
+#endif
+}
+
+static unsigned popCount(uint64_t v) {
+#ifdef _MSC_VER
+  return (unsigned)__popcnt64(v);
+#else
+  return (unsigned)__builtin_popcountll(v);
+#endif
+}
+
+#if TGC_CONSERVATIVE_ROOTS || TGC_THREADS
+static void getStackBounds(char*& lo, char*& hi) {
+#if defined(_WIN32)
+  ULONG_PTR l, h;
+  GetCurrentThreadStackLimits(&l, &h);
+  lo = (char*)l;
+  hi = (char*)h;
+#elif defined(__APPLE__)
+  hi = (char*)pthread_get_stackaddr_np(pthread_self());
+  lo = hi - pthread_get_stacksize_np(pthread_self());
+#else
+  pthread_attr_t attr;
+  void* addr = nullptr;
+  size_t sz = 0;
+  if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+    pthread_attr_getstack(&attr, &addr, &sz);
+    pthread_attr_destroy(&attr);
+  }
+  lo = (char*)addr;
+  hi = lo + sz;
+#endif
+}
+#endif
+
+#if TGC_CONSERVATIVE_ROOTS
+
+#if defined(_MSC_VER)
+#define TGC_NO_SANITIZE __declspec(no_sanitize_address)
+#define TGC_NOINLINE __declspec(noinline)
+#else
+#define TGC_NO_SANITIZE __attribute__((no_sanitize_address))
+#define TGC_NOINLINE __attribute__((noinline))
+#endif
+
+// Calls f with every word from its own frame up to hi, so the frames of the
+// callers are all included. Compressed pointers are decoded from each half
+// word as well.
+template <typename F>
+TGC_NOINLINE TGC_NO_SANITIZE static void scanStackFrom(const char* hi, F& f) {
+  volatile uintptr_t here = 0;
+  auto* p = (uintptr_t*)&here;
+  auto* end = (uintptr_t*)hi;
+  for (; p < end; p++) {
+    f((const void*)*p);
+#if TGC_COMPRESSED_PTRS
+    for (uint32_t w : {uint32_t(*p), uint32_t(*p >> 32)}) {
+      if (auto o = w & PtrBase::OffsetMask)
+        f(Heap::regionBase + (size_t(o) << PtrBase::OffsetShift));
+    }
+#endif
+  }
+}
+
+// Calls f with every word of the stack above the caller that may be a gc
+// pointer, the callee-saved registers included. They are spilled into this
+// frame as they are: the setjmp of glibc mangles some of them.
+template <typename F>
+TGC_NO_SANITIZE void Collector::scanStack(F f) {
+#if defined(_MSC_VER)
+  jmp_buf regs;
+  setjmp(regs);
+#else
+  __builtin_unwind_init();
+#endif
+  scanStackFrom(stackHi, f);
+}
+
+#endif
+
 //////////////////////////////////////////////////////////////////////////
 
 void ObjMeta::destroy() {
-  if (!arrayLength)
+  if (destroyed)
     return;
-  klass->memHandler(klass, ClassMeta::MemRequest::Dctor, objPtr(), arrayLength);
-  arrayLength = 0;
+  destroyed = true;
+#if TGC_ALLOC_TRACE
+  // the drops of its fields follow, told apart from the ones of the program.
+  if (auto* gc = Collector::inst)
+    gc->trace.free(this);
+#endif
+  auto* c = klass();
+  c->memHandler(c, ClassMeta::MemRequest::Dctor, objPtr(), arrayLength());
 }
 
 void ObjMeta::operator delete(void* p) {
   auto* m = (ObjMeta*)p;
-  m->klass->callDealloc(m);
+  ClassMeta::callDealloc(m->allocPtr());
 }
 
 bool ObjMeta::containsPtr(char* p) {
   auto* o = objPtr();
-  return o <= p && p < o + klass->size * arrayLength;
+  return o <= p && p < o + klass()->size * arrayLength();
 }
 
 //////////////////////////////////////////////////////////////////////////
@@ -59,66 +184,605 @@ PtrBase* ObjPtrEnumerator::getNext() {
   return nullptr;
 }
 
+size_t ObjPtrEnumerator::getRun(const PtrBase*& first) {
+  // arrays of a lone pointer are dense.
+  auto* subPtrs = klass->subPtrOffsets;
+  if (!subPtrs || subPtrs->size() != 1 || (*subPtrs)[0] != 0 ||
+      klass->size != sizeof(PtrBase) || arrayElemIdx || subPtrIdx)
+    return 0;
+  first = (const PtrBase*)base;
+  return len;
+}
+
+//////////////////////////////////////////////////////////////////////////
+/// Pointer runs
+
+// The kernels write the indices of the non-null slots among the first n of
+// a run to idx. The vector ones test several slots per compare, the one to
+// use is picked by the cpu at startup.
+
+#if TGC_COMPRESSED_PTRS
+using RunSlot = uint32_t;
+static constexpr size_t RunStride = 1;
+#else
+using RunSlot = uintptr_t;
+static constexpr size_t RunStride = sizeof(PtrBase) / sizeof(uintptr_t);
+#endif
+static_assert(sizeof(PtrBase) == sizeof(RunSlot) * RunStride,
+              "pointer slots should be dense");
+
+using FindPtrsFn = size_t (*)(const RunSlot* s, size_t i, size_t n,
+                              RunSlot mask, uint32_t* idx);
+
+static size_t findPtrsScalar(const RunSlot* s, size_t i, size_t n,
+                             RunSlot mask, uint32_t* idx) {
+  size_t k = 0;
+  for (; i < n; i++) {
+    idx[k] = (uint32_t)i;
+    k += (s[i * RunStride] & mask) != 0;
+  }
+  return k;
+}
+
+#if TGC_X64
+
+#ifdef _MSC_VER
+#define TGC_TARGET_AVX2
+#else
+#define TGC_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+// bit j of bits is set when slot i + j is not null.
+static size_t emitPtrs(unsigned bits, size_t i, uint32_t* idx) {
+  size_t k = 0;
+  for (; bits; bits &= bits - 1)
+    idx[k++] = uint32_t(i + countTrailingZeros(bits));
+  return k;
+}
+
+static size_t findPtrsSse2(const RunSlot* s, size_t i, size_t n, RunSlot mask,
+                           uint32_t* idx) {
+  size_t k = 0;
+  auto zero = _mm_setzero_si128();
+#if TGC_COMPRESSED_PTRS
+  auto m = _mm_set1_epi32((int)mask);
+  for (; i + 4 <= n; i += 4) {
+    auto w = _mm_and_si128(_mm_loadu_si128((const __m128i*)(s + i)), m);
+    auto null = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(w, zero)));
+    k += emitPtrs(~null & 0xf, i, idx + k);
+  }
+#else
+  for (; i + 2 <= n; i += 2) {
+    auto* p = (const __m128i*)(s + i * RunStride);
+    auto w = _mm_unpacklo_epi64(_mm_loadu_si128(p), _mm_loadu_si128(p + 1));
+    // a slot is null when both of its halves are.
+    auto c = _mm_cmpeq_epi32(w, zero);
+    c = _mm_and_si128(c, _mm_shuffle_epi32(c, _MM_SHUFFLE(2, 3, 0, 1)));
+    auto null = _mm_movemask_pd(_mm_castsi128_pd(c));
+    k += emitPtrs(~null & 0x3, i, idx + k);
+  }
+#endif
+  return k + findPtrsScalar(s, i, n, mask, idx + k);
+}
+
+TGC_TARGET_AVX2 static size_t findPtrsAvx2(const RunSlot* s, size_t i,
+                                           size_t n, RunSlot mask,
+                                           uint32_t* idx) {
+  size_t k = 0;
+  auto zero = _mm256_setzero_si256();
+#if TGC_COMPRESSED_PTRS
+  auto m = _mm256_set1_epi32((int)mask);
+  for (; i + 8 <= n; i += 8) {
+    auto w = _mm256_and_si256(_mm256_loadu_si256((const __m256i*)(s + i)), m);
+    auto c = _mm256_cmpeq_epi32(w, zero);
+    auto null = _mm256_movemask_ps(_mm256_castsi256_ps(c));
+    k += emitPtrs(~null & 0xff, i, idx + k);
+  }
+#else
+  for (; i + 4 <= n; i += 4) {
+    auto* p = (const __m256i*)(s + i * RunStride);
+    // the metas of slots 0, 2, 1, 3, put back in order.
+    auto w = _mm256_unpacklo_epi64(_mm256_loadu_si256(p),
+                                   _mm256_loadu_si256(p + 1));
+    w = _mm256_permute4x64_epi64(w, _MM_SHUFFLE(3, 1, 2, 0));
+    auto c = _mm256_cmpeq_epi64(w, zero);
+    auto null = _mm256_movemask_pd(_mm256_castsi256_pd(c));
+    k += emitPtrs(~null & 0xf, i, idx + k);
+  }
+#endif
+  return k + findPtrsScalar(s, i, n, mask, idx + k);
+}
+
+static bool cpuHasAvx2() {
+#ifdef _MSC_VER
+  int r[4];
+  __cpuid(r, 1);
+  // the os has to save the ymm registers as well.
+  if (!(r[2] & (1 << 27)) || (_xgetbv(0) & 6) != 6)
+    return false;
+  __cpuidex(r, 7, 0);
+  return r[1] & (1 << 5);
+#else
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2");
+#endif
+}
+
+#endif
+
+static FindPtrsFn pickFindPtrs() {
+#if TGC_X64
+  return cpuHasAvx2() ? findPtrsAvx2 : findPtrsSse2;
+#else
+  return findPtrsScalar;
+#endif
+}
+
+size_t Collector::findPtrs(const PtrBase* run, size_t n, uint32_t* idx) {
+  static auto* find = pickFindPtrs();
+#if TGC_COMPRESSED_PTRS
+  RunSlot mask = PtrBase::OffsetMask;
+#else
+  RunSlot mask = ~RunSlot(0);
+#endif
+  return find((const RunSlot*)run, 0, n, mask, idx);
+}
+
+// A chunk of slots is visited while it is still in the cache.
+static constexpr size_t RunChunk = 256;
+
+template <typename F, typename C>
+void Collector::scanRun(const PtrBase* run, size_t n, F f, C eachChunk) {
+  uint32_t idx[RunChunk];
+  for (size_t i = 0; i < n; i += RunChunk) {
+    auto len = min(n - i, RunChunk);
+    eachChunk(run + i, len);
+    auto cnt = findPtrs(run + i, len, idx);
+    if (cnt == len) {
+      for (size_t j = 0; j < len; j++)
+        f(run + i + j);
+      continue;
+    }
+    for (size_t j = 0; j < cnt; j++)
+      f(run + i + idx[j]);
+  }
+}
+
+template <typename F>
+void Collector::forEachPtr(IPtrEnumerator* it, F f) {
+  const PtrBase* run;
+  if (auto n = it->getRun(run))
+    return scanRun(run, n, f, [](const PtrBase*, size_t) {});
+  for (; auto* p = it->getNext();) {
+    if (p->getMeta())
+      f(p);
+  }
+}
+
 //////////////////////////////////////////////////////////////////////////
 
-PtrBase::PtrBase() : isRoot(true), isOld(false) {
+PtrBase::PtrBase() {
   auto* c = Collector::inst ? Collector::inst : Collector::get();
-  c->tryRegisterToClass(this);
+  if (auto* f = GcFrame::current; f && f->contains(this))
+    f->add(this);
+  else if (auto* b = GcBuffer::current; b && b->owner && b->contains(this))
+    b->adopt(this);
+#if TGC_CONSERVATIVE_ROOTS
+  // the stack is scanned at gc, so the pointers on it are not tracked.
+  else if (Collector::onStack(this))
+    setRoot(false);
+#endif
+  else
+    c->tryRegisterToClass(this);
 }
 
-PtrBase::PtrBase(void* obj) : isRoot(true), isOld(false) {
+PtrBase::PtrBase(void* obj) {
   auto* c = Collector::inst ? Collector::inst : Collector::get();
-  c->tryRegisterToClass(this);
-  meta = c->globalFindOwnerMeta(obj);
+  if (auto* f = GcFrame::current; f && f->contains(this))
+    f->add(this);
+  else if (auto* b = GcBuffer::current; b && b->owner && b->contains(this))
+    b->adopt(this);
+#if TGC_CONSERVATIVE_ROOTS
+  else if (Collector::onStack(this))
+    setRoot(false);
+#endif
+  else
+    c->tryRegisterToClass(this);
+  setMeta(c->globalFindOwnerMeta(obj));
+#if TGC_HYBRID_RC
+  retain(getMeta());
+#endif
   writeBarrier();
 }
 
 PtrBase::~PtrBase() {
+#if TGC_HYBRID_RC
+  release(getMeta());
+#endif
+#if TGC_ALLOC_TRACE
+  Collector::inst->trace.drop(this);
+#endif
+#if TGC_CONSERVATIVE_ROOTS
+  if (Collector::onStack(this))
+    return;
+#endif
+  auto* c = Collector::inst;
+  // pointers of young frames never reach the sets.
+  if (auto* f = GcFrame::current; f && f->contains(this) && f->remove(this) &&
+                                  !isOld() && !c->isRegionOpen())
+    return;
+  // nor the ones adopted by a young container.
+  if (auto* b = GcBuffer::current; b && b->contains(this) && !isRoot() &&
+                                   !isOld() && !c->isRegionOpen())
+    return;
+  c->logBarrier((uintptr_t)this | 1);
+}
+
+void PtrBase::logWrite(ObjMeta* m) const {
   auto* c = Collector::inst;
-  c->unrefs.emplace_back(this);
+  if (isRoot() || isOld() || c->inRegion(m)) {
+#if TGC_CONSERVATIVE_ROOTS
+    // found by the stack scan when the region closes.
+    if (Collector::onStack(this))
+      return;
+#endif
+    c->logBarrier((uintptr_t)this);
+  }
+}
+
+//////////////////////////////////////////////////////////////////////////
+
+class FramePtrEnumerator : public IPtrEnumerator {
+  GcFrame* frame;
+  size_t i = 0;
+
+ public:
+  FramePtrEnumerator(GcFrame* f) : frame(f) {}
+  const PtrBase* getNext() override {
+    auto& ptrs = frame->ptrs;
+    return i < ptrs.size() ? (PtrBase*)((char*)frame + ptrs[i++]) : nullptr;
+  }
+};
+
+TGC_THREAD_LOCAL GcFrame* GcFrame::current = nullptr;
+TGC_THREAD_LOCAL GcBuffer* GcBuffer::current = nullptr;
+
+ClassMeta* GcFrame::klass() {
+  // frames are arrays of granules, with the frame header in front.
+  static ClassMeta cls{
+      [](ClassMeta* c, ClassMeta::MemRequest r, void* obj, size_t) -> void* {
+        switch (r) {
+          case ClassMeta::MemRequest::Dctor:
+            ((GcFrame*)obj)->~GcFrame();
+            break;
+          case ClassMeta::MemRequest::NewPtrEnumerator:
+            return new FramePtrEnumerator((GcFrame*)obj);
+          case ClassMeta::MemRequest::Trace:
+            c->registered = true;
+            break;
+        }
+        return nullptr;
+      },
+      Heap::Granularity};
+  return &cls;
+}
+
+static gc<GcFrame>& pendingFrame() {
+  static TGC_THREAD_LOCAL gc<GcFrame> p;
+  return p;
+}
+
+ObjMeta* GcFrame::newMeta(size_t sz) {
+  auto g = Heap::Granularity;
+  auto* meta = klass()->newMeta((sz + g - 1) / g);
+  pendingFrame().reset(meta);
+  return meta;
+}
+
+void GcFrame::endCreate() {
+  pendingFrame() = nullptr;
+}
+
+GcFrame::GcFrame(ObjMeta* m)
+    : meta(m), end(m->objPtr() + klass()->size * m->arrayLength()) {
+  klass()->endNewMeta(m, false);
+  enter();
+}
+
+void GcFrame::add(PtrBase* p) {
+  ptrs.push_back(unsigned((char*)p - (char*)this));
+  p->setRoot(false);
+  p->setOld(meta->isOld);
+  meta->hasSubPtrs = true;
 }
 
-void PtrBase::writeBarrier() {
-  if (this->meta)
-    Collector::inst->delayIntergenerationalPtrs.insert(this);
+bool GcFrame::remove(PtrBase* p) {
+  auto o = unsigned((char*)p - (char*)this);
+  // mostly destroyed in reverse order
+  for (auto i = ptrs.size(); i > 0; i--) {
+    if (ptrs[i - 1] == o) {
+      ptrs[i - 1] = ptrs.back();
+      ptrs.pop_back();
+      return true;
+    }
+  }
+  return false;
 }
 
 //////////////////////////////////////////////////////////////////////////
 
+char* ClassMeta::callAlloc(size_t sz, bool mayCollect) {
+  auto* c = Collector::inst;
+#if TGC_COMPRESSED_PTRS
+  assert(!hasAllocHook() &&
+         "compressed pointers need objects in the heap region");
+#elif TGC_ALLOC_HOOKS
+  if (alloc)
+    return (char*)alloc(sz);
+#endif
+  if (auto* p = c->allocCell(sz))
+    return p;
+  if (c->heap.limitReached()) {
+    if (mayCollect) {
+      c->handleMemoryPressure(MemoryPressure::Critical);
+      if (auto* p = c->allocCell(sz))
+        return p;
+    }
+    throw std::bad_alloc();
+  }
+#if TGC_COMPRESSED_PTRS
+  throw std::bad_alloc();
+#else
+  // the reserved region is exhausted.
+  return new char[sz];
+#endif
+}
+
+void ClassMeta::callDealloc(void* p) {
+  auto* c = Collector::inst;
+  if (c && c->heap.contains(p))
+    c->freeCell(p);
+#if TGC_ALLOC_HOOKS
+  else if (dealloc)
+    dealloc(p);
+#endif
+  else
+    delete[](char*)(p);
+}
+
+unsigned ClassMeta::registerClass(ClassMeta* c) {
+  // plain array so that classes can be registered during static init.
+  static unsigned cnt = 1, capacity = 0;
+  if (cnt == capacity || !classes) {
+    capacity = max(capacity * 2, 64u);
+    auto* n = new ClassMeta*[capacity]();
+    if (classes)
+      copy(classes, classes + cnt, n);
+#if TGC_THREADS
+    // kept, as the others may still read it.
+    static auto* retired = new vector<ClassMeta**>();
+    if (classes)
+      retired->push_back(classes);
+#else
+    delete[] classes;
+#endif
+    classes = n;
+  }
+  classes[cnt] = c;
+  return cnt++;
+}
+
+void ClassMeta::assignIndex() {
+#if TGC_THREADS
+  // the first objects of a class may be made by several threads at once.
+  Collector::ThreadLock lock(Collector::inst);
+  if (index)
+    return;
+#endif
+  index = registerClass(this);
+}
+
+vector<pair<const char*, ClassMeta*>>& ClassMeta::imageClasses() {
+  static vector<pair<const char*, ClassMeta*>> classes;
+  return classes;
+}
+
+void ClassMeta::registerImageClass(ClassMeta* c, const char* name) {
+  imageClasses().emplace_back(name, c);
+}
+
 ObjMeta* ClassMeta::newMeta(size_t cnt) {
   auto* c = Collector::inst ? Collector::inst : Collector::get();
+#if TGC_THREADS
+  c->safepoint();
+#endif
 
-  if (c->gcCond && c->gcCond->needMinorGc(c))
-    c->collect();
+  auto isArray = cnt != 1;
+  auto prefix = isArray ? ObjMeta::ArrayPrefix : 0;
+  auto sz = prefix + sizeof(ObjMeta) + size * cnt;
+  // objects of a region do not count for the gc.
+  char* p = c->regionDepth && !hasAllocHook() && sz <= Heap::MaxSmallSize
+                ? c->regionAlloc(sz)
+                : nullptr;
+
+#if TGC_HYBRID_RC
+  if (c->releases.size() >= Collector::ReleaseBufferSize)
+    c->flushReleases();
+#endif
+  if (!p) {
+    if (c->heap.pastSoftLimit())
+      c->handleMemoryPressure(MemoryPressure::Moderate);
+    else if (c->needMinorGc())
+      c->collect();
+  }
+
+  if (!index)
+    assignIndex();
 
   ObjMeta* meta = nullptr;
+  auto inRegion = p != nullptr;
+  // the leaf pages would take the lock for every object with threads.
+  auto inLeaf = !TGC_THREADS && !p && leaf && !hasAllocHook() &&
+                sz <= Heap::MaxSmallSize &&
+                (p = c->heap.allocLeaf(sz, !trivialDtor));
   try {
-    isCreatingObj++;
-    auto* p = callAlloc(size * cnt + sizeof(ObjMeta));
-    meta = new (p) ObjMeta(this, p + sizeof(ObjMeta), cnt);
+    if (!p)
+      p = callAlloc(sz);
+    if (isArray) {
+      p[0] = ObjMeta::ArrayMagic;
+      *(size_t*)(p + prefix - sizeof(size_t)) = cnt;
+    }
+    meta = new (p + prefix) ObjMeta(this, isArray);
+    meta->isLeaf = inLeaf;
+    meta->creating = true;
+#if TGC_ALLOC_TRACE
+    c->trace.alloc(meta, sz - prefix);
+#endif
+#if TGC_HYBRID_RC
+    // a count of its own while it is created, dropped by endNewMeta.
+    meta->counted = acyclic;
+    meta->refCount = 1;
+#endif
     // Allow using gc_from(this) in the constructor of the creating object.
-    c->addMeta(meta);
+    if (inRegion)
+      c->regionObjs.push_back(meta);
+    else if (!inLeaf)
+      c->addMeta(meta);
+    // untraced classes learn their layout from the first construction.
+    if (!registered) {
+      meta->discovering = true;
+      c->creatingObjs.push_back(meta);
+      isCreatingObj++;
+    }
     return meta;
   } catch (std::bad_alloc&) {
     if (meta)
-      callDealloc(meta);
+      callDealloc(meta->allocPtr());
+    throw;
+  }
+}
+
+void ClassMeta::newMetaBatch(size_t n, ObjMeta** metas) {
+  auto* c = Collector::inst ? Collector::inst : Collector::get();
+#if TGC_THREADS
+  c->safepoint();
+#endif
+
+#if TGC_HYBRID_RC
+  if (c->releases.size() >= Collector::ReleaseBufferSize)
+    c->flushReleases();
+#endif
+  if (c->heap.pastSoftLimit())
+    c->handleMemoryPressure(MemoryPressure::Moderate);
+  else if (c->needMinorGc())
+    c->collect();
+
+  if (!index)
+    assignIndex();
+
+  auto sz = sizeof(ObjMeta) + size;
+  auto** ps = (char**)metas;
+  auto inLeaf = !TGC_THREADS && leaf && !hasAllocHook() &&
+                sz <= Heap::MaxSmallSize;
+  auto allocFromHeap = [&] {
+    size_t i = 0;
+    if (inLeaf) {
+      for (; i < n && (ps[i] = c->heap.allocLeaf(sz, !trivialDtor)); i++) {
+      }
+    } else if (!hasAllocHook()) {
+      i = c->allocCells(sz, n, ps);
+    }
+    return i;
+  };
+  auto i = allocFromHeap();
+  if (i < n && c->heap.limitReached()) {
+    // no gc while holding cells without headers, so give them back first.
+    while (i > 0)
+      c->freeCell(ps[--i]);
+    c->handleMemoryPressure(MemoryPressure::Critical);
+    i = allocFromHeap();
+  }
+  auto leafCnt = inLeaf ? i : 0;
+  try {
+    for (; i < n; i++)
+      ps[i] = callAlloc(sz, false);
+  } catch (std::bad_alloc&) {
+    while (i > 0)
+      callDealloc(ps[--i]);
     throw;
   }
+  for (i = 0; i < n; i++) {
+    metas[i] = new (ps[i]) ObjMeta(this, false);
+    metas[i]->isLeaf = i < leafCnt;
+#if TGC_ALLOC_TRACE
+    c->trace.alloc(metas[i], sz);
+#endif
+#if TGC_HYBRID_RC
+    metas[i]->counted = acyclic;
+    metas[i]->refCount = 1;
+#endif
+  }
+}
+
+void ClassMeta::endNewMetaBatch(ObjMeta** metas, size_t n, bool failed) {
+  auto* c = Collector::inst;
+  if (failed) {
+#if TGC_HYBRID_RC
+    c->dropReleases(metas, n);
+#endif
+    for (size_t i = 0; i < n; i++)
+      callDealloc(metas[i]);
+  } else {
+#if TGC_HYBRID_RC
+    for (size_t i = 0; i < n; i++)
+      if (metas[i]->counted)
+        c->logRelease(metas[i]);
+#endif
+    // the leaf objects come first.
+    size_t leafCnt = 0;
+    while (leafCnt < n && metas[leafCnt]->isLeaf)
+      leafCnt++;
+    c->addMetas(metas + leafCnt, n - leafCnt);
+  }
 }
 
 void ClassMeta::endNewMeta(ObjMeta* meta, bool failed) {
   auto* c = Collector::inst;
-  isCreatingObj--;
-  vector_remove(c->creatingObjs, meta);
+  meta->creating = false;
+  if (meta->discovering) {
+    meta->discovering = false;
+    isCreatingObj--;
+    vector_remove(c->creatingObjs, meta);
+  }
+#if TGC_HYBRID_RC
+  if (failed)
+    c->dropReleases(&meta, 1);
+  else if (meta->counted)
+    c->logRelease(meta);
+#endif
   if (failed) {
-    c->newGen.remove(meta);
-    callDealloc(meta);
+    if (c->inRegion(meta)) {
+      // the memory goes with the region.
+      vector_remove(c->regionObjs, meta);
+    } else if (meta->isLeaf) {
+      callDealloc(meta->allocPtr());
+    } else {
+      c->removeMeta(meta);
+      callDealloc(meta->allocPtr());
+    }
   } else {
-    meta->klass->registered = true;
+    registered = true;
   }
 }
 
 void ClassMeta::registerSubPtr(ObjMeta* owner, PtrBase* p) {
+#if TGC_THREADS
+  // the first objects of the class may be made by several threads.
+  Collector::ThreadLock lock(Collector::inst);
+#endif
+  // the next elements of an array have theirs at the same offsets.
+  if (size_t((char*)p - owner->objPtr()) >= size)
+    return;
   auto offset = (OffsetType)((char*)p - owner->objPtr());
   if (!subPtrOffsets) {
     subPtrOffsets = new vector<OffsetType>();
@@ -130,82 +794,1861 @@ void ClassMeta::registerSubPtr(ObjMeta* owner, PtrBase* p) {
 
 //////////////////////////////////////////////////////////////////////////
 
-Collector* Collector::get() {
-  if (!inst) {
+namespace {
+
+const size_t CommitChunk = Heap::HugePageSize;
+
+size_t alignUp(size_t v, size_t a) {
+  return (v + a - 1) / a * a;
+}
+
+char* reserveRegion(size_t sz) {
 #ifdef _WIN32
-    _CrtSetDbgFlag(_CRTDBG_ALLOC_MEM_DF | _CRTDBG_LEAK_CHECK_DF);
+  return (char*)VirtualAlloc(nullptr, sz, MEM_RESERVE, PAGE_NOACCESS);
+#else
+  auto* p = mmap(nullptr, sz, PROT_NONE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  return p == MAP_FAILED ? nullptr : (char*)p;
 #endif
+}
 
-    inst = new Collector();
-    atexit([] { delete inst; });
+void unreserveRegion(char* p, size_t sz) {
+#ifdef _WIN32
+  VirtualFree(p, 0, MEM_RELEASE);
+#else
+  munmap(p, sz);
+#endif
+}
+
+bool commitRange(char* p, size_t sz) {
+#ifdef _WIN32
+  return VirtualAlloc(p, sz, MEM_COMMIT, PAGE_READWRITE) != nullptr;
+#else
+  return mprotect(p, sz, PROT_READ | PROT_WRITE) == 0;
+#endif
+}
+
+void adviseHugePages(char* p, size_t sz) {
+#ifdef MADV_HUGEPAGE
+  madvise(p, sz, MADV_HUGEPAGE);
+#endif
+}
+
+// The pages stay committed, only the physical memory is given back.
+void discardRange(char* p, size_t sz, bool lazy) {
+#ifdef _WIN32
+  VirtualAlloc(p, sz, MEM_RESET, PAGE_READWRITE);
+#else
+#ifdef MADV_FREE
+  if (lazy) {
+    madvise(p, sz, MADV_FREE);
+    return;
   }
-  return inst;
+#endif
+  madvise(p, sz, MADV_DONTNEED);
+#endif
 }
 
-Collector::Collector() {
-  roots.reserve(1024 * 10);
-  unrefs.reserve(1024 * 10);
-  temp.reserve(1024 * 10);
-  intergenerationalPtrs.reserve(1024 * 10);
-  delayIntergenerationalPtrs.reserve(1024 * 10);
-  setGcCondition(new GcCondition_Time);
+}  // namespace
+
+// Touches the committed but not yet used memory ahead of the allocation
+// frontier, so that page faults are not taken in the allocation path.
+struct Heap::Prefaulter {
+  mutex mtx;
+  condition_variable cv;
+  char* scheduledEnd = nullptr;
+  char* doneEnd = nullptr;
+  bool quit = false;
+  // started last, after the state above is initialized.
+  thread worker;
+
+  Prefaulter() : worker([this] { run(); }) {}
+
+  ~Prefaulter() {
+    {
+      lock_guard<mutex> lk(mtx);
+      quit = true;
+    }
+    cv.notify_all();
+    worker.join();
+  }
+
+  void schedule(char* start, char* end) {
+    {
+      lock_guard<mutex> lk(mtx);
+      if (doneEnd != start && scheduledEnd != start)
+        doneEnd = start;
+      scheduledEnd = end;
+    }
+    cv.notify_all();
+  }
+
+  void waitUntil(char* end) {
+    unique_lock<mutex> lk(mtx);
+    cv.wait(lk, [&] { return doneEnd >= min(end, scheduledEnd); });
+  }
+
+  void run() {
+    unique_lock<mutex> lk(mtx);
+    while (!quit) {
+      if (doneEnd >= scheduledEnd) {
+        cv.wait(lk);
+        continue;
+      }
+      auto* start = doneEnd;
+      auto* end = scheduledEnd;
+      lk.unlock();
+      for (auto* p = start; p < end; p += 4096)
+        *(volatile char*)p = 0;
+      lk.lock();
+      doneEnd = end;
+      cv.notify_all();
+    }
+  }
+};
+
+Heap::Heap() {
+  for (unsigned sz = Granularity; sz <= 256; sz += Granularity)
+    classSizes.push_back(sz);
+  for (unsigned sz = 256; sz < MaxSmallSize; sz *= 2)
+    for (unsigned i = 1; i <= 4; i++)
+      classSizes.push_back(sz + sz / 4 * i);
+
+  sizeToClass.resize(MaxSmallSize / Granularity + 1);
+  for (unsigned i = 0, sc = 0; i < sizeToClass.size(); i++) {
+    while (classSizes[sc] < i * Granularity)
+      sc++;
+    sizeToClass[i] = (unsigned char)sc;
+  }
+  avail.resize(classSizes.size(), NoPage);
+  leafAvail.resize(classSizes.size() * 2, NoPage);
+
+  auto sz = sizeof(void*) == 8 ? (size_t(32) << 30) : (size_t(512) << 20);
+  if (TGC_COMPRESSED_PTRS)
+    sz = min(sz, CompressedRange);
+  for (; sz >= CommitChunk * 4 && !base; sz /= 2) {
+#ifdef _WIN32
+    base = reserveRegion(sz);
+#else
+    // keep the region aligned for huge pages.
+    if (auto* p = reserveRegion(sz + CommitChunk)) {
+      base = (char*)alignUp((size_t)p, CommitChunk);
+      if (base != p)
+        munmap(p, base - p);
+      munmap(base + sz, p + CommitChunk - base);
+    }
+#endif
+    if (base)
+      reservedSize = sz;
+  }
+  pages.reserve(reservedSize >> PageShift);
+  regionBase = base;
+
+  // the first page is never handed out, offset 0 stands for null.
+  pages.resize(1);
+  pages[0].kind = PageKind::Reserved;
 }
 
-Collector::~Collector() {
-  while (newGen.size()) {
-    auto i = newGen.back();
-    newGen.pop_back();
-    delete i;
+Heap::~Heap() {
+  prefaulter.reset();
+  if (base)
+    unreserveRegion(base, reservedSize);
+}
+
+void Heap::setPolicy(const Policy& p) {
+  if (p.hugePages && !policy.hugePages && base)
+    adviseHugePages(base, reservedSize);
+  if (p.prefault && !prefaulter)
+    prefaulter.reset(new Prefaulter);
+  else if (!p.prefault)
+    prefaulter.reset();
+  policy = p;
+
+  limit = p.heapLimit;
+  if (p.cgroupLimitShare > 0) {
+    if (auto cg = cgroupMemoryLimit()) {
+      auto l = size_t(double(cg) * p.cgroupLimitShare);
+      limit = limit ? min(limit, l) : l;
+    }
   }
-  while (oldGen.size()) {
-    auto i = oldGen.back();
-    oldGen.pop_back();
-    delete i;
+  updateSoftLimit();
+}
+
+Heap::Stats Heap::getStats() const {
+#if TGC_THREADS
+  // the caches of the other threads are counted as used.
+  auto used = usedSize - GcThread::cachedBytes(*this);
+#else
+  auto used = usedSize;
+#endif
+  return {reservedSize, committedSize, used, releasedSize, pageBytes, limit};
+}
+
+#ifdef __linux__
+// The lowest limit set by the cgroup or one of its parents, 0 if none.
+static size_t cgroupTreeLimit(const string& root, string cg, const char* file) {
+  size_t limit = 0;
+  for (;;) {
+    auto dir = root + (cg == "/" ? "" : cg);
+    if (auto* f = fopen((dir + "/" + file).c_str(), "r")) {
+      unsigned long long v = 0;
+      // "max" when unlimited with v2, a number close to 2^63 with v1.
+      if (fscanf(f, "%llu", &v) == 1 && v < (1ull << 62))
+        limit = limit ? min(limit, (size_t)v) : (size_t)v;
+      fclose(f);
+    }
+    if (cg.size() <= 1)
+      return limit;
+    cg.erase(max(cg.rfind('/'), size_t(1)));
+  }
+}
+#endif
+
+size_t Heap::cgroupMemoryLimit() {
+#ifdef __linux__
+  // the lines are "id:controllers:path", the cgroup v2 one is "0::path".
+  auto* f = fopen("/proc/self/cgroup", "r");
+  if (!f)
+    return 0;
+  string v2, v1;
+  char line[4096];
+  while (fgets(line, sizeof(line), f)) {
+    auto* ctrls = strchr(line, ':');
+    auto* path = ctrls ? strchr(ctrls + 1, ':') : nullptr;
+    if (!path)
+      continue;
+    string cg(path + 1, strcspn(path + 1, "\n"));
+    string list = "," + string(ctrls + 1, path) + ",";
+    if (ctrls == line + 1 && line[0] == '0' && path == ctrls + 1)
+      v2 = cg;
+    else if (list.find(",memory,") != string::npos)
+      v1 = cg;
+  }
+  fclose(f);
+
+  // the hierarchies may both be mounted, the lower limit holds.
+  size_t limit = 0;
+  for (auto l : {v2.empty() ? 0 : cgroupTreeLimit("/sys/fs/cgroup", v2,
+                                                  "memory.max"),
+                 v1.empty() ? 0 : cgroupTreeLimit("/sys/fs/cgroup/memory", v1,
+                                                  "memory.limit_in_bytes")}) {
+    if (l)
+      limit = limit ? min(limit, l) : l;
+  }
+  return limit;
+#else
+  return 0;
+#endif
+}
+
+char* Heap::alloc(size_t sz) {
+  if (sz > MaxSmallSize)
+    return allocLarge(sz);
+
+  auto sc = sizeClassOf(sz);
+  auto idx = avail[sc];
+  if (idx == NoPage && (idx = newSmallPage(sc)) == NoPage)
+    return nullptr;
+
+  auto& pg = pages[idx];
+  char* p;
+  if (pg.freeList) {
+    p = pg.freeList;
+    pg.freeList = *(char**)p;
+  } else {
+    p = pageAddr(idx) + size_t(pg.bump++) * classSizes[sc];
+  }
+  if (++pg.used == pg.capacity) {
+    avail[sc] = pg.next;
+    pg.inAvail = false;
+  }
+  usedSize += classSizes[sc];
+  return p;
+}
+
+size_t Heap::allocBatch(size_t sz, size_t n, char** out) {
+  size_t i = 0;
+  if (sz > MaxSmallSize) {
+    for (; i < n && (out[i] = allocLarge(sz)); i++) {
+    }
+    return i;
+  }
+
+  auto sc = sizeClassOf(sz);
+  auto cellSize = classSizes[sc];
+  while (i < n) {
+    auto idx = avail[sc];
+    if (idx == NoPage && (idx = newSmallPage(sc)) == NoPage)
+      break;
+
+    auto& pg = pages[idx];
+    for (; i < n && pg.freeList; i++, pg.used++) {
+      out[i] = pg.freeList;
+      pg.freeList = *(char**)out[i];
+    }
+    for (; i < n && !pg.freeList && pg.bump < pg.capacity; i++, pg.used++)
+      out[i] = pageAddr(idx) + size_t(pg.bump++) * cellSize;
+    if (pg.used == pg.capacity) {
+      avail[sc] = pg.next;
+      pg.inAvail = false;
+    }
+  }
+  usedSize += i * cellSize;
+  return i;
+}
+
+void Heap::free(void* ptr) {
+  auto idx = pageIndex(ptr);
+  auto& pg = pages[idx];
+  if (pg.kind == PageKind::Large) {
+    usedSize -= size_t(pg.capacity) << PageShift;
+    freePages(idx, pg.capacity);
+    return;
+  }
+  if (pg.kind == PageKind::Bump) {
+    if (!pg.open && --pg.used == 0) {
+      usedSize -= PageSize;
+      freePages(idx, 1);
+    }
+    return;
+  }
+  if (pg.kind == PageKind::Leaf) {
+    auto i = size_t((char*)ptr - pageAddr(idx)) / classSizes[pg.sizeClass];
+    auto bit = ~(uint64_t(1) << (i % 64));
+    auto* b = pg.leaf.get();
+    b->alloc[i / 64] &= bit;
+    b->resetAge(i / 64, ~bit);
+    b->old[i / 64] &= bit;
+    b->frozen[i / 64] &= bit;
+    pg.used--;
+    leafCount--;
+    usedSize -= classSizes[pg.sizeClass];
+    auto list = pg.sizeClass * 2 + pg.dtor;
+    if (!pg.inAvail) {
+      pg.next = leafAvail[list];
+      pg.inAvail = true;
+      leafAvail[list] = idx;
+    }
+    return;
+  }
+
+  assert(pg.kind == PageKind::Small);
+  auto* p = (char*)ptr;
+  *(char**)p = pg.freeList;
+  pg.freeList = p;
+  pg.used--;
+  usedSize -= classSizes[pg.sizeClass];
+  // empty pages are kept in the list until releaseEmptyPages.
+  if (!pg.inAvail) {
+    pg.next = avail[pg.sizeClass];
+    pg.inAvail = true;
+    avail[pg.sizeClass] = idx;
+  }
+}
+
+unsigned Heap::newSmallPage(unsigned sc) {
+  auto idx = allocPages(1);
+  if (idx == NoPage)
+    return NoPage;
+  auto& pg = pages[idx];
+  pg.kind = PageKind::Small;
+  pg.sizeClass = (unsigned short)sc;
+  pg.capacity = (unsigned)(PageSize / classSizes[sc]);
+  pg.bump = pg.used = 0;
+  pg.freeList = nullptr;
+  pg.next = avail[sc];
+  pg.inAvail = true;
+  avail[sc] = idx;
+  return idx;
+}
+
+unsigned Heap::newLeafPage(unsigned sc, bool dtor) {
+  auto idx = allocPages(1);
+  if (idx == NoPage)
+    return NoPage;
+  auto& pg = pages[idx];
+  pg.kind = PageKind::Leaf;
+  pg.sizeClass = (unsigned short)sc;
+  pg.capacity = (unsigned)(PageSize / classSizes[sc]);
+  pg.bump = pg.used = 0;
+  pg.dtor = dtor;
+  pg.leaf.reset(new LeafBits());
+  // the bits past the capacity are never handed out.
+  for (auto i = pg.capacity; i < LeafBits::Words * 64; i++)
+    pg.leaf->alloc[i / 64] |= uint64_t(1) << (i % 64);
+  auto list = sc * 2 + dtor;
+  pg.next = leafAvail[list];
+  pg.inAvail = true;
+  leafAvail[list] = idx;
+  leafPages.push_back(idx);
+  return idx;
+}
+
+char* Heap::allocLeaf(size_t sz, bool dtor) {
+  auto sc = sizeClassOf(sz);
+  auto list = sc * 2 + dtor;
+  auto idx = leafAvail[list];
+  if (idx == NoPage && (idx = newLeafPage(sc, dtor)) == NoPage)
+    return nullptr;
+
+  // `bump` is the word to look for a free slot from.
+  auto& pg = pages[idx];
+  auto* b = pg.leaf.get();
+  while (!~b->alloc[pg.bump])
+    pg.bump = (pg.bump + 1) % LeafBits::Words;
+  auto w = pg.bump;
+  auto bit = countTrailingZeros(~b->alloc[w]);
+  b->alloc[w] |= uint64_t(1) << bit;
+  if (++pg.used == pg.capacity) {
+    leafAvail[list] = pg.next;
+    pg.inAvail = false;
+  }
+  leafCount++;
+  usedSize += classSizes[sc];
+  return pageAddr(idx) + (w * 64 + bit) * size_t(classSizes[sc]);
+}
+
+size_t Heap::sweepLeaves(bool full) {
+  size_t freed = 0;
+  vector<ObjMeta*> dying;
+  for (auto idx : leafPages) {
+    auto& pg = pages[idx];
+    auto* b = pg.leaf.get();
+    auto cellSize = classSizes[pg.sizeClass];
+    for (unsigned w = 0; w < LeafBits::Words; w++) {
+      auto lo = w * 64;
+      auto valid = ~uint64_t(0);
+      if (pg.capacity < lo + 64)
+        valid = pg.capacity > lo ? (uint64_t(1) << (pg.capacity - lo)) - 1 : 0;
+      auto young = b->alloc[w] & valid & ~b->frozen[w] &
+                   (full ? ~uint64_t(0) : ~b->old[w]);
+      auto dead = young & ~b->mark[w];
+      b->mark[w] = 0;
+      if (!full) {
+        auto live = young & ~dead;
+        auto due = live & b->ageIs(w, LeafTenure - 1);
+        b->old[w] |= due;
+        b->resetAge(w, due);
+        b->addAge(w, live & ~due);
+      }
+      if (!dead)
+        continue;
+      if (pg.dtor) {
+        for (; dead; dead &= dead - 1) {
+          auto* p = pageAddr(idx) + (lo + countTrailingZeros(dead)) * cellSize;
+          if (*p == (char)ObjMeta::ArrayMagic)
+            p += ObjMeta::ArrayPrefix;
+          dying.push_back((ObjMeta*)p);
+        }
+        continue;
+      }
+      auto n = popCount(dead);
+      b->alloc[w] &= ~dead;
+      b->resetAge(w, dead);
+      b->old[w] &= ~dead;
+      pg.used -= n;
+      leafCount -= n;
+      usedSize -= size_t(n) * cellSize;
+      freed += n;
+    }
+    pg.bump = 0;
+    if (pg.used < pg.capacity && !pg.inAvail) {
+      auto list = pg.sizeClass * 2 + pg.dtor;
+      pg.next = leafAvail[list];
+      pg.inAvail = true;
+      leafAvail[list] = idx;
+    }
+  }
+
+  // destructors may allocate, so run them after the bitmaps are settled.
+  for (auto* m : dying) {
+    m->destroy();
+    free(m->allocPtr());
+  }
+  return freed + dying.size();
+}
+
+void Heap::thawLeaves() {
+  for (auto idx : leafPages) {
+    auto* b = pages[idx].leaf.get();
+    for (unsigned w = 0; w < LeafBits::Words; w++) {
+      b->old[w] |= b->frozen[w];
+      b->frozen[w] = 0;
+    }
+  }
+}
+
+ObjMeta* Heap::findObject(const void* p) const {
+  if (!contains(p))
+    return nullptr;
+  auto idx = pageIndex(p);
+  if (idx >= top)
+    return nullptr;
+  auto& pg = pages[idx];
+  auto off = size_t((const char*)p - pageAddr(idx));
+  char* cell = nullptr;
+  switch (pg.kind) {
+    case PageKind::Small: {
+      auto i = off / classSizes[pg.sizeClass];
+      if (i >= pg.bump)
+        return nullptr;
+      cell = pageAddr(idx) + i * classSizes[pg.sizeClass];
+      break;
+    }
+    case PageKind::Leaf: {
+      auto i = off / classSizes[pg.sizeClass];
+      if (i >= pg.capacity || !(pg.leaf->alloc[i / 64] >> (i % 64) & 1))
+        return nullptr;
+      cell = pageAddr(idx) + i * classSizes[pg.sizeClass];
+      break;
+    }
+    case PageKind::LargeTail:
+      idx = pg.next;
+      [[fallthrough]];
+    case PageKind::Large:
+      cell = pageAddr(idx);
+      break;
+    case PageKind::Bump: {
+      if (pg.open)
+        return nullptr;
+      // the objects have various sizes, so take the header or the object
+      // right at the pointer.
+      cell = (char*)(uintptr_t(p) & ~uintptr_t(Granularity - 1));
+      if ((unsigned char)*cell != ObjMeta::Magic && off >= sizeof(ObjMeta))
+        cell -= sizeof(ObjMeta);
+      break;
+    }
+    default:
+      return nullptr;
+  }
+  if (*cell == (char)ObjMeta::ArrayMagic)
+    cell += ObjMeta::ArrayPrefix;
+  auto* m = (ObjMeta*)cell;
+  return m->magic == ObjMeta::Magic && !m->destroyed ? m : nullptr;
+}
+
+char* Heap::allocBumpPage() {
+  auto idx = allocPages(1);
+  if (idx == NoPage)
+    return nullptr;
+  auto& pg = pages[idx];
+  pg.kind = PageKind::Bump;
+  pg.used = 0;
+  pg.open = true;
+  usedSize += PageSize;
+  return pageAddr(idx);
+}
+
+void Heap::closeBumpPage(char* page) {
+  auto idx = pageIndex(page);
+  auto& pg = pages[idx];
+  pg.open = false;
+  if (!pg.used) {
+    usedSize -= PageSize;
+    freePages(idx, 1);
+  }
+}
+
+char* Heap::allocImage(const uint32_t* layout, unsigned n) {
+  auto idx = allocPages(n);
+  if (idx == NoPage)
+    return nullptr;
+  for (unsigned i = 0; i < n;) {
+    auto& pg = pages[idx + i];
+    if (layout[i] & ImageLargePage) {
+      auto run = layout[i] & ~ImageLargePage;
+      pg.kind = PageKind::Large;
+      pg.capacity = run;
+      for (unsigned j = 1; j < run; j++) {
+        pages[idx + i + j].kind = PageKind::LargeTail;
+        pages[idx + i + j].next = idx + i;
+      }
+      i += run;
+    } else {
+      pg.kind = PageKind::Bump;
+      pg.open = false;
+      pg.used = layout[i];
+      i++;
+    }
+  }
+  usedSize += size_t(n) << PageShift;
+  return pageAddr(idx);
+}
+
+void Heap::releaseImage(char* p, unsigned n) {
+  usedSize -= size_t(n) << PageShift;
+  freePages(pageIndex(p), n);
+}
+
+char* Heap::allocLarge(size_t sz) {
+  auto n = alignUp(sz, PageSize) >> PageShift;
+  if (n >= (reservedSize >> PageShift))
+    return nullptr;
+  auto idx = allocPages((unsigned)n);
+  if (idx == NoPage)
+    return nullptr;
+  pages[idx].kind = PageKind::Large;
+  pages[idx].capacity = (unsigned)n;
+  for (unsigned i = 1; i < n; i++) {
+    pages[idx + i].kind = PageKind::LargeTail;
+    pages[idx + i].next = idx;
+  }
+  usedSize += n << PageShift;
+  return pageAddr(idx);
+}
+
+unsigned Heap::allocPages(unsigned n) {
+  auto bytes = size_t(n) << PageShift;
+  limitHit = limit && pageBytes + bytes > limit;
+  if (limitHit)
+    return NoPage;
+
+  auto it = freeSpans.lower_bound({n, 0});
+  if (it != freeSpans.end()) {
+    auto len = it->first, idx = it->second;
+    removeFreeSpan(idx);
+    if (len > n)
+      addFreeSpan(idx + n, len - n);
+    for (unsigned i = 0; i < n; i++)
+      pages[idx + i].dirty = true;
+    pageBytes += bytes;
+    return idx;
+  }
+
+  auto idx = top;
+  if (!grow(top + n))
+    return NoPage;
+  for (unsigned i = 0; i < n; i++)
+    pages[idx + i].dirty = true;
+  pageBytes += bytes;
+  return idx;
+}
+
+bool Heap::grow(unsigned newTop) {
+  auto end = size_t(newTop) << PageShift;
+  if (end > reservedSize)
+    return false;
+
+  if (end > committedSize) {
+    auto sz = alignUp(end, CommitChunk) - committedSize;
+    if (!commitRange(base + committedSize, sz))
+      return false;
+    committedSize += sz;
+  }
+
+  if (prefaulter) {
+    prefaulter->waitUntil(base + end);
+    // keep one chunk ahead of the frontier faulted in.
+    if (committedSize - end < CommitChunk &&
+        committedSize + CommitChunk <= reservedSize &&
+        commitRange(base + committedSize, CommitChunk)) {
+      prefaulter->schedule(base + committedSize,
+                           base + committedSize + CommitChunk);
+      committedSize += CommitChunk;
+    }
+  }
+
+  top = newTop;
+  pages.resize(top);
+  return true;
+}
+
+void Heap::freePages(unsigned idx, unsigned n) {
+  pageBytes -= size_t(n) << PageShift;
+  for (unsigned i = 0; i < n; i++) {
+    auto& pg = pages[idx + i];
+    pg.kind = PageKind::Free;
+    pg.freeList = nullptr;
+    pg.used = 0;
+    pg.inAvail = false;
+    pg.leaf.reset();
+  }
+
+  // coalesce with the neighbours.
+  if (idx > 0 && pages[idx - 1].kind == PageKind::Free) {
+    auto head = pages[idx - 1].next;
+    auto len = pages[head].capacity;
+    removeFreeSpan(head);
+    idx = head;
+    n += len;
+  }
+  auto right = idx + n;
+  if (right < top && pages[right].kind == PageKind::Free) {
+    auto len = pages[right].capacity;
+    removeFreeSpan(right);
+    n += len;
+  }
+  // the pages keep their own dirty flags, so the released ones stay so.
+  addFreeSpan(idx, n);
+}
+
+void Heap::addFreeSpan(unsigned idx, unsigned n) {
+  auto& head = pages[idx];
+  head.kind = PageKind::Free;
+  head.capacity = n;
+  head.next = idx;
+  pages[idx + n - 1].kind = PageKind::Free;
+  pages[idx + n - 1].next = idx;
+  freeSpans.insert({n, idx});
+}
+
+void Heap::removeFreeSpan(unsigned idx) {
+  freeSpans.erase({pages[idx].capacity, idx});
+}
+
+void Heap::releaseEmptyPages() {
+  auto freeEmpty = [&](vector<unsigned>& lists) {
+    for (auto& head : lists) {
+      auto* link = &head;
+      while (*link != NoPage) {
+        auto idx = *link;
+        auto& pg = pages[idx];
+        if (pg.used == 0) {
+          *link = pg.next;
+          freePages(idx, 1);
+        } else {
+          link = &pg.next;
+        }
+      }
+    }
+  };
+  freeEmpty(avail);
+  freeEmpty(leafAvail);
+  leafPages.erase(remove_if(leafPages.begin(), leafPages.end(),
+                            [&](unsigned i) {
+                              return pages[i].kind != PageKind::Leaf;
+                            }),
+                  leafPages.end());
+
+  // retain the dirty pages of the smallest spans, up to the policy, and
+  // release the larger spans.
+  size_t retained = 0;
+  for (auto [n, idx] : freeSpans) {
+    unsigned dirty = 0;
+    for (unsigned i = 0; i < n; i++)
+      dirty += pages[idx + i].dirty;
+    if (!dirty)
+      continue;
+    if (retained + dirty <= policy.retainedEmptyPages) {
+      retained += dirty;
+      continue;
+    }
+    releaseSpan(idx, n);
+  }
+}
+
+// Only the runs of dirty pages are given back, the others were already.
+void Heap::releaseSpan(unsigned idx, unsigned n) {
+  for (unsigned i = idx, end = idx + n; i < end;) {
+    if (!pages[i].dirty) {
+      i++;
+      continue;
+    }
+    auto j = i;
+    while (j < end && pages[j].dirty)
+      j++;
+    auto* from = pageAddr(i);
+    auto* to = pageAddr(j);
+    if (policy.hugePages) {
+      // do not split the huge pages still in use.
+      from = (char*)alignUp((size_t)from, HugePageSize);
+      to = (char*)((size_t)to / HugePageSize * HugePageSize);
+    }
+    if (from < to) {
+      discardRange(from, to - from, policy.lazyRelease);
+      releasedSize += to - from;
+      for (auto k = pageIndex(from); k < pageIndex(to); k++)
+        pages[k].dirty = false;
+    }
+    i = j;
+  }
+}
+
+//////////////////////////////////////////////////////////////////////////
+
+Collector* Collector::get() {
+  if (!inst) {
+#if TGC_THREADS
+    // the first gc objects may be made by several threads at once.
+    static mutex initLock;
+    lock_guard<mutex> lock(initLock);
+    if (inst)
+      return inst;
+#endif
+#ifdef _WIN32
+    _CrtSetDbgFlag(_CRTDBG_ALLOC_MEM_DF | _CRTDBG_LEAK_CHECK_DF);
+#endif
+
+    inst = new Collector();
+    atexit([] { delete inst; });
+  }
+  return inst;
+}
+
+Collector::Collector() {
+#if TGC_CONSERVATIVE_ROOTS
+  getStackBounds(stackLo, stackHi);
+#endif
+  roots.reserve(1024 * 10);
+  barrierLog.reserve(1024 * 10);
+  temp.reserve(1024 * 10);
+  intergenerationalPtrs.reserve(1024 * 10);
+  delayIntergenerationalPtrs.reserve(1024 * 10);
+  // not by setGcCondition, which would stop the world of a collector not
+  // made yet.
+#ifdef TGC_GC_CONDITION
+  gcCond = new TGC_GC_CONDITION;
+#else
+  gcCond = new GcCondition_Time;
+#endif
+}
+
+void Collector::setGcCondition(GcConditionType* c) {
+#if TGC_THREADS
+  StopTheWorld stop(this);
+#endif
+  delete gcCond;
+  gcCond = c;
+}
+
+Collector::~Collector() {
+#if TGC_HYBRID_RC
+  // the objects are all freed below, whatever their counts.
+  flushingReleases = true;
+#endif
+  while (newGen.size()) {
+    auto i = newGen.back();
+    newGen.pop_back();
+    delete i;
+  }
+  while (oldGen.size()) {
+    auto i = oldGen.back();
+    oldGen.pop_back();
+    delete i;
+  }
+  while (frozen.size()) {
+    auto i = frozen.back();
+    frozen.pop_back();
+    delete i;
+  }
+  // nothing is marked, so all of them are destroyed.
+  heap.thawLeaves();
+  heap.sweepLeaves(true);
+
+  delete gcCond;
+}
+
+void Collector::trimBuffers() {
+  const size_t reserved = 1024 * 10;
+
+  auto trimVector = [&](auto& v) {
+    if (v.capacity() > reserved && v.size() * 4 < v.capacity()) {
+      decay_t<decltype(v)> n;
+      n.reserve(max(v.size() * 2, reserved));
+      n.assign(v.begin(), v.end());
+      v.swap(n);
+    }
+  };
+  auto trimSet = [&](auto& s) {
+    if (s.bucket_count() > reserved * 2 && s.size() * 4 < s.bucket_count()) {
+      decay_t<decltype(s)> n;
+      n.reserve(max(s.size() * 2, reserved));
+      n.insert(s.begin(), s.end());
+      s.swap(n);
+    }
+  };
+
+  trimVector(temp);
+  trimVector(barrierLog);
+  trimVector(creatingObjs);
+  trimSet(roots);
+  trimSet(intergenerationalPtrs);
+  trimSet(delayIntergenerationalPtrs);
+
+  auto& buf = IPtrEnumerator::buf;
+  while (buf.size() > 64) {
+    delete[] buf.back();
+    buf.pop_back();
+  }
+  buf.shrink_to_fit();
+}
+
+void Collector::releaseMemory() {
+#if TGC_THREADS
+  StopTheWorld stop(this);
+#endif
+  trimBuffers();
+  heap.releaseEmptyPages();
+  heap.updateSoftLimit();
+#ifdef __GLIBC__
+  malloc_trim(0);
+#endif
+}
+
+void Collector::handleMemoryPressure(MemoryPressure level) {
+#if TGC_THREADS
+  StopTheWorld stop(this);
+#endif
+  // e.g. allocations of the handlers.
+  if (inPressure)
+    return;
+  inPressure = true;
+  recorder.begin("memory pressure");
+  auto usedBefore = heap.getStats().usedBytes;
+  auto handlers = pressureHandlers;
+  for (auto& h : handlers)
+    h.second(level);
+  fullCollect();
+  releaseMemory();
+  recorder.end("memory pressure", 0, freedSince(usedBefore));
+  inPressure = false;
+}
+
+void Collector::addMeta(ObjMeta* meta) {
+#if TGC_THREADS
+  // kept by the thread until the world is stopped.
+  if (auto* t = stopDepth ? nullptr : GcThread::self()) {
+    t->fresh.push_back(meta);
+    return;
+  }
+  ThreadLock lock(this);
+#endif
+  newGen.push_back(meta);
+}
+
+void Collector::addMetas(ObjMeta** metas, size_t n) {
+#if TGC_THREADS
+  if (auto* t = stopDepth ? nullptr : GcThread::self()) {
+    t->fresh.insert(t->fresh.end(), metas, metas + n);
+    return;
+  }
+  ThreadLock lock(this);
+#endif
+  newGen.append(metas, n);
+}
+
+void Collector::removeMeta(ObjMeta* meta) {
+#if TGC_THREADS
+  if (auto* t = stopDepth ? nullptr : GcThread::self()) {
+    auto& fresh = t->fresh;
+    for (auto i = fresh.size(); i > 0; i--) {
+      if (fresh[i - 1] == meta) {
+        fresh.erase(fresh.begin() + (i - 1));
+        return;
+      }
+    }
+  }
+  // taken by a gc since.
+  StopTheWorld stop(this);
+#endif
+  newGen.remove(meta);
+}
+
+bool Collector::needMinorGc() {
+#if TGC_THREADS
+  // asked for a batch of the allocations of the thread at a time.
+  unsigned n = 1;
+  if (auto* t = stopDepth ? nullptr : GcThread::self()) {
+    if (++t->allocs < GcThread::CondBatch)
+      return false;
+    n = t->allocs;
+    t->allocs = 0;
+  }
+  ThreadLock lock(this);
+  auto need = false;
+  for (; gcCond && n > 0; n--)
+    need = gcCond->needMinorGc(this) || need;
+  return need;
+#else
+  return gcCond && gcCond->needMinorGc(this);
+#endif
+}
+
+// With threads, the small cells come from the cache of the thread.
+char* Collector::allocCell(size_t sz) {
+#if TGC_THREADS
+  auto* t = stopDepth ? nullptr : GcThread::self();
+  if (t && sz <= Heap::MaxSmallSize)
+    return t->allocCell(this, sz);
+  ThreadLock lock(this);
+#endif
+  return heap.alloc(sz);
+}
+
+size_t Collector::allocCells(size_t sz, size_t n, char** out) {
+#if TGC_THREADS
+  ThreadLock lock(this);
+#endif
+  return heap.allocBatch(sz, n, out);
+}
+
+void Collector::freeCell(void* p) {
+#if TGC_THREADS
+  if (auto* t = stopDepth ? nullptr : GcThread::self()) {
+    auto sc = heap.smallCellClass(p);
+    if (sc >= 0)
+      return t->freeCell(this, (char*)p, (unsigned)sc);
+  }
+  ThreadLock lock(this);
+#endif
+  heap.free(p);
+}
+
+void Collector::tryRegisterToClass(PtrBase* p) {
+  if (ClassMeta::isCreatingObj > 0) {
+    // owner may not be the current one(e.g. constructor recursed)
+    for (auto i = creatingObjs.rbegin(); i != creatingObjs.rend(); ++i) {
+      auto* owner = *i;
+      auto* cls = owner->klass();
+      if (!cls->registered && owner->containsPtr((char*)p)) {
+        cls->registerSubPtr(owner, p);
+        break;
+      }
+    }
+  }
+}
+
+// Each one is logged as destroyed and written again, so that the replay drops
+// it from the sets of its former owner.
+void Collector::adoptPtrs(ObjMeta* owner) {
+  if (auto* it = owner->klass()->enumPtrs(owner)) {
+    for (; auto* p = it->getNext();) {
+      logBarrier((uintptr_t)p | 1);
+      p->adoptBy(owner);
+      if (auto* m = p->getMeta())
+        p->logWrite(m);
+    }
+    delete it;
+  }
+}
+
+// Replay in order, a destroyed pointer may have its address reused.
+void Collector::flushBarrierLog() {
+  auto region = regionDepth > 0;
+  for (auto e : barrierLog) {
+    auto* ptr = (const PtrBase*)(e & ~uintptr_t(1));
+    if (e & 1) {
+      intergenerationalPtrs.erase(ptr);
+      delayIntergenerationalPtrs.erase(ptr);
+      roots.erase(ptr);
+#if TGC_MIXED_GC
+      forget(ptr);
+#endif
+      if (region)
+        regionRefs.erase(ptr);
+    } else if (!region) {
+      delayIntergenerationalPtrs.insert(ptr);
+    } else if (!heap.inOpenBumpPage(ptr)) {
+      // pointers of region objects are traced from the region.
+      delayIntergenerationalPtrs.insert(ptr);
+      regionRefs.insert(ptr);
+    }
+  }
+  barrierLog.clear();
+  if (region)
+    filterRegionRefs();
+}
+
+// All the pointers are alive after the replay, keep the ones from outside
+// into the region.
+void Collector::filterRegionRefs() {
+  for (auto it = regionRefs.begin(); it != regionRefs.end();) {
+    auto* p = *it;
+    // young non-root pointers were only logged for the region.
+    if (!p->isRoot() && !p->isOld())
+      delayIntergenerationalPtrs.erase(p);
+    auto* m = p->getMeta();
+    if (m && heap.inOpenBumpPage(m))
+      ++it;
+    else
+      it = regionRefs.erase(it);
+  }
+}
+
+// The objects of an open region are roots of the heap.
+void Collector::markFromRegion() {
+  for (auto* o : regionObjs) {
+    if (auto* it = o->klass()->enumPtrs(o)) {
+      forEachPtr(it, [&](const PtrBase* p) { mark(p->getMeta()); });
+      delete it;
+    }
+  }
+}
+
+char* Collector::regionAlloc(size_t sz) {
+  sz = alignUp(sz, Heap::Granularity);
+  if (sz > size_t(regionEnd - regionCur)) {
+    auto* page = heap.allocBumpPage();
+    if (!page)
+      return nullptr;
+    regionPages.push_back(page);
+    regionCur = page;
+    regionEnd = page + Heap::PageSize;
+  }
+  auto* p = regionCur;
+  regionCur += sz;
+  return p;
+}
+
+#if TGC_CONSERVATIVE_ROOTS
+// Only the headers found in their generation are real, the others are stale
+// data that looks like one.
+ObjMeta* Collector::findMeta(const void* p) {
+  auto* m = heap.findObject(p);
+  if (!m || m->isLeaf)
+    return m;
+  auto& gen = m->isOld ? oldGen : newGen;
+  return m->genIndex < gen.size() && gen[m->genIndex] == m ? m : nullptr;
+}
+
+// Called first thing by a gc, so that the frames of the collector do not
+// hold the objects it walked yet.
+void Collector::findStackRoots() {
+  scanStack([&](const void* p) {
+    if (auto* m = findMeta(p))
+      stackRoots.push_back(m);
+  });
+}
+#endif
+
+void Collector::closeRegion() {
+  if (regionDepth > 1) {
+    regionDepth--;
+    return;
+  }
+#if TGC_THREADS
+  // for the log of the thread.
+  StopTheWorld stop(this);
+#endif
+#if TGC_CONSERVATIVE_ROOTS
+  scanStack([&](const void* p) {
+    if (heap.inOpenBumpPage(p))
+      stackRefs.push_back(p);
+  });
+#endif
+  recorder.begin("close region");
+  flushBarrierLog();
+
+  // mark the objects reachable from outside.
+  for (auto* m : regionObjs)
+    m->color = ObjMeta::Color::White;
+  for (auto* p : regionRefs)
+    temp.push_back(p->getMeta());
+#if TGC_CONSERVATIVE_ROOTS
+  // the pointers on the stack were not logged, so look them up by address.
+  auto objs = regionObjs;
+  sort(objs.begin(), objs.end());
+  for (auto* p : stackRefs) {
+    auto it = upper_bound(objs.begin(), objs.end(), p,
+                          [](const void* p, ObjMeta* m) { return p < m; });
+    if (it != objs.begin() && (*--it == p || (*it)->containsPtr((char*)p)))
+      temp.push_back(*it);
+  }
+  stackRefs.clear();
+#endif
+  while (temp.size()) {
+    auto* m = temp.back();
+    temp.pop_back();
+    if (m->color != ObjMeta::Color::White)
+      continue;
+    m->color = ObjMeta::Color::Black;
+    if (auto* it = m->klass()->enumPtrs(m)) {
+      for (; auto* p = it->getNext();) {
+        auto* sub = p->getMeta();
+        if (sub && sub->color == ObjMeta::Color::White &&
+            heap.inOpenBumpPage(sub))
+          temp.push_back(sub);
+      }
+      delete it;
+    }
+  }
+
+  // the escaped ones join the new generation where they are.
+  vector<ObjMeta*> dead;
+  for (auto* m : regionObjs) {
+    if (m->color == ObjMeta::Color::White) {
+      dead.push_back(m);
+      continue;
+    }
+    heap.keepInBumpPage(m);
+    newGen.push_back(m);
+    if (auto* it = m->klass()->enumPtrs(m)) {
+      for (; auto* p = it->getNext();)
+        p->setRoot(false);
+      delete it;
+    }
+  }
+  regionObjs.clear();
+  regionRefs.clear();
+  regionDepth = 0;
+
+  // destructors may allocate, so run them after the region is closed.
+  for (auto* m : dead)
+    m->destroy();
+#if TGC_HYBRID_RC
+  // their memory goes with the pages, so nothing should refer to it after.
+  flushReleases();
+  dropReleases(dead.data(), dead.size());
+#endif
+  for (auto* page : regionPages)
+    heap.closeBumpPage(page);
+  regionPages.clear();
+  regionCur = regionEnd = nullptr;
+  recorder.end("close region", dead.size());
+}
+
+void Collector::endDelete() {
+#if TGC_THREADS
+  // the world stopped by beginDelete.
+  struct Resume {
+    Collector* c;
+    ~Resume() { c->resumeWorld(); }
+  } resume{this};
+#endif
+  if (--deleteDepth)
+    return;
+  // the destructors may delete more while freeing.
+  auto metas = move(deleted);
+  deleted.clear();
+  if (metas.empty())
+    return;
+  sort(metas.begin(), metas.end());
+  metas.erase(unique(metas.begin(), metas.end()), metas.end());
+#if TGC_CHECK_DELETE
+  auto referenced = findReferenced(metas);
+  metas.erase(remove_if(metas.begin(), metas.end(),
+                        [&](ObjMeta* m) { return referenced.count(m); }),
+              metas.end());
+#endif
+#if TGC_HYBRID_RC
+  // the releases may still refer to them, so they go after the ones being
+  // released when called from there.
+  flushReleases();
+  if (flushingReleases) {
+    dying.insert(dying.end(), metas.begin(), metas.end());
+    return;
+  }
+#endif
+  size_t freed = 0;
+  for (auto* m : metas)
+    freed += freeDeleted(m);
+  if (freed && gcCond)
+    gcCond->onFreed(this, freed);
+}
+
+bool Collector::freeDeleted(ObjMeta* m) {
+  // the ones being created, or in an open region, are freed with the rest.
+  if (m->discovering || inRegion(m))
+    return false;
+  if (!m->isLeaf) {
+    auto& gen = m->isOld ? oldGen : newGen;
+    if (m->genIndex >= gen.size() || gen[m->genIndex] != m)
+      return false;
+    gen.remove(m);
+#if TGC_MIXED_GC
+    if (m->isOld)
+      leaveOldRegion(m);
+#endif
+  }
+  delete m;
+  return true;
+}
+
+#if TGC_HYBRID_RC
+// The increments are applied at once, so a count never drops below the
+// decrements still buffered for it, and they are applied in any order.
+void Collector::flushReleases() {
+  if (flushingReleases || releases.empty())
+    return;  // by a destructor run from here, the loop goes on
+  flushingReleases = true;
+  recorder.begin("releases");
+  auto usedBefore = heap.getStats().usedBytes;
+  while (releases.size()) {
+    auto* m = releases.back();
+    releases.pop_back();
+    // destroyed ones are freed by gc_delete or the sweep, the ones of a
+    // region when it closes.
+    if (--m->refCount || m->destroyed || inRegion(m))
+      continue;
+    m->destroy();
+    dying.push_back(m);
+  }
+  // the destructors released more of them, so they are freed last.
+  size_t freed = 0;
+  for (auto* m : dying)
+    freed += freeDeleted(m);
+  dying.clear();
+  flushingReleases = false;
+  recorder.end("releases", freed, freedSince(usedBefore));
+  if (freed && !collecting && gcCond)
+    gcCond->onFreed(this, freed);
+}
+
+void Collector::dropReleases(ObjMeta* const* metas, size_t n) {
+  if (releases.empty())
+    return;
+  vector<ObjMeta*> sorted(metas, metas + n);
+  sort(sorted.begin(), sorted.end());
+  releases.erase(remove_if(releases.begin(), releases.end(),
+                           [&](ObjMeta* m) {
+                             return binary_search(sorted.begin(),
+                                                  sorted.end(), m);
+                           }),
+                 releases.end());
+}
+#endif
+
+#if TGC_CHECK_DELETE
+// Looks for the gc pointers to the objects in the roots and the heap, the
+// stack is not scanned in the conservative mode.
+unordered_set<ObjMeta*> Collector::findReferenced(
+    const vector<ObjMeta*>& metas) {
+  unordered_set<ObjMeta*> targets(metas.begin(), metas.end()), found;
+  auto check = [&](const PtrBase* p) {
+    if (auto* m = p->getMeta(); m && targets.count(m))
+      found.insert(m);
+  };
+  auto checkObjs = [&](auto& objs) {
+    for (auto* o : objs) {
+      if (auto* it = o->klass()->enumPtrs(o)) {
+        for (; auto* p = it->getNext();)
+          check(p);
+        delete it;
+      }
+    }
+  };
+  flushBarrierLog();
+  for (auto* p : roots)
+    check(p);
+  // the roots logged since the last gc.
+  for (auto* p : delayIntergenerationalPtrs)
+    if (p->isRoot())
+      check(p);
+  checkObjs(newGen);
+  checkObjs(oldGen);
+  checkObjs(regionObjs);
+  return found;
+}
+#endif
+
+void Collector::handleDelayIntergenerationalPtrs() {
+  for (auto* p : delayIntergenerationalPtrs) {
+    if (p->isRoot())
+      roots.insert(p);
+    else if (p->isOld()) {
+#if TGC_MIXED_GC
+      // to old objects, they are for the region of the target.
+      if (auto* m = p->getMeta(); m && m->isOld) {
+        remember(p, nullptr);
+        continue;
+      }
+#endif
+      intergenerationalPtrs.insert(p);
+    }
+  }
+  delayIntergenerationalPtrs.clear();
+}
+
+void Collector::markIntergenerationalPtrs() {
+  recorder.begin("mark remembered set");
+  for (auto ptr : intergenerationalPtrs) {
+    auto* m = ptr->getMeta();
+    if (!m)
+      continue;
+#if TGC_MIXED_GC
+    // the old ones are kept by the remembered sets of the regions, the ones
+    // promoted by this gc join them.
+    if (m->isOld) {
+      if (mixed)
+        continue;
+    } else if (!m->isLeaf && m->scanCountInNewGen + 1 >= scanCountToOldGen) {
+      toRemember.emplace_back(ptr, nullptr);
+    }
+#endif
+    mark(m);
+  }
+  recorder.end("mark remembered set", intergenerationalPtrs.size());
+}
+
+#if TGC_MIXED_GC
+//////////////////////////////////////////////////////////////////////////
+/// Old regions
+
+static size_t oldBytes(const ObjMeta* m) {
+  return sizeof(ObjMeta) + m->klass()->size * m->arrayLength();
+}
+
+// Only a live old object that holds p is taken, container buffers and the
+// objects of closed gc regions have no header to find.
+const ObjMeta* Collector::findOldOwner(const PtrBase* p) const {
+  auto* m = heap.findObject(p);
+  if (!m || !m->isOld || m->isLeaf || m->isFrozen() ||
+      m->genIndex >= oldGen.size() || oldGen[m->genIndex] != m)
+    return nullptr;
+  auto* o = m->objPtr();
+  auto end = o + m->klass()->size * m->arrayLength();
+  return (const char*)p >= o && (const char*)p < end ? m : nullptr;
+}
+
+// The old leaves are not in the regions, only full gcs sweep them.
+void Collector::remember(const PtrBase* p, const ObjMeta* owner) {
+  auto* m = p->getMeta();
+  if (!m || !m->isOld || m->isLeaf)
+    return;
+  if (!owner)
+    owner = findOldOwner(p);
+  auto to = oldRegionOf(m);
+  auto from = owner ? oldRegionOf(owner) : NoRegion;
+  // a stale entry of another region only marks more.
+  if (from == to)
+    return;
+  auto it = remembered.emplace(p, to).first;
+  if (it->second != to) {
+    oldRegions[it->second].remset.erase(p);
+    it->second = to;
+  }
+  oldRegions[to].remset[p] = from;
+}
+
+void Collector::forget(const PtrBase* p) {
+  auto it = remembered.find(p);
+  if (it == remembered.end())
+    return;
+  oldRegions[it->second].remset.erase(p);
+  remembered.erase(it);
+}
+
+void Collector::rememberPromoted() {
+  for (auto& i : toRemember)
+    remember(i.first, i.second);
+  toRemember.clear();
+}
+
+// After a full gc, all the garbage is gone.
+void Collector::countOldRegions() {
+  for (auto& i : oldRegions) {
+    i.second.bytes = i.second.garbage = 0;
+    i.second.objs.clear();
+  }
+  for (auto* m : oldGen) {
+    auto& region = oldRegions[oldRegionOf(m)];
+    region.bytes += oldBytes(m);
+    region.objs.insert(m);
+  }
+  for (auto it = oldRegions.begin(); it != oldRegions.end();) {
+    if (!it->second.bytes && it->second.remset.empty())
+      it = oldRegions.erase(it);
+    else
+      ++it;
+  }
+  oldGenSizeAfterGc = oldGen.size();
+}
+
+// Taken out of the old generation without a gc, freed or frozen.
+void Collector::leaveOldRegion(ObjMeta* m) {
+  auto it = oldRegions.find(oldRegionOf(m));
+  if (it != oldRegions.end())
+    it->second.objs.erase(m);
+}
+
+// The most garbage first, as long as the bytes to trace fit the budget.
+void Collector::selectCollectionSet() {
+  vector<pair<size_t, uintptr_t>> garbage;
+  for (auto& i : oldRegions)
+    if (i.second.garbage)
+      garbage.emplace_back(i.second.garbage, i.first);
+  sort(garbage.begin(), garbage.end(), greater<>());
+  size_t bytes = 0;
+  for (auto& i : garbage) {
+    auto sz = oldRegions[i.second].bytes;
+    if (collectionSet.size() && bytes + sz > mixedGcBudget)
+      break;
+    bytes += sz;
+    collectionSet.push_back(i.second);
+  }
+  sort(collectionSet.begin(), collectionSet.end());
+}
+
+void Collector::sweepCollectionSet(vector<ObjMeta*>& objs) {
+  recorder.begin("sweep old regions");
+  auto usedBefore = heap.getStats().usedBytes;
+  for (auto r : collectionSet) {
+    auto& region = oldRegions[r];
+    region.bytes = region.garbage = 0;
+  }
+  vector<ObjMeta*> dead;
+  for (auto* m : objs) {
+    if (m->color == ObjMeta::Color::White) {
+      oldGen.remove(m);
+      oldRegions[oldRegionOf(m)].objs.erase(m);
+      dead.push_back(m);
+    } else {
+      oldRegions[oldRegionOf(m)].bytes += oldBytes(m);
+    }
+  }
+  // what they kept in the other regions may be garbage now.
+  for (auto* m : dead) {
+    auto* it = m->destroyed ? nullptr : m->klass()->enumPtrs(m);
+    if (!it)
+      continue;
+    for (; auto* p = it->getNext();) {
+      auto* t = p->getMeta();
+      if (t && t->isOld && !t->isLeaf && !t->isFrozen() && !inCollectionSet(t))
+        oldRegions[oldRegionOf(t)].garbage += oldBytes(t);
+    }
+    delete it;
+  }
+  freeDead(dead);
+  for (auto r : collectionSet) {
+    auto it = oldRegions.find(r);
+    if (it != oldRegions.end() && !it->second.bytes &&
+        it->second.remset.empty())
+      oldRegions.erase(it);
+  }
+  recorder.end("sweep old regions", dead.size(), freedSince(usedBefore));
+}
+#endif
+
+//////////////////////////////////////////////////////////////////////////
+/// Frozen objects
+
+size_t Collector::freeze(ObjMeta* root) {
+#if TGC_THREADS
+  StopTheWorld stop(this);
+#endif
+  // the objects of a region may still go with it.
+  if (!root || regionDepth)
+    return 0;
+  size_t n = 0;
+  temp.push_back(root);
+  while (temp.size()) {
+    auto* m = temp.back();
+    temp.pop_back();
+#if TGC_HYBRID_RC
+    // the count would free them when their last root goes.
+    m->counted = false;
+#endif
+    if (m->isLeaf) {
+      heap.freezeLeaf(m);
+      continue;
+    }
+    if (m->isFrozen())
+      continue;
+    (m->isOld ? oldGen : newGen).remove(m);
+#if TGC_MIXED_GC
+    if (m->isOld)
+      leaveOldRegion(m);
+#endif
+    m->color = ObjMeta::Color::Frozen;
+    m->isOld = true;
+    frozen.push_back(m);
+    n++;
+    if (auto* it = m->klass()->enumPtrs(m)) {
+      for (; auto* p = it->getNext();) {
+        // the barrier files the written ones as roots.
+        p->setRoot(true);
+        p->setOld(false);
+        intergenerationalPtrs.erase(p);
+        if (auto* sub = p->getMeta())
+          temp.push_back(sub);
+      }
+      delete it;
+    }
   }
-  for (auto* i : IPtrEnumerator::buf)
-    delete[] i;
+  return n;
+}
 
-  delete gcCond;
+size_t Collector::thaw() {
+#if TGC_THREADS
+  StopTheWorld stop(this);
+#endif
+  auto n = frozen.size();
+  while (frozen.size()) {
+    auto* m = frozen.back();
+    frozen.pop_back();
+    m->color = ObjMeta::Color::Black;
+    if (auto* it = m->klass()->enumPtrs(m)) {
+      for (; auto* p = it->getNext();) {
+        p->setRoot(false);
+        roots.erase(p);
+      }
+      delete it;
+    }
+    promote(m);
+  }
+#if TGC_MIXED_GC
+  rememberPromoted();
+#endif
+  heap.thawLeaves();
+  return n;
 }
 
-void Collector::addMeta(ObjMeta* meta) {
-  newGen.push_back(meta);
-  creatingObjs.push_back(meta);
+//////////////////////////////////////////////////////////////////////////
+/// Heap image
+
+// The file holds the header, the classes, the layout of the pages, the
+// offsets of the objects, then the pages. A gc pointer in the pages holds
+// the offset of its object in granules plus one, so that 0 is null.
+struct ImageHeader {
+  char magic[8];
+  uint32_t ptrSize;
+  uint32_t pageShift;
+  uint32_t classCnt;
+  uint32_t pageCnt;
+  uint64_t objCnt;
+  uint64_t root;  // offset of the header of the root
+};
+
+static const char ImageMagic[8] = "tgc2img";
+using ImageRef = conditional_t<TGC_COMPRESSED_PTRS, uint32_t, uint64_t>;
+using ImageFile = unique_ptr<FILE, int (*)(FILE*)>;
+
+static size_t imageSize(ObjMeta* m) {
+  auto prefix = m->isArray ? ObjMeta::ArrayPrefix : 0;
+  return prefix + sizeof(ObjMeta) + m->klass()->size * m->arrayLength();
 }
 
-void Collector::tryRegisterToClass(PtrBase* p) {
-  if (ClassMeta::isCreatingObj > 0) {
-    // owner may not be the current one(e.g. constructor recursed)
-    for (auto i = creatingObjs.rbegin(); i != creatingObjs.rend(); ++i) {
-      auto* owner = *i;
-      if (!owner->klass->registered && owner->containsPtr((char*)p)) {
-        owner->klass->registerSubPtr(owner, p);
-        break;
+bool Collector::saveImage(const char* path, ObjMeta* root) {
+#if TGC_THREADS
+  StopTheWorld stop(this);
+#endif
+  if (!root)
+    return false;
+
+  // the objects in the order they are found, with their offsets.
+  vector<ObjMeta*> objs{root};
+  unordered_map<ObjMeta*, uint64_t> offsets{{root, 0}};
+  for (size_t i = 0; i < objs.size(); i++) {
+    auto* m = objs[i];
+    auto* c = m->klass();
+    if (!c->imageSafe || !c->registered || m->destroyed ||
+        heap.inOpenBumpPage(m))
+      return false;
+    if (auto* it = c->enumPtrs(m)) {
+      for (; auto* p = it->getNext();) {
+        auto* sub = p->getMeta();
+        if (sub && offsets.emplace(sub, 0).second)
+          objs.push_back(sub);
       }
+      delete it;
+    }
+  }
+
+  // pack them like the bump pages of a region.
+  vector<uint32_t> layout;
+  size_t pos = Heap::PageSize;
+  for (auto* m : objs) {
+    auto sz = alignUp(imageSize(m), Heap::Granularity);
+    auto prefix = m->isArray ? ObjMeta::ArrayPrefix : 0;
+    if (sz > Heap::MaxSmallSize) {
+      auto n = alignUp(sz, Heap::PageSize) >> Heap::PageShift;
+      offsets[m] = (layout.size() << Heap::PageShift) + prefix;
+      layout.push_back(Heap::ImageLargePage | uint32_t(n));
+      layout.resize(layout.size() + n - 1);
+      pos = Heap::PageSize;
+      continue;
+    }
+    if (pos + sz > Heap::PageSize) {
+      layout.push_back(0);
+      pos = 0;
+    }
+    offsets[m] = ((layout.size() - 1) << Heap::PageShift) + pos + prefix;
+    layout.back()++;
+    pos += sz;
+  }
+
+  unordered_map<ClassMeta*, const char*> names;
+  for (auto& i : ClassMeta::imageClasses())
+    names.emplace(i.second, i.first);
+  vector<ClassMeta*> classes;
+  unordered_map<ClassMeta*, unsigned> classIdx;
+  vector<char> data(layout.size() << Heap::PageShift);
+  vector<uint64_t> objOffsets;
+  objOffsets.reserve(objs.size());
+  for (auto* m : objs) {
+    auto* c = m->klass();
+    auto cls = classIdx.emplace(c, (unsigned)classes.size());
+    if (cls.second)
+      classes.push_back(c);
+    auto off = offsets[m];
+    objOffsets.push_back(off);
+    auto* h = (ObjMeta*)&data[off];
+    memcpy((char*)h - ((char*)m - m->allocPtr()), m->allocPtr(),
+           imageSize(m));
+    h->color = ObjMeta::Color::Black;
+    h->scanCountInNewGen = 0;
+    h->isOld = true;
+    h->isLeaf = false;
+    h->classIndex = cls.first->second;
+    h->genIndex = 0;
+    h->counted = false;
+    h->refCount = 0;
+    if (auto* it = c->enumPtrs(m)) {
+      for (; auto* p = it->getNext();) {
+        auto* sub = p->getMeta();
+        ImageRef ref = sub ? ImageRef(offsets[sub] / Heap::Granularity + 1) : 0;
+        auto* slot = h->objPtr() + ((const char*)p - m->objPtr());
+        memset(slot, 0, sizeof(PtrBase));
+        memcpy(slot, &ref, sizeof(ref));
+      }
+      delete it;
     }
   }
-}
 
-void Collector::handleUnrefs() {
-  for (auto ptr : unrefs) {
-    intergenerationalPtrs.erase(ptr);
-    delayIntergenerationalPtrs.erase(ptr);
-    roots.erase(ptr);
+  ImageFile f(fopen(path, "wb"), fclose);
+  if (!f)
+    return false;
+  ImageHeader hdr;
+  memcpy(hdr.magic, ImageMagic, sizeof(hdr.magic));
+  hdr.ptrSize = sizeof(PtrBase);
+  hdr.pageShift = Heap::PageShift;
+  hdr.classCnt = (uint32_t)classes.size();
+  hdr.pageCnt = (uint32_t)layout.size();
+  hdr.objCnt = objs.size();
+  hdr.root = offsets[root];
+  auto write = [&](const void* p, size_t sz) {
+    return fwrite(p, 1, sz, f.get()) == sz;
+  };
+  bool ok = write(&hdr, sizeof(hdr));
+  for (auto* c : classes) {
+    auto* name = names[c];
+    uint32_t cls[] = {(uint32_t)strlen(name), c->size,
+                      c->subPtrOffsets ? (uint32_t)c->subPtrOffsets->size()
+                                       : 0};
+    ok = ok && write(cls, sizeof(cls)) && write(name, cls[0]) &&
+         (!cls[2] || write(c->subPtrOffsets->data(),
+                           cls[2] * sizeof(ClassMeta::OffsetType)));
   }
-  unrefs.clear();
+  ok = ok && write(layout.data(), layout.size() * sizeof(uint32_t)) &&
+       write(objOffsets.data(), objOffsets.size() * sizeof(uint64_t)) &&
+       write(data.data(), data.size());
+  return ok;
 }
 
-void Collector::handleDelayIntergenerationalPtrs() {
-  for (auto* p : delayIntergenerationalPtrs) {
-    if (p->isRoot)
-      roots.insert(p);
-    else if (p->isOld) {
-      intergenerationalPtrs.insert(p);
+ObjMeta* Collector::loadImage(const char* path, ClassMeta* rootClass) {
+#if TGC_THREADS
+  StopTheWorld stop(this);
+#endif
+  ImageFile f(fopen(path, "rb"), fclose);
+  if (!f)
+    return nullptr;
+  auto read = [&](void* p, size_t sz) {
+    return fread(p, 1, sz, f.get()) == sz;
+  };
+  ImageHeader hdr;
+  if (!read(&hdr, sizeof(hdr)) || memcmp(hdr.magic, ImageMagic, 8) ||
+      hdr.ptrSize != sizeof(PtrBase) || hdr.pageShift != Heap::PageShift ||
+      !hdr.pageCnt)
+    return nullptr;
+
+  // the classes are matched by name and should have the same layout.
+  unordered_map<string, ClassMeta*> byName;
+  for (auto& i : ClassMeta::imageClasses())
+    byName.emplace(i.first, i.second);
+  vector<ClassMeta*> classes(hdr.classCnt);
+  for (auto& c : classes) {
+    uint32_t cls[3];
+    if (!read(cls, sizeof(cls)))
+      return nullptr;
+    string name(cls[0], '\0');
+    vector<ClassMeta::OffsetType> subPtrs(cls[2]);
+    if (!read(&name[0], name.size()) ||
+        !read(subPtrs.data(), subPtrs.size() * sizeof(subPtrs[0])))
+      return nullptr;
+    auto it = byName.find(name);
+    if (it == byName.end())
+      return nullptr;
+    c = it->second;
+    auto* known = c->subPtrOffsets;
+    if (!c->registered || c->size != cls[1] ||
+        subPtrs != (known ? *known : vector<ClassMeta::OffsetType>()))
+      return nullptr;
+    if (!c->index)
+      c->index = ClassMeta::registerClass(c);
+  }
+
+  vector<uint32_t> layout(hdr.pageCnt);
+  vector<uint64_t> objOffsets(hdr.objCnt);
+  if (!read(layout.data(), layout.size() * sizeof(uint32_t)) ||
+      !read(objOffsets.data(), objOffsets.size() * sizeof(uint64_t)))
+    return nullptr;
+  for (uint32_t i = 0; i < hdr.pageCnt;) {
+    auto run = layout[i] & Heap::ImageLargePage
+                   ? layout[i] & ~Heap::ImageLargePage
+                   : 1;
+    if (!layout[i] || !run || run > hdr.pageCnt - i)
+      return nullptr;
+    i += run;
+  }
+
+  auto* base = heap.allocImage(layout.data(), hdr.pageCnt);
+  if (!base && heap.limitReached()) {
+    handleMemoryPressure(MemoryPressure::Critical);
+    base = heap.allocImage(layout.data(), hdr.pageCnt);
+  }
+  if (!base)
+    throw std::bad_alloc();
+  auto dataSize = size_t(hdr.pageCnt) << Heap::PageShift;
+  auto fail = [&] {
+    heap.releaseImage(base, hdr.pageCnt);
+    return nullptr;
+  };
+  if (!read(base, dataSize))
+    return fail();
+
+  // relocate the classes and the gc pointers.
+  vector<ObjMeta*> metas;
+  metas.reserve(objOffsets.size());
+  for (auto off : objOffsets) {
+    auto* m = (ObjMeta*)(base + off);
+    if (off % Heap::Granularity || off + sizeof(ObjMeta) > dataSize ||
+        m->magic != ObjMeta::Magic || m->classIndex >= classes.size())
+      return fail();
+    auto* c = classes[m->classIndex];
+    m->classIndex = c->index;
+    m->counted = false;
+    if (off + imageSize(m) > dataSize)
+      return fail();
+    if (auto* it = c->enumPtrs(m)) {
+      bool ok = true;
+      for (; auto* cp = it->getNext();) {
+        auto* p = const_cast<PtrBase*>(cp);
+        ImageRef ref;
+        memcpy(&ref, p, sizeof(ref));
+        auto target = (uint64_t(ref) - 1) * Heap::Granularity;
+        ok = ok && (!ref || target + sizeof(ObjMeta) <= dataSize);
+        p->setMeta(ref && ok ? (ObjMeta*)(base + target) : nullptr);
+        p->setOld(true);
+        p->setRoot(false);
+      }
+      delete it;
+      if (!ok)
+        return fail();
     }
+    metas.push_back(m);
   }
-  delayIntergenerationalPtrs.clear();
+  auto* root = (ObjMeta*)(base + hdr.root);
+  if (hdr.root + sizeof(ObjMeta) > dataSize || root->magic != ObjMeta::Magic ||
+      root->klass() != rootClass)
+    return fail();
+  oldGen.append(metas.data(), metas.size());
+#if TGC_MIXED_GC
+  for (auto* m : metas) {
+    auto& region = oldRegions[oldRegionOf(m)];
+    region.bytes += oldBytes(m);
+    region.objs.insert(m);
+    if (auto* it = m->klass()->enumPtrs(m)) {
+      for (; auto* p = it->getNext();)
+        remember(p, m);
+      delete it;
+    }
+  }
+#endif
+  return root;
 }
 
+//////////////////////////////////////////////////////////////////////////
+
 ObjMeta* Collector::globalFindOwnerMeta(void* obj) {
   auto* meta = (ObjMeta*)((char*)obj - sizeof(ObjMeta));
   if (meta->magic == ObjMeta::Magic)
@@ -216,16 +2659,19 @@ ObjMeta* Collector::globalFindOwnerMeta(void* obj) {
 
 void Collector::mark(ObjMeta* meta) {
   auto doMark = [&](ObjMeta* meta) {
-    if (meta->color == ObjMeta::Color::White) {
+    if (meta->isLeaf) {
+      heap.markLeaf(meta);
+    } else if (meta->color == ObjMeta::Color::White) {
       meta->color = ObjMeta::Color::Black;
 
-      if (auto* ptrIt = meta->klass->enumPtrs(meta)) {
-        for (; auto* child = ptrIt->getNext();) {
-          if (auto* m = child->meta) {
-            if (m->color == ObjMeta::Color::White)
-              temp.push_back(m);
-          }
-        }
+      if (auto* ptrIt = meta->klass()->enumPtrs(meta)) {
+        forEachPtr(ptrIt, [&](const PtrBase* child) {
+          auto* m = child->getMeta();
+          if (m->isLeaf)
+            heap.markLeaf(m);
+          else if (m->color == ObjMeta::Color::White)
+            temp.push_back(m);
+        });
         delete ptrIt;
       }
     }
@@ -242,23 +2688,47 @@ void Collector::mark(ObjMeta* meta) {
 // Unified way for objects and containers.
 void Collector::preMark(ObjMeta* meta) {
   auto work = [&](ObjMeta* meta) {
+    // objects of an open region keep their pointers as roots.
+    if (regionDepth && heap.inOpenBumpPage(meta))
+      return;
+#if TGC_MIXED_GC
+    // nor are the old ones out of the regions of a mixed gc walked.
+    if (mixed && meta->isOld && !inCollectionSet(meta))
+      return;
+#endif
     // fix for circular references.
     if (meta->color == ObjMeta::Color::Black) {
       // sweep function cannot reset color of intergenerational objects.
       meta->color = ObjMeta::Color::White;
+      if (meta->creating)
+        constructing.push_back(meta);
 
       meta->hasSubPtrs = true;
-      if (auto* it = meta->klass->enumPtrs(meta)) {
+      if (auto* it = meta->klass()->enumPtrs(meta)) {
         meta->hasSubPtrs = false;
 
-        for (; auto* ptr = it->getNext();) {
-          ptr->isRoot = false;
+        auto visit = [&](const PtrBase* ptr) {
+          auto* subMeta = ptr->getMeta();
+          // fix for circular references.
+          if (subMeta->color == ObjMeta::Color::Black && !subMeta->isLeaf)
+            temp.push_back(subMeta);
+        };
+        const PtrBase* run;
+        if (auto n = it->getRun(run)) {
           meta->hasSubPtrs = true;
-
-          if (auto* subMeta = ptr->meta) {
-            // fix for circular references.
-            if (subMeta->color == ObjMeta::Color::Black)
-              temp.push_back(ptr->meta);
+          scanRun(run, n, visit, [](const PtrBase* c, size_t len) {
+            // most are cleared already, leave their lines clean.
+            for (size_t i = 0; i < len; i++) {
+              if (c[i].isRoot())
+                c[i].setRoot(false);
+            }
+          });
+        } else {
+          for (; auto* ptr = it->getNext();) {
+            ptr->setRoot(false);
+            meta->hasSubPtrs = true;
+            if (ptr->getMeta())
+              visit(ptr);
           }
         }
         delete it;
@@ -274,112 +2744,907 @@ void Collector::preMark(ObjMeta* meta) {
   }
 }
 
+size_t Collector::freedSince(size_t usedBefore) const {
+  auto used = heap.getStats().usedBytes;
+  return usedBefore > used ? usedBefore - used : 0;
+}
+
 void Collector::minorCollect() {
+#if TGC_THREADS
+  StopTheWorld stop(this);
+#endif
+#if TGC_HYBRID_RC
+  // a gc from a destructor run by flushReleases waits for the next one.
+  if (flushingReleases)
+    return;
+  flushReleases();
+#endif
+#if TGC_CONSERVATIVE_ROOTS
+  findStackRoots();
+#endif
+  recorder.begin("minor gc");
+#if TGC_ALLOC_TRACE
+  trace.gc(GcTrace::Kind::MinorGc);
+#endif
+  auto usedBefore = heap.getStats().usedBytes;
   freeObjCntOfPrevGc = 0;
   newGenGcCount++;
+  collecting = true;
 
+  recorder.begin("preMark");
   for (auto meta : newGen)
     preMark(meta);
+  recorder.end("preMark", newGen.size());
 
-  handleUnrefs();
+  recorder.begin("barrier log");
+  auto logged = barrierLog.size();
+  flushBarrierLog();
   handleDelayIntergenerationalPtrs();
+  recorder.end("barrier log", logged);
 
+  recorder.begin("mark roots");
   for (auto ptr : roots) {
-    if (ptr->meta && !ptr->isOld) {
-      mark(ptr->meta);
+    if (auto* m = ptr->getMeta(); m && !ptr->isOld()) {
+      mark(m);
     }
   }
+  // deleted by a destructor that allocated, they are freed after it.
+  for (auto* m : deleted)
+    if (!m->isOld)
+      mark(m);
+  // nothing refers to the ones in their constructor yet.
+  for (auto* m : constructing)
+    mark(m);
+  constructing.clear();
+#if TGC_CONSERVATIVE_ROOTS
+  for (auto* m : stackRoots)
+    mark(m);
+  recorder.end("mark roots", roots.size() + stackRoots.size());
+  stackRoots.clear();
+#else
+  recorder.end("mark roots", roots.size());
+#endif
 
-  for (auto ptr : intergenerationalPtrs) {
-    if (ptr->meta)
-      mark(ptr->meta);
-  }
+  markIntergenerationalPtrs();
+  markFromRegion();
 
   sweep(newGen);
+  recorder.begin("sweep leaves");
+  auto leaves = heap.sweepLeaves(false);
+  recorder.end("sweep leaves", leaves);
+  freeObjCntOfPrevGc += (int)leaves;
+  collecting = false;
+  recorder.end("minor gc", freeObjCntOfPrevGc,
+               freedSince(usedBefore));
 }
 
 void Collector::sweep(MetaSet& gen) {
-  for (auto it = gen.begin(); it != gen.end();) {
-    auto* meta = *it;
-
+  auto* name = &gen == &oldGen ? "sweep old" : "sweep new";
+  recorder.begin(name);
+  auto usedBefore = heap.getStats().usedBytes;
+  vector<ObjMeta*> dead;
+  // temp is empty after marking.
+  auto& promoted = temp;
+  gen.retain([&](ObjMeta* meta) {
     if (meta->color == ObjMeta::Color::White) {
-      freeObjCntOfPrevGc++;
-      it = gen.erase(it);
-      delete meta;
-    } else {
-      if (!full && ++meta->scanCountInNewGen >= scanCountToOldGen) {
-        meta->scanCountInNewGen = 0;
-        it = newGen.erase(it);
-        promote(meta);
-      } else
-        ++it;
+      dead.push_back(meta);
+      return false;
+    }
+    if (!full && ++meta->scanCountInNewGen >= scanCountToOldGen) {
+      meta->scanCountInNewGen = 0;
+      promoted.push_back(meta);
+      return false;
     }
+    return true;
+  });
+
+  if (promoted.size()) {
+    recorder.begin("promote");
+    size_t interned = 0;
+    for (auto* meta : promoted)
+      interned += promote(meta);
+    recorder.end("promote", promoted.size(), interned);
+    promoted.clear();
   }
+#if TGC_MIXED_GC
+  rememberPromoted();
+#endif
 
-  if (trace)
-    printf("sweep %s, free cnt:%d\n", &gen == &oldGen ? "old" : "new",
-           freeObjCntOfPrevGc);
+  // destructors may allocate, so run them after the set is settled.
+  freeDead(dead);
+  recorder.end(name, dead.size(), freedSince(usedBefore));
+
+#if TGC_GC_TRACE
+  printf("sweep %s, free cnt:%d\n", &gen == &oldGen ? "old" : "new",
+         freeObjCntOfPrevGc);
+#endif
+}
+
+void Collector::freeDead(vector<ObjMeta*>& dead) {
+  freeObjCntOfPrevGc += (int)dead.size();
+#if TGC_HYBRID_RC
+  // the releases may refer to the dead ones, so they are applied in between.
+  // The dead old ones may point to the dead young ones, so a full or mixed
+  // gc frees them after sweeping both gens.
+  for (auto* meta : dead)
+    meta->destroy();
+  swept.insert(swept.end(), dead.begin(), dead.end());
+  if (!full && !mixed)
+    freeSwept();
+#else
+  for (auto* meta : dead)
+    delete meta;
+#endif
+}
+
+#if TGC_HYBRID_RC
+void Collector::freeSwept() {
+  flushReleases();
+  for (auto* meta : swept)
+    delete meta;
+  swept.clear();
 }
+#endif
 
-void Collector::promote(ObjMeta* meta) {
+size_t Collector::promote(ObjMeta* meta) {
+  meta->isOld = true;
   oldGen.push_back(meta);
-  if (auto it = meta->klass->enumPtrs(meta)) {
-    for (; auto* p = it->getNext();) {
-      p->isOld = true;
-      if (p->meta)
-        intergenerationalPtrs.insert(p);
+#if TGC_MIXED_GC
+  auto& region = oldRegions[oldRegionOf(meta)];
+  auto bytes = oldBytes(meta);
+  region.bytes += bytes;
+  region.garbage += bytes;
+  region.objs.insert(meta);
+#endif
+  size_t freed = 0;
+#if TGC_STRING_DEDUP
+  if (meta->klass()->internable && !meta->destroyed) {
+    auto* s = (istring*)meta->objPtr();
+    for (size_t i = 0, n = meta->arrayLength(); i < n; i++)
+      freed += strings.intern(s[i].rep);
+  }
+#endif
+  if (auto it = meta->klass()->enumPtrs(meta)) {
+    auto remember = [&](const PtrBase* p) {
+      intergenerationalPtrs.insert(p);
+#if TGC_MIXED_GC
+      toRemember.emplace_back(p, meta);
+#endif
+    };
+    const PtrBase* run;
+    if (auto n = it->getRun(run)) {
+      scanRun(run, n, remember, [](const PtrBase* c, size_t len) {
+        for (size_t i = 0; i < len; i++)
+          c[i].setOld(true);
+      });
+    } else {
+      for (; auto* p = it->getNext();) {
+        p->setOld(true);
+        if (p->getMeta())
+          remember(p);
+      }
     }
     delete it;
   }
+  return freed;
 }
 
 void Collector::fullCollect() {
+#if TGC_THREADS
+  StopTheWorld stop(this);
+#endif
+#if TGC_HYBRID_RC
+  // a gc from a destructor run by flushReleases waits for the next one.
+  if (flushingReleases)
+    return;
+  flushReleases();
+#endif
+#if TGC_CONSERVATIVE_ROOTS
+  findStackRoots();
+#endif
+  recorder.begin("full gc");
+#if TGC_ALLOC_TRACE
+  trace.gc(GcTrace::Kind::FullGc);
+#endif
+  auto usedBefore = heap.getStats().usedBytes;
   freeObjCntOfPrevGc = 0;
   full = true;
+  collecting = true;
   fullGcCount++;
 
+  recorder.begin("preMark");
   for (auto meta : newGen)
     preMark(meta);
   for (auto meta : oldGen)
     preMark(meta);
+  recorder.end("preMark", newGen.size() + oldGen.size());
 
-  handleUnrefs();
+  recorder.begin("barrier log");
+  auto logged = barrierLog.size();
+  flushBarrierLog();
   handleDelayIntergenerationalPtrs();
+  recorder.end("barrier log", logged);
 
+  recorder.begin("mark roots");
   for (auto ptr : roots) {
-    if (ptr->meta) {
-      mark(ptr->meta);
+    if (auto* m = ptr->getMeta()) {
+      mark(m);
     }
   }
+  // deleted by a destructor that allocated, they are freed after it.
+  for (auto* m : deleted)
+    mark(m);
+  // nothing refers to the ones in their constructor yet.
+  for (auto* m : constructing)
+    mark(m);
+  constructing.clear();
+#if TGC_CONSERVATIVE_ROOTS
+  for (auto* m : stackRoots)
+    mark(m);
+  recorder.end("mark roots", roots.size() + stackRoots.size());
+  stackRoots.clear();
+#else
+  recorder.end("mark roots", roots.size());
+#endif
+  markFromRegion();
 
   sweep(newGen);
   sweep(oldGen);
+#if TGC_HYBRID_RC
+  recorder.begin("free swept");
+  auto usedBeforeFree = heap.getStats().usedBytes;
+  auto sweptCnt = swept.size();
+  freeSwept();
+  recorder.end("free swept", sweptCnt, freedSince(usedBeforeFree));
+#endif
+  recorder.begin("sweep leaves");
+  auto leaves = heap.sweepLeaves(true);
+  recorder.end("sweep leaves", leaves);
+  freeObjCntOfPrevGc += (int)leaves;
+#if TGC_MIXED_GC
+  countOldRegions();
+#endif
   full = false;
+  collecting = false;
+
+  auto& policy = heap.getPolicy();
+  if (policy.trimBuffers)
+    trimBuffers();
+#if TGC_THREADS
+  // the cells cached by the threads keep their pages.
+  for (auto* t : threads)
+    t->returnCells(heap);
+#endif
+  if (policy.releaseEmptyPages) {
+    recorder.begin("release pages");
+    auto released = heap.getStats().releasedBytes;
+    heap.releaseEmptyPages();
+    recorder.end("release pages", 0,
+                 heap.getStats().releasedBytes - released);
+  }
+  heap.updateSoftLimit();
+  recorder.end("full gc", freeObjCntOfPrevGc,
+               freedSince(usedBefore));
+}
+
+#if TGC_MIXED_GC
+void Collector::mixedCollect() {
+#if TGC_THREADS
+  StopTheWorld stop(this);
+#endif
+#if TGC_HYBRID_RC
+  // a gc from a destructor run by flushReleases waits for the next one.
+  if (flushingReleases)
+    return;
+  flushReleases();
+#endif
+#if TGC_CONSERVATIVE_ROOTS
+  findStackRoots();
+#endif
+  recorder.begin("mixed gc");
+#if TGC_ALLOC_TRACE
+  trace.gc(GcTrace::Kind::MixedGc);
+#endif
+  auto usedBefore = heap.getStats().usedBytes;
+  freeObjCntOfPrevGc = 0;
+  mixed = true;
+  collecting = true;
+  mixedGcCount++;
+
+  recorder.begin("select regions");
+  selectCollectionSet();
+  recorder.end("select regions", collectionSet.size());
+
+  recorder.begin("preMark");
+  for (auto meta : newGen)
+    preMark(meta);
+  // only the objects of the selected regions, not the whole old gen.
+  vector<ObjMeta*> objs;
+  for (auto r : collectionSet) {
+    auto& region = oldRegions[r].objs;
+    objs.insert(objs.end(), region.begin(), region.end());
+  }
+  for (auto meta : objs)
+    preMark(meta);
+  recorder.end("preMark", newGen.size() + objs.size());
+
+  recorder.begin("barrier log");
+  auto logged = barrierLog.size();
+  flushBarrierLog();
+  handleDelayIntergenerationalPtrs();
+  recorder.end("barrier log", logged);
+
+  recorder.begin("mark roots");
+  for (auto ptr : roots) {
+    if (auto* m = ptr->getMeta())
+      mark(m);
+  }
+  // deleted by a destructor that allocated, they are freed after it.
+  for (auto* m : deleted)
+    mark(m);
+  // nothing refers to the ones in their constructor yet.
+  for (auto* m : constructing)
+    mark(m);
+  constructing.clear();
+#if TGC_CONSERVATIVE_ROOTS
+  for (auto* m : stackRoots)
+    mark(m);
+  recorder.end("mark roots", roots.size() + stackRoots.size());
+  stackRoots.clear();
+#else
+  recorder.end("mark roots", roots.size());
+#endif
+  markIntergenerationalPtrs();
+
+  // the pointers from the regions out of the set.
+  recorder.begin("mark old regions");
+  size_t remembered = 0;
+  for (auto r : collectionSet) {
+    for (auto& i : oldRegions[r].remset) {
+      if (binary_search(collectionSet.begin(), collectionSet.end(), i.second))
+        continue;
+      if (auto* m = i.first->getMeta())
+        mark(m);
+      remembered++;
+    }
+  }
+  recorder.end("mark old regions", remembered);
+  markFromRegion();
+
+  sweep(newGen);
+  sweepCollectionSet(objs);
+#if TGC_HYBRID_RC
+  recorder.begin("free swept");
+  auto usedBeforeFree = heap.getStats().usedBytes;
+  auto sweptCnt = swept.size();
+  freeSwept();
+  recorder.end("free swept", sweptCnt, freedSince(usedBeforeFree));
+#endif
+  recorder.begin("sweep leaves");
+  auto leaves = heap.sweepLeaves(false);
+  recorder.end("sweep leaves", leaves);
+  freeObjCntOfPrevGc += (int)leaves;
+  collectionSet.clear();
+  oldGenSizeAfterGc = oldGen.size();
+  mixed = false;
+  collecting = false;
+  recorder.end("mixed gc", freeObjCntOfPrevGc, freedSince(usedBefore));
 }
+#endif
 
 void Collector::collect() {
+#if TGC_THREADS
+  StopTheWorld stop(this);
+#endif
   if (gcCond && gcCond->needFullGc(this)) {
     fullCollect();
+#if TGC_MIXED_GC
+  } else if (gcCond && gcCond->needMixedGc(this)) {
+    mixedCollect();
+#endif
   } else {
     minorCollect();
   }
 }
 
+#if TGC_THREADS
+//////////////////////////////////////////////////////////////////////////
+/// Threads
+
+GcThread* GcThread::attach() {
+  if (exited)
+    return nullptr;
+  // detaches the thread when it exits.
+  struct Detacher {
+    ~Detacher() {
+      if (current)
+        current->detach();
+      current = nullptr;
+      exited = true;
+    }
+  };
+  static thread_local Detacher detacher;
+  (void)detacher;
+
+  auto* c = Collector::get();
+  auto* t = new GcThread();
+  getStackBounds(t->stackLo, t->stackHi);
+  t->caches.resize(c->heap.sizeClassCount());
+  {
+    unique_lock<mutex> lk(c->threadLock);
+    // not into a stopped world.
+    c->threadCv.wait(lk, [c] { return !c->stopRequested; });
+    c->threads.push_back(t);
+  }
+  current = t;
+  return t;
+}
+
+void GcThread::detach() {
+  auto* c = Collector::inst;
+  {
+    lock_guard<mutex> lk(c->threadLock);
+    returnCells(c->heap);
+    c->newGen.append(fresh.data(), fresh.size());
+    c->barrierLog.insert(c->barrierLog.end(), stackLog.begin(),
+                         stackLog.end());
+    c->orphanLog.insert(c->orphanLog.end(), sharedLog.begin(),
+                        sharedLog.end());
+    auto& ts = c->threads;
+    ts.erase(remove(ts.begin(), ts.end(), this), ts.end());
+  }
+  // a gc may wait for this one.
+  c->threadCv.notify_all();
+  delete this;
+}
+
+char* GcThread::allocCell(Collector* c, size_t sz) {
+  auto& cache = caches[c->heap.sizeClassOf(sz)];
+  if (!cache.head) {
+    char* cells[CacheRefill];
+    size_t n;
+    {
+      Collector::ThreadLock lock(c);
+      n = c->heap.allocBatch(sz, CacheRefill, cells);
+    }
+    if (!n)
+      return nullptr;
+    // handed out in the order of the heap.
+    for (auto i = n; i > 0; i--) {
+      *(char**)cells[i - 1] = cache.head;
+      cache.head = cells[i - 1];
+    }
+    cache.cnt = (unsigned)n;
+  }
+  auto* p = cache.head;
+  cache.head = *(char**)p;
+  cache.cnt--;
+  return p;
+}
+
+void GcThread::freeCell(Collector* c, char* p, unsigned sizeClass) {
+  auto& cache = caches[sizeClass];
+  *(char**)p = cache.head;
+  cache.head = p;
+  // past two refills, the others get the cells back.
+  if (++cache.cnt > CacheRefill * 2) {
+    Collector::ThreadLock lock(c);
+    for (; cache.cnt > CacheRefill; cache.cnt--) {
+      auto* q = cache.head;
+      cache.head = *(char**)q;
+      c->heap.free(q);
+    }
+  }
+}
+
+size_t GcThread::cachedBytes(const Heap& heap) {
+  size_t n = 0;
+  if (auto* t = current) {
+    for (unsigned i = 0; i < t->caches.size(); i++)
+      n += t->caches[i].cnt * heap.classSize(i);
+  }
+  return n;
+}
+
+void GcThread::returnCells(Heap& heap) {
+  for (auto& cache : caches) {
+    while (auto* p = cache.head) {
+      cache.head = *(char**)p;
+      heap.free(p);
+    }
+    cache.cnt = 0;
+  }
+}
+
+void Collector::stopWorld() {
+  if (stopDepth) {
+    stopDepth++;
+    return;
+  }
+  auto* t = GcThread::self();
+  // one in a blocking region is counted as stopped already.
+  size_t self = t && !t->blocking ? 1 : 0;
+  unique_lock<mutex> lk(threadLock);
+  // stopped by another thread first, wait for it as a stopped one.
+  while (stopRequested) {
+    stoppedThreads += self;
+    threadCv.notify_all();
+    threadCv.wait(lk, [this] { return !stopRequested; });
+    stoppedThreads -= self;
+  }
+  stopRequested = true;
+  threadCv.wait(lk, [&] { return stoppedThreads + self >= threads.size(); });
+  // held until resumeWorld.
+  lk.release();
+  stopDepth = 1;
+  // only worth a mark when there are others to gather.
+  auto others = threads.size() > 1;
+  if (others)
+    recorder.begin("stop the world");
+  gatherThreads();
+  if (others)
+    recorder.end("stop the world", threads.size());
+}
+
+void Collector::resumeWorld() {
+  if (--stopDepth)
+    return;
+  stopRequested = false;
+  threadLock.unlock();
+  threadCv.notify_all();
+}
+
+void Collector::park() {
+  auto* t = GcThread::self();
+  if (stopDepth || !t)
+    return;
+  // one in a blocking region is counted as stopped already.
+  size_t self = t->blocking ? 0 : 1;
+  unique_lock<mutex> lk(threadLock);
+  if (!stopRequested)
+    return;
+  stoppedThreads += self;
+  threadCv.notify_all();
+  threadCv.wait(lk, [this] { return !stopRequested; });
+  stoppedThreads -= self;
+}
+
+void Collector::enterBlocking() {
+  assert(!stopDepth && "the world is stopped by this thread");
+  auto* t = GcThread::self();
+  if (!t || t->blocking++)
+    return;
+  lock_guard<mutex> lk(threadLock);
+  stoppedThreads++;
+  threadCv.notify_all();
+}
+
+void Collector::leaveBlocking() {
+  auto* t = GcThread::self();
+  if (!t || --t->blocking)
+    return;
+  unique_lock<mutex> lk(threadLock);
+  threadCv.wait(lk, [this] { return !stopRequested; });
+  stoppedThreads--;
+}
+
+size_t Collector::getThreadCount() {
+  ThreadLock lock(this);
+  return threads.size();
+}
+
+// The new objects join the new generation, the logs on the stacks are
+// replayed thread by thread and the others in the order they were written.
+void Collector::gatherThreads() {
+  for (auto* t : threads) {
+    newGen.append(t->fresh.data(), t->fresh.size());
+    t->fresh.clear();
+    barrierLog.insert(barrierLog.end(), t->stackLog.begin(),
+                      t->stackLog.end());
+    t->stackLog.clear();
+    orphanLog.insert(orphanLog.end(), t->sharedLog.begin(),
+                     t->sharedLog.end());
+    t->sharedLog.clear();
+  }
+  sort(orphanLog.begin(), orphanLog.end());
+  for (auto& e : orphanLog)
+    barrierLog.push_back(e.second);
+  orphanLog.clear();
+}
+
+void Collector::logFull(GcThread* t, uintptr_t e) {
+  if (!t) {
+    ThreadLock lock(this);
+    orphanLog.emplace_back(logSeq.fetch_add(1, memory_order_relaxed), e);
+    return;
+  }
+  StopTheWorld stop(this);
+  flushBarrierLog();
+}
+#endif
+
+//////////////////////////////////////////////////////////////////////////
+/// GcRecorder
+
+void GcRecorder::start(size_t capacity) {
+  if (ring.size() != capacity) {
+    ring.assign(max<size_t>(capacity, 1), Event());
+    count = 0;
+  }
+  recording = true;
+}
+
+void GcRecorder::record(const char* name,
+                        bool begin,
+                        size_t objs,
+                        size_t bytes) {
+  auto now = chrono::steady_clock::now().time_since_epoch();
+  auto& e = ring[count++ % ring.size()];
+  e.name = name;
+  e.time = (uint64_t)chrono::duration_cast<chrono::nanoseconds>(now).count();
+  e.objs = objs;
+  e.bytes = bytes;
+  e.begin = begin;
+}
+
+vector<GcRecorder::Event> GcRecorder::events() const {
+  vector<Event> r;
+  auto n = min(count, ring.size());
+  r.reserve(n);
+  for (auto i = count - n; i < count; i++)
+    r.push_back(ring[i % ring.size()]);
+  return r;
+}
+
+// The ends whose begins were overwritten are dropped.
+static vector<GcRecorder::Event> pairedEvents(vector<GcRecorder::Event> es) {
+  int depth = 0;
+  es.erase(remove_if(es.begin(), es.end(),
+                     [&](const GcRecorder::Event& e) {
+                       if (e.begin)
+                         depth++;
+                       else if (depth)
+                         depth--;
+                       else
+                         return true;
+                       return false;
+                     }),
+           es.end());
+  return es;
+}
+
+bool GcRecorder::writeChromeTrace(const char* path) const {
+  auto* f = fopen(path, "w");
+  if (!f)
+    return false;
+  fprintf(f, "{\"traceEvents\":[");
+  auto sep = "\n";
+  for (auto& e : pairedEvents(events())) {
+    fprintf(f,
+            "%s{\"name\":\"%s\",\"cat\":\"gc\",\"ph\":\"%c\","
+            "\"ts\":%.3f,\"pid\":1,\"tid\":1",
+            sep, e.name, e.begin ? 'B' : 'E', e.time / 1000.0);
+    if (!e.begin)
+      fprintf(f, ",\"args\":{\"objects\":%llu,\"bytes\":%llu}",
+              (unsigned long long)e.objs, (unsigned long long)e.bytes);
+    fprintf(f, "}");
+    sep = ",\n";
+  }
+  fprintf(f, "\n]}\n");
+  return fclose(f) == 0;
+}
+
+// Perfetto traces are protobufs, the few messages needed are encoded here.
+struct ProtoWriter {
+  string buf;
+
+  void varint(uint64_t v) {
+    for (; v >= 0x80; v >>= 7)
+      buf += char(v | 0x80);
+    buf += char(v);
+  }
+  void field(unsigned id, uint64_t v) {
+    varint(id << 3);
+    varint(v);
+  }
+  void field(unsigned id, const string& v) {
+    varint(id << 3 | 2);
+    varint(v.size());
+    buf += v;
+  }
+};
+
+bool GcRecorder::writePerfetto(const char* path) const {
+  // Trace.packet = 1, TracePacket: timestamp = 8, sequence id = 10,
+  // track_event = 11, track_descriptor = 60, TrackDescriptor: uuid = 1,
+  // name = 2, TrackEvent: debug_annotations = 4, type = 9, track_uuid = 11,
+  // name = 23, DebugAnnotation: uint_value = 7, name = 10.
+  const uint64_t track = 0x7467633200000001;
+  ProtoWriter trace;
+  auto packet = [&](const ProtoWriter& p) { trace.field(1, p.buf); };
+
+  ProtoWriter desc, descPacket;
+  desc.field(1, track);
+  desc.field(2, string("tgc2"));
+  descPacket.field(10, 1);
+  descPacket.field(60, desc.buf);
+  packet(descPacket);
+
+  for (auto& e : pairedEvents(events())) {
+    ProtoWriter ev, p;
+    ev.field(9, e.begin ? 1 : 2);  // slice begin or end
+    ev.field(11, track);
+    if (e.begin) {
+      ev.field(23, string(e.name));
+    } else {
+      pair<const char*, uint64_t> args[] = {{"objects", e.objs},
+                                            {"bytes", e.bytes}};
+      for (auto& a : args) {
+        ProtoWriter arg;
+        arg.field(10, string(a.first));
+        arg.field(7, a.second);
+        ev.field(4, arg.buf);
+      }
+    }
+    p.field(8, e.time);
+    p.field(10, 1);
+    p.field(11, ev.buf);
+    packet(p);
+  }
+
+  auto* f = fopen(path, "wb");
+  if (!f)
+    return false;
+  auto& buf = trace.buf;
+  auto ok = fwrite(buf.data(), 1, buf.size(), f) == buf.size();
+  return fclose(f) == 0 && ok;
+}
+
+//////////////////////////////////////////////////////////////////////////
+/// istring
+
+IStringRep* IStringRep::make(const char* s, size_t len) {
+  auto* r = (IStringRep*)::operator new(sizeof(IStringRep) + len + 1);
+  r->refs = 1;
+  r->len = len;
+  r->hash = 0;
+  r->interned = false;
+  memcpy(r->data(), s, len);
+  r->data()[len] = 0;
+  return r;
+}
+
+void IStringRep::destroy() {
+  if (interned) {
+#if TGC_THREADS
+    Collector::ThreadLock lock(Collector::inst);
+#endif
+    Collector::inst->strings.erase(this);
+  }
+  ::operator delete(this);
+}
+
+StringPool::~StringPool() {
+  // the istrings outliving the collector free their buffers by themselves.
+  for (auto* r : set)
+    r->interned = false;
+}
+
+size_t StringPool::intern(IStringRep*& rep) {
+  if (!rep || rep->interned)
+    return 0;
+  rep->hash = hash<string_view>()(string_view(rep->data(), rep->len));
+  auto [it, added] = set.insert(rep);
+  if (added) {
+    rep->interned = true;
+    return 0;
+  }
+  auto freed = rep->refs == 1 ? rep->bytes() : 0;
+  rep->release();
+  rep = *it;
+  rep->refs++;
+  return freed;
+}
+
+StringPool::Stats StringPool::getStats() const {
+  Stats st{set.size(), 0, 0};
+  for (auto* r : set) {
+    st.bytes += r->bytes();
+    st.savedBytes += (r->refs - 1) * r->bytes();
+  }
+  return st;
+}
+
+//////////////////////////////////////////////////////////////////////////
+/// GcTrace
+
+static uint64_t steadyNs() {
+  auto now = chrono::steady_clock::now().time_since_epoch();
+  return (uint64_t)chrono::duration_cast<chrono::nanoseconds>(now).count();
+}
+
+bool GcTrace::start(const char* path) {
+#if TGC_ALLOC_TRACE
+  stop();
+  failed = false;
+  file = fopen(path, "wb");
+  if (!file)
+    return false;
+  if (fwrite(Magic, sizeof(Magic), 1, file) != 1) {
+    fclose(file);
+    file = nullptr;
+    return false;
+  }
+  buf.reserve(64 * 1024);
+  startTime = steadyNs();
+  return true;
+#else
+  (void)path;
+  return false;
+#endif
+}
+
+bool GcTrace::stop() {
+  if (!file)
+    return !failed;
+  auto ok = flush();
+  if (fclose(file) != 0)
+    ok = false;
+  file = nullptr;
+  if (!ok)
+    failed = true;
+  return ok;
+}
+
+bool GcTrace::flush() {
+  auto ok = fwrite(buf.data(), sizeof(Record), buf.size(), file) == buf.size();
+  buf.clear();
+  return ok;
+}
+
+void GcTrace::add(Kind kind, uint64_t id, uint64_t arg, uint32_t cls) {
+  buf.push_back({steadyNs() - startTime, id, arg, cls, kind});
+  // on a full disk, the trace ends at what it could write.
+  if (buf.size() == buf.capacity() && !flush()) {
+    fclose(file);
+    file = nullptr;
+    failed = true;
+  }
+}
+
+//////////////////////////////////////////////////////////////////////////
+
 void Collector::dumpStats() {
+#if TGC_THREADS
+  StopTheWorld stop(this);
+#endif
   printf("========= [gc] ========\n");
   printf("[newGen meta    ] %3d\n", newGen.size());
   printf("[oldGen meta    ] %3d\n", oldGen.size());
+  printf("[frozen meta    ] %3zu\n", frozen.size());
   auto liveCnt = 0;
   for (auto i : newGen)
-    if (i->arrayLength)
+    if (!i->destroyed)
       liveCnt++;
   for (auto i : oldGen)
-    if (i->arrayLength)
+    if (!i->destroyed)
       liveCnt++;
   printf("[live objects   ] %3d\n", liveCnt);
+  printf("[leaf objects   ] %3zu\n", heap.getLeafCount());
+  auto ss = strings.getStats();
+  printf("[interned strs  ] %3zu, %zuK saved\n", ss.strings,
+         ss.savedBytes / 1024);
   printf("[new gen gc cnt ] %3d\n", newGenGcCount);
   printf("[full gc cnt    ] %3d\n", fullGcCount);
+#if TGC_MIXED_GC
+  printf("[mixed gc cnt   ] %3d\n", mixedGcCount);
+  printf("[old regions    ] %3zu\n", oldRegions.size());
+#endif
   printf("[last freed objs] %3d\n", freeObjCntOfPrevGc);
+  auto hs = heap.getStats();
+  printf("[heap committed ] %3zuK\n", hs.committedBytes / 1024);
+  printf("[heap used      ] %3zuK\n", hs.usedBytes / 1024);
+  printf("[heap released  ] %3zuK\n", hs.releasedBytes / 1024);
   printf("=======================\n");
 }
 
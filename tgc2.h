@@ -27,9 +27,117 @@ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 
 #pragma once
 
+// Store gc pointers as 32-bit offsets into the heap region, which is then
+// limited to 16GB. It must be the same for all the translation units.
+#ifndef TGC_COMPRESSED_PTRS
+#define TGC_COMPRESSED_PTRS 0
+#endif
+
+// Find the roots on the stack by scanning it at gc, instead of tracking the
+// gc pointers living there. Only the stack of the thread that created the
+// collector is scanned, so the gc pointers on other stacks do not keep their
+// objects. It must be the same for all the translation units.
+#ifndef TGC_CONSERVATIVE_ROOTS
+#define TGC_CONSERVATIVE_ROOTS 0
+#endif
+
+// Free the acyclic objects by reference counting as soon as they lose their
+// last gc pointer, the gc collecting the others. It must be the same for all
+// the translation units.
+#ifndef TGC_HYBRID_RC
+#define TGC_HYBRID_RC 0
+#endif
+#if TGC_HYBRID_RC && TGC_CONSERVATIVE_ROOTS
+#error "TGC_HYBRID_RC needs the gc pointers on the stack to be counted"
+#endif
+
+// Collect the old generation a few regions at a time with the young one, see
+// Collector::mixedCollect, so that full gcs are rare. The barrier then logs
+// the writes of old objects to old ones as well. It must be the same for all
+// the translation units.
+#ifndef TGC_MIXED_GC
+#define TGC_MIXED_GC 0
+#endif
+
+// Let several threads use the gc objects, see GcThread. Each thread then
+// allocates from cells of its own and logs its barrier by itself, and the
+// gcs stop all of them at their safepoints. It must be the same for all the
+// translation units.
+#ifndef TGC_THREADS
+#define TGC_THREADS 0
+#endif
+#if TGC_THREADS && (TGC_HYBRID_RC || TGC_CONSERVATIVE_ROOTS)
+#error "TGC_THREADS supports neither TGC_HYBRID_RC nor TGC_CONSERVATIVE_ROOTS"
+#endif
+#if TGC_THREADS && TGC_ALLOC_TRACE
+#error "TGC_ALLOC_TRACE records a single thread"
+#endif
+#if TGC_THREADS
+#define TGC_THREAD_LOCAL thread_local
+#else
+#define TGC_THREAD_LOCAL
+#endif
+
+// Compile-time policy, the defaults keep the runtime configuration. Each of
+// them must be the same for all the translation units.
+//
+// TGC_GC_CONDITION names the built-in GcCondition to trigger the gcs with,
+// e.g. GcCondition_ObjCnt. It is then called without virtual dispatch, and
+// setGcCondition only takes that class.
+//
+// Let ClassMeta::alloc and dealloc replace the heap. Without them the
+// allocation path does not check for them.
+#ifndef TGC_ALLOC_HOOKS
+#define TGC_ALLOC_HOOKS 1
+#endif
+// The minor gcs a young object survives before it is promoted.
+#ifndef TGC_TENURE_SCANS
+#define TGC_TENURE_SCANS 2
+#endif
+// Record the collections, see GcRecorder. Without it recording does nothing.
+#ifndef TGC_RECORDER
+#define TGC_RECORDER 1
+#endif
+// Print the freed objects of every sweep.
+#ifndef TGC_GC_TRACE
+#define TGC_GC_TRACE 0
+#endif
+// Let GcTrace stream the allocations and the gc pointer writes into a file.
+// Every write then checks whether it is recording.
+#ifndef TGC_ALLOC_TRACE
+#define TGC_ALLOC_TRACE 0
+#endif
+
+// Hold gc_int, gc_double and the other scalar boxes in place of the pointer,
+// see ImmediateBox. Copies of them then no longer share the value.
+#ifndef TGC_IMMEDIATE_BOXES
+#define TGC_IMMEDIATE_BOXES 0
+#endif
+// Intern the gc_istring objects promoted to the old generation, so that the
+// equal ones share one buffer.
+#ifndef TGC_STRING_DEDUP
+#define TGC_STRING_DEDUP 1
+#endif
+
+// Let gc_delete scan the heap for other gc pointers to the object before
+// freeing it, and leave a referenced one to the gc. On in debug builds.
+#ifndef TGC_CHECK_DELETE
+#ifdef NDEBUG
+#define TGC_CHECK_DELETE 0
+#else
+#define TGC_CHECK_DELETE 1
+#endif
+#endif
+
+#include <algorithm>
 #include <cassert>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
 #include <ctime>
+#include <functional>
 #include <memory>
+#include <string_view>
 #include <unordered_set>
 #include <vector>
 
@@ -41,6 +149,22 @@ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include <string>
 #include <unordered_map>
 
+#if TGC_THREADS
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#endif
+
+// gc_task needs C++20 coroutines.
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#include <coroutine>
+#include <exception>
+#include <optional>
+#define TGC_COROUTINES 1
+#else
+#define TGC_COROUTINES 0
+#endif
+
 namespace tgc2 {
 namespace details {
 
@@ -53,112 +177,121 @@ class ClassMeta;
 class PtrBase;
 class IPtrEnumerator;
 class Collector;
-
-//////////////////////////////////////////////////////////////////////////
-
-namespace helper {
+class istring;
 
 template <typename T>
-struct list_slot {
-  T* prev;
-  T* next;
-};
-
+struct is_gc_leaf;
 template <typename T>
-struct list_iterator_base {
-  T* ptr;
-  list_iterator_base(T* p) : ptr{p} {}
-  list_iterator_base(const list_iterator_base& r) : ptr{r.ptr} {}
-  T* operator*() { return ptr; }
-  T* operator->() { return ptr; }
-  bool operator!=(const list_iterator_base& r) const { return ptr != r.ptr; }
-};
-
-template <typename T, list_slot<T> T::*slot>
-class list {
-  T* m_first = nullptr;
-  T* m_last = nullptr;
-  size_t m_size = 0;
-
- public:
-  struct iterator : list_iterator_base<T> {
-    using list_iterator_base<T>::list_iterator_base;
-    iterator& operator++() {
-      this->ptr = next(this->ptr);
-      return *this;
-    }
-  };
-
-  static T*& prev(T* p) { return (p->*slot).prev; }
-  static T*& next(T* p) { return (p->*slot).next; }
-
-  void push_back(T* v) {
-    if (m_last)
-      next(m_last) = v;
-    else
-      m_first = v;
-    prev(v) = m_last;
-    next(v) = nullptr;
-    m_last = v;
-    m_size++;
-  }
-
-  void remove(T* v) {
-    if (v == m_first)
-      m_first = next(m_first);
-    else if (auto p = prev(v))
-      next(p) = next(v);
+struct is_gc_image_safe;
+template <typename T>
+struct is_gc_acyclic;
 
-    if (v == m_last)
-      m_last = prev(m_last);
-    else if (auto n = next(v))
-      prev(n) = prev(v);
-    m_size--;
-  }
+struct ImmediateBoxBase {};
+// gc<T> holding its value in place, see ImmediateBox.
+template <typename T>
+constexpr bool is_gc_immediate_v = is_base_of_v<ImmediateBoxBase, T>;
 
-  iterator erase(iterator it) {
-    auto* o = *it;
-    auto n = next(o);
-    remove(o);
-    return n;
-  }
-  T* back() { return m_last; }
-  void pop_back() { remove(m_last); }
-  iterator begin() { return {m_first}; }
-  iterator end() { return {nullptr}; }
-  size_t size() { return m_size; }
-};
-}  // namespace helper
+// A name of T that is the same in every run of the program, without RTTI.
+template <typename T>
+const char* gc_type_name() {
+#ifdef _MSC_VER
+  return __FUNCSIG__;
+#else
+  return __PRETTY_FUNCTION__;
+#endif
+}
 
 //////////////////////////////////////////////////////////////////////////
 
+// The header is kept in 16 bytes: the class is referenced by its index and
+// the generation by the position in the generation set. Arrays keep their
+// length in a prefix before the header.
 class ObjMeta {
  public:
-  enum class Color : unsigned char { White, Black };
+  // frozen ones are neither white nor black, so no gc walks them.
+  enum class Color : unsigned char { White, Black, Frozen };
   static constexpr unsigned char Magic = 0xdd;
+  static constexpr unsigned char ArrayMagic = 0xda;
+  static constexpr size_t ArrayPrefix = 16;
 
-  ClassMeta* klass = nullptr;
-  helper::list_slot<ObjMeta> gen;
-  size_t arrayLength = 0;
-  Color color;
   unsigned char magic = Magic;
-  unsigned char scanCountInNewGen;
-  bool hasSubPtrs = true;
-
-  ObjMeta(ClassMeta* c, char* o, size_t n)
-      : klass(c), arrayLength(n), scanCountInNewGen(0), color(Color::Black) {}
+  Color color = Color::Black;
+  unsigned char scanCountInNewGen = 0;
+  bool hasSubPtrs : 1;
+  bool isArray : 1;
+  bool destroyed : 1;
+  bool isOld : 1;
+  bool discovering : 1;  // sub pointers of the class are being discovered
+  bool isLeaf : 1;       // in the leaf space, see Heap::allocLeaf
+  bool counted : 1;      // by refCount, see TGC_HYBRID_RC
+  bool creating : 1;     // its constructor is running, kept by the gcs
+  unsigned classIndex;
+  unsigned genIndex = 0;
+  unsigned refCount = 0;
+
+  ObjMeta(ClassMeta* c, bool array);
   ~ObjMeta() {
-    if (arrayLength)
+    if (!destroyed)
       destroy();
   }
   void operator delete(void* c);
   bool containsPtr(char* p);
   char* objPtr() const { return (char*)this + sizeof(ObjMeta); }
+  char* allocPtr() const { return (char*)this - (isArray ? ArrayPrefix : 0); }
+  size_t arrayLength() const {
+    return isArray ? *(size_t*)((char*)this - sizeof(size_t)) : 1;
+  }
+  ClassMeta* klass() const;
   void destroy();
+  bool isFrozen() const { return color == Color::Frozen; }
 };
 
-static_assert(sizeof(ObjMeta) <= sizeof(void*) * 5,
-              "too large for small allocation");
+static_assert(sizeof(ObjMeta) == 16, "header should be compact");
+
+// Objects of a generation. They keep their position, so that any of them
+// can be unlinked in O(1).
+class MetaSet {
+  vector<ObjMeta*> objs;
+
+ public:
+  using iterator = vector<ObjMeta*>::iterator;
+
+  void push_back(ObjMeta* m) {
+    m->genIndex = (unsigned)objs.size();
+    objs.push_back(m);
+  }
+  void append(ObjMeta** ms, size_t n) {
+    auto idx = objs.size();
+    objs.insert(objs.end(), ms, ms + n);
+    for (size_t i = 0; i < n; i++)
+      ms[i]->genIndex = unsigned(idx + i);
+  }
+  void remove(ObjMeta* m) {
+    auto* last = objs.back();
+    objs[m->genIndex] = last;
+    last->genIndex = m->genIndex;
+    objs.pop_back();
+  }
+  // keep the objects that `pred` returns true for, in order.
+  template <typename F>
+  void retain(F pred) {
+    size_t n = 0;
+    for (size_t i = 0; i < objs.size(); i++) {
+      auto* m = objs[i];
+      if (pred(m)) {
+        m->genIndex = (unsigned)n;
+        objs[n++] = m;
+      }
+    }
+    objs.resize(n);
+  }
+  ObjMeta* operator[](size_t i) const { return objs[i]; }
+  ObjMeta* back() { return objs.back(); }
+  void pop_back() { objs.pop_back(); }
+  iterator begin() { return objs.begin(); }
+  iterator end() { return objs.end(); }
+  size_t size() const { return objs.size(); }
+};
 
 //////////////////////////////////////////////////////////////////////////
 
@@ -166,8 +299,18 @@ class IPtrEnumerator {
  public:
   virtual ~IPtrEnumerator() {}
   virtual const PtrBase* getNext() = 0;
-
-  static vector<char*> buf;
+  // All the pointers as one dense run of slots, scanned at once by the
+  // collector instead of a getNext call per slot. 0 if there is no such run.
+  virtual size_t getRun(const PtrBase*&) { return 0; }
+
+  // the blocks go with the pool, when the thread or the program exits.
+  struct Pool : vector<char*> {
+    ~Pool() {
+      for (auto* p : *this)
+        delete[] p;
+    }
+  };
+  static TGC_THREAD_LOCAL Pool buf;
 
   void* operator new(size_t) {
     if (buf.size()) {
@@ -190,6 +333,7 @@ class ObjPtrEnumerator : public IPtrEnumerator {
   ObjPtrEnumerator(ClassMeta* c, char* o, size_t l)
       : klass(c), base(o), len(l) {}
   PtrBase* getNext() override;
+  size_t getRun(const PtrBase*& first) override;
 };
 
 template <typename T>
@@ -200,8 +344,10 @@ struct PtrEnumerator : ObjPtrEnumerator {
 //////////////////////////////////////////////////////////////////////////
 
 class ClassMeta {
+  friend class Collector;
+
  public:
-  enum class MemRequest { Dctor, NewPtrEnumerator };
+  enum class MemRequest { Dctor, NewPtrEnumerator, Trace };
 
   using MemHandler = void* (*)(ClassMeta* cls,
                                MemRequest r,
@@ -214,15 +360,46 @@ class ClassMeta {
   MemHandler memHandler = nullptr;
   vector<OffsetType>* subPtrOffsets = nullptr;
   unsigned short size = 0;
-  bool registered = false;
-
-  static int isCreatingObj;
+#if TGC_THREADS
+  // set by the first objects of the class, in any thread.
+  atomic<bool> registered;
+#else
+  bool registered : 1;
+#endif
+  bool leaf : 1;  // holds no gc pointers
+  bool trivialDtor : 1;
+  bool imageSafe : 1;  // can be saved into a heap image
+  bool acyclic : 1;    // can not reach itself, see is_gc_acyclic
+  bool internable : 1;  // istring, interned at promotion
+#if TGC_THREADS
+  atomic<unsigned> index{0};  // assigned on first allocation
+#else
+  unsigned index = 0;  // assigned on first allocation
+#endif
+
+  static TGC_THREAD_LOCAL int isCreatingObj;
+#if TGC_ALLOC_HOOKS
   static Alloc alloc;
   static Dealloc dealloc;
-
-  ClassMeta(MemHandler h, unsigned short sz) : memHandler(h), size(sz) {}
+  static bool hasAllocHook() { return alloc; }
+#else
+  static constexpr bool hasAllocHook() { return false; }
+#endif
+
+  ClassMeta(MemHandler h, unsigned short sz)
+      : memHandler(h),
+        size(sz),
+        registered(false),
+        leaf(false),
+        trivialDtor(false),
+        imageSafe(false),
+        internable(false) {
+    memHandler(this, MemRequest::Trace, nullptr, 0);
+  }
   ~ClassMeta() { delete subPtrOffsets; }
   ObjMeta* newMeta(size_t objCnt);
+  void newMetaBatch(size_t n, ObjMeta** metas);
+  void endNewMetaBatch(ObjMeta** metas, size_t n, bool failed);
   void registerSubPtr(ObjMeta* owner, PtrBase* p);
   void endNewMeta(ObjMeta* meta, bool failed);
 
@@ -232,18 +409,15 @@ class ClassMeta {
   }
 
   IPtrEnumerator* enumPtrs(ObjMeta* m) {
-    if (!m->hasSubPtrs)
+    if (!m->hasSubPtrs || m->destroyed)
       return nullptr;
     return (IPtrEnumerator*)memHandler(this, MemRequest::NewPtrEnumerator,
-                                       m->objPtr(), m->arrayLength);
+                                       m->objPtr(), m->arrayLength());
   }
 
-  static char* callAlloc(size_t sz) {
-    return alloc ? (char*)alloc(sz) : new char[sz];
-  }
-  static void callDealloc(void* p) {
-    dealloc ? dealloc(p) : delete[](char*)(p);
-  }
+  static char* callAlloc(size_t sz, bool mayCollect = true);
+  static void callDealloc(void* p);
+  static ClassMeta* fromIndex(unsigned i) { return classes[i]; }
 
   template <typename T>
   static ClassMeta* get() {
@@ -254,6 +428,9 @@ class ClassMeta {
   static ClassMeta* getRegistered();
 
  private:
+  template <typename T>
+  static void traceOffsets(ClassMeta* c);
+
   template <typename T>
   struct Holder {
     static void* MemHandler(ClassMeta* klass,
@@ -268,7 +445,23 @@ class ClassMeta {
           }
         } break;
         case MemRequest::NewPtrEnumerator: {
-          return new PtrEnumerator<T>(klass, (char*)obj, cnt);
+          if constexpr (is_gc_leaf<T>::value)
+            return nullptr;
+          else
+            return new PtrEnumerator<T>(klass, (char*)obj, cnt);
+        } break;
+        case MemRequest::Trace: {
+          klass->trivialDtor = is_trivially_destructible_v<T>;
+          klass->acyclic = is_gc_acyclic<T>::value;
+          klass->internable = is_same_v<T, istring>;
+          if constexpr (is_gc_leaf<T>::value)
+            klass->registered = klass->leaf = true;
+          else
+            traceOffsets<T>(klass);
+          if constexpr (is_gc_image_safe<T>::value) {
+            klass->imageSafe = true;
+            registerImageClass(klass, gc_type_name<T>());
+          }
         } break;
       }
       return nullptr;
@@ -276,35 +469,416 @@ class ClassMeta {
 
     static ClassMeta inst;
   };
+
+  static unsigned registerClass(ClassMeta* c);
+  // on the first allocation of the class.
+  void assignIndex();
+  static void registerImageClass(ClassMeta* c, const char* name);
+  // by name, for the classes of a heap image to be found when it is loaded.
+  static vector<pair<const char*, ClassMeta*>>& imageClasses();
+  static ClassMeta** classes;
 };
 
 template <typename T>
 ClassMeta ClassMeta::Holder<T>::inst{MemHandler, sizeof(T)};
 
+inline ObjMeta::ObjMeta(ClassMeta* c, bool array)
+    : hasSubPtrs(true),
+      isArray(array),
+      destroyed(false),
+      isOld(false),
+      discovering(false),
+      isLeaf(false),
+      counted(false),
+      creating(false),
+      classIndex(c->index) {}
+
+inline ClassMeta* ObjMeta::klass() const {
+  return ClassMeta::fromIndex(classIndex);
+}
+
+// Collects the offsets of the fields listed by gc_trace(T&, Visitor&), with
+// nested traced structs and arrays flattened.
+struct OffsetTracer {
+  char* base;
+  vector<ClassMeta::OffsetType>& offsets;
+  bool acyclic = true;  // all the gc pointers point to acyclic classes
+
+  template <typename... F>
+  void operator()(F&... fields) {
+    (visit(fields), ...);
+  }
+
+  template <typename F>
+  void visit(F& f);
+};
+
+template <typename T, typename = void>
+struct has_gc_trace : false_type {};
+
+template <typename T>
+struct has_gc_trace<
+    T,
+    void_t<decltype(gc_trace(declval<T&>(), declval<OffsetTracer&>()))>>
+    : true_type {};
+
+template <typename F>
+void OffsetTracer::visit(F& f) {
+  if constexpr (is_base_of_v<PtrBase, F>) {
+    offsets.push_back(ClassMeta::OffsetType((char*)&f - base));
+    acyclic = acyclic && is_gc_acyclic<typename F::pointee>::value;
+  } else if constexpr (is_array_v<F>) {
+    for (auto& i : f)
+      visit(i);
+  } else if constexpr (is_gc_immediate_v<F>) {
+    // nothing to trace.
+  } else {
+    static_assert(has_gc_trace<F>::value,
+                  "traced field should be a gc pointer or a traced type");
+    gc_trace(f, *this);
+  }
+}
+
+// Traced classes are registered at static init, no instance is needed.
+template <typename T>
+void ClassMeta::traceOffsets(ClassMeta* c) {
+  if constexpr (has_gc_trace<T>::value) {
+    alignas(T) char layout[sizeof(T)];
+    vector<OffsetType> offsets;
+    OffsetTracer tracer{layout, offsets};
+    gc_trace(*(T*)layout, tracer);
+    if (!offsets.empty())
+      c->subPtrOffsets = new vector<OffsetType>(move(offsets));
+    c->acyclic = c->acyclic || tracer.acyclic;
+    c->registered = true;
+  } else {
+    static_assert(!is_gc_image_safe<T>::value,
+                  "image safe class should be traced");
+  }
+}
+
 static_assert(sizeof(ClassMeta) <= sizeof(void*) * 3,
               "too large for small objects");
 
 //////////////////////////////////////////////////////////////////////////
 
+// bits to hold the values up to n, at least one.
+constexpr unsigned bitWidth(unsigned n) {
+  return n > 1 ? 1 + bitWidth(n / 2) : 1;
+}
+
+// Page based heap where the objects are carved from.
+// A contiguous region is reserved upfront and committed on demand. Small
+// objects share the pages of their size class and large objects occupy a run
+// of pages, so that fully empty pages can be given back to the OS.
+class Heap {
+ public:
+  static constexpr size_t PageShift = 16;
+  static constexpr size_t PageSize = size_t(1) << PageShift;
+  static constexpr size_t HugePageSize = size_t(2) << 20;
+  static constexpr size_t Granularity = 16;
+  static constexpr size_t MaxSmallSize = PageSize / 4;
+  // the region compressed pointers can address.
+  static constexpr size_t CompressedRange = size_t(16) << 30;
+
+  static char* regionBase;
+
+  struct Policy {
+    // give the fully empty pages back to the OS after full gc.
+    bool releaseEmptyPages = true;
+    // let the OS reclaim released pages lazily(MADV_FREE).
+    bool lazyRelease = false;
+    // empty pages kept to absorb the next allocation burst.
+    size_t retainedEmptyPages = 32;
+    // shrink the internal buffers of the collector after full gc.
+    bool trimBuffers = true;
+    // back the heap with transparent huge pages.
+    bool hugePages = false;
+    // fault in the next huge page in a background thread.
+    bool prefault = false;
+    // the most bytes of pages to hand out, 0 for no limit.
+    size_t heapLimit = 0;
+    // if not 0, the limit is also this share of the memory limit of the
+    // cgroup, so that the process is not killed while a gc could free memory.
+    double cgroupLimitShare = 0;
+  };
+
+  struct Stats {
+    size_t reservedBytes;
+    size_t committedBytes;
+    size_t usedBytes;
+    size_t releasedBytes;
+    size_t pageBytes;  // pages handed out, what the limit applies to
+    size_t limitBytes;
+  };
+
+  Heap();
+  ~Heap();
+  char* alloc(size_t sz);
+  // allocate up to n blocks of the same size, returns the count allocated.
+  size_t allocBatch(size_t sz, size_t n, char** out);
+  void free(void* p);
+  unsigned sizeClassOf(size_t sz) const {
+    return sizeToClass[(sz + Granularity - 1) / Granularity];
+  }
+  size_t sizeClassCount() const { return classSizes.size(); }
+  size_t classSize(unsigned sizeClass) const { return classSizes[sizeClass]; }
+  // the size class of the cell p is in if it is a small one, else -1.
+  int smallCellClass(const void* p) const {
+    auto& pg = pages[pageIndex(p)];
+    return pg.kind == PageKind::Small ? pg.sizeClass : -1;
+  }
+  bool contains(const void* p) const {
+    return (size_t)((const char*)p - base) < reservedSize;
+  }
+  // Pages carved by gc_region. Objects in an open page are not freed one by
+  // one, the page is released when the region closes unless objects that
+  // escaped are kept on it.
+  char* allocBumpPage();
+  void keepInBumpPage(const void* p) { pages[pageIndex(p)].used++; }
+  void closeBumpPage(char* page);
+  bool inOpenBumpPage(const void* p) const {
+    if (!contains(p))
+      return false;
+    auto& pg = pages[pageIndex(p)];
+    return pg.kind == PageKind::Bump && pg.open;
+  }
+  // Small objects without gc pointers are kept in pages of their own, out of
+  // the generations. Their liveness and age are tracked in bitmaps, so they
+  // are never walked one by one, unless they have destructors to run.
+  char* allocLeaf(size_t sz, bool dtor);
+  // A run of pages for the objects of a heap image. The objects are packed
+  // like in closed bump pages, each entry of `layout` tells how many start
+  // in a page, or with ImageLargePage set, that a large object takes that
+  // many pages from there.
+  static constexpr uint32_t ImageLargePage = 1u << 31;
+  char* allocImage(const uint32_t* layout, unsigned n);
+  void releaseImage(char* p, unsigned n);
+  void markLeaf(const void* p) {
+    auto idx = pageIndex(p);
+    auto& pg = pages[idx];
+    auto i = size_t((const char*)p - pageAddr(idx)) / classSizes[pg.sizeClass];
+    pg.leaf->mark[i / 64] |= uint64_t(1) << (i % 64);
+  }
+  // frozen leaves are kept without being marked, until thawed as old ones.
+  void freezeLeaf(const void* p) {
+    auto idx = pageIndex(p);
+    auto& pg = pages[idx];
+    auto i = size_t((const char*)p - pageAddr(idx)) / classSizes[pg.sizeClass];
+    pg.leaf->frozen[i / 64] |= uint64_t(1) << (i % 64);
+  }
+  void thawLeaves();
+  // frees the unmarked young objects, or all the unmarked ones if full, and
+  // returns their count.
+  size_t sweepLeaves(bool full);
+  size_t getLeafCount() const { return leafCount; }
+  // The header of the object whose cell holds p if it looks like one, for the
+  // pointers found on the stack. Objects of closed regions are only found
+  // from their start and the ones of the open region not at all.
+  ObjMeta* findObject(const void* p) const;
+  void releaseEmptyPages();
+  // an allocation failed since the pages would exceed the limit.
+  bool limitReached() const { return limitHit; }
+  // half way from the pages kept by the last full gc to the limit.
+  bool pastSoftLimit() const { return limit && pageBytes > softLimit; }
+  void updateSoftLimit() {
+    softLimit = limit > pageBytes ? pageBytes + (limit - pageBytes) / 2 : limit;
+  }
+  // memory.max of the cgroup of the process or its parents, with cgroup v2
+  // or v1, 0 if unknown or unlimited.
+  static size_t cgroupMemoryLimit();
+  void setPolicy(const Policy& p);
+  const Policy& getPolicy() const { return policy; }
+  Stats getStats() const;
+
+ private:
+  static constexpr unsigned NoPage = ~0u;
+
+  enum class PageKind : unsigned char {
+    Reserved,
+    Free,
+    Small,
+    Large,
+    LargeTail,
+    Bump,
+    Leaf
+  };
+
+  // minor gcs a leaf survives before it is old, as for the other objects.
+  static constexpr unsigned LeafTenure =
+      TGC_TENURE_SCANS > 1 ? TGC_TENURE_SCANS : 1;
+
+  struct LeafBits {
+    static constexpr size_t Words = PageSize / 32 / 64;
+    static constexpr unsigned AgeBits = bitWidth(LeafTenure - 1);
+    uint64_t alloc[Words];
+    uint64_t mark[Words];
+    // minor gcs survived, bit i of the count of a slot is in age[i].
+    uint64_t age[AgeBits][Words];
+    uint64_t old[Words];
+    uint64_t frozen[Words];  // kept by gc_freeze
+
+    uint64_t ageIs(size_t w, unsigned n) const {
+      auto r = ~uint64_t(0);
+      for (unsigned i = 0; i < AgeBits; i++)
+        r &= (n >> i) & 1 ? age[i][w] : ~age[i][w];
+      return r;
+    }
+    void addAge(size_t w, uint64_t slots) {
+      for (unsigned i = 0; i < AgeBits && slots; i++) {
+        auto carry = age[i][w] & slots;
+        age[i][w] ^= slots;
+        slots = carry;
+      }
+    }
+    void resetAge(size_t w, uint64_t slots) {
+      for (auto& a : age)
+        a[w] &= ~slots;
+    }
+  };
+
+  struct Page {
+    char* freeList = nullptr;
+    unsigned used = 0;        // live slots
+    unsigned capacity = 0;    // slots of small page or pages of a run
+    unsigned bump = 0;        // slots from here are never handed out
+    unsigned next = NoPage;   // next available page or head of the run
+    unsigned short sizeClass = 0;
+    PageKind kind = PageKind::Free;
+    bool dirty = false;  // used since it was last released
+    bool inAvail = false;
+    bool open = false;  // bump page of the open region
+    bool dtor = false;  // leaf page of objects with destructors
+    unique_ptr<LeafBits> leaf;
+  };
+
+  struct Prefaulter;
+
+  unsigned pageIndex(const void* p) const {
+    return (unsigned)(((const char*)p - base) >> PageShift);
+  }
+  char* pageAddr(unsigned idx) const {
+    return base + (size_t(idx) << PageShift);
+  }
+  unsigned newSmallPage(unsigned sc);
+  unsigned newLeafPage(unsigned sc, bool dtor);
+  char* allocLarge(size_t sz);
+  unsigned allocPages(unsigned n);
+  void freePages(unsigned idx, unsigned n);
+  void addFreeSpan(unsigned idx, unsigned n);
+  void removeFreeSpan(unsigned idx);
+  bool grow(unsigned newTop);
+  void releaseSpan(unsigned idx, unsigned n);
+
+  char* base = nullptr;
+  size_t reservedSize = 0;
+  size_t committedSize = 0;
+  size_t usedSize = 0;
+  size_t releasedSize = 0;
+  size_t pageBytes = 0;
+  size_t limit = 0;
+  size_t softLimit = 0;
+  bool limitHit = false;
+  unsigned top = 1;
+  vector<Page> pages;
+  vector<unsigned> classSizes;
+  vector<unsigned char> sizeToClass;
+  vector<unsigned> avail;
+  vector<unsigned> leafAvail;  // by size class, then with destructors
+  vector<unsigned> leafPages;
+  size_t leafCount = 0;
+  set<pair<unsigned, unsigned>> freeSpans;  // (length, index)
+  unique_ptr<Prefaulter> prefaulter;
+  Policy policy;
+};
+
 class PtrBase {
   friend class Collector;
   friend class ClassMeta;
+  friend class GcFrame;
+  friend class GcBuffer;
+  template <typename K, typename V>
+  friend class flat_hash_map;
 
  public:
-  ObjMeta* getMeta() { return meta; }
+#if TGC_COMPRESSED_PTRS
+  ObjMeta* getMeta() const {
+    auto o = word & OffsetMask;
+    return o ? (ObjMeta*)(Heap::regionBase + (size_t(o) << OffsetShift))
+             : nullptr;
+  }
+#else
+  ObjMeta* getMeta() const { return meta; }
+#endif
 
  protected:
   PtrBase();
   PtrBase(void* obj);
   ~PtrBase();
   void writeBarrier();
+  void logWrite(ObjMeta* m) const;
+#if TGC_ALLOC_TRACE
+  void traceStore(ObjMeta* m) const;
+#endif
+  // a sub pointer of owner, as old as it. The ones of frozen objects are
+  // roots, see Collector::freeze.
+  void adoptBy(const ObjMeta* owner) const {
+    setRoot(owner->isFrozen());
+    setOld(owner->isOld && !owner->isFrozen());
+  }
+#if TGC_HYBRID_RC
+  static void retain(ObjMeta* m) {
+    if (m && m->counted)
+      m->refCount++;
+  }
+  // the decrement is deferred, see Collector::flushReleases.
+  static void release(ObjMeta* m);
+#endif
+
+#if TGC_COMPRESSED_PTRS
+  // The scaled offset of the meta in the heap region, with the flags in the
+  // top bits. Offset 0 is null since the first page is never handed out.
+  static constexpr uint32_t OldBit = 1u << 31;
+  static constexpr uint32_t RootBit = 1u << 30;
+  static constexpr uint32_t OffsetMask = RootBit - 1;
+  static constexpr unsigned OffsetShift = 4;
+
+  void setMeta(ObjMeta* m) {
+    auto o = m ? (uint32_t)(((char*)m - Heap::regionBase) >> OffsetShift) : 0;
+    word = (word & ~OffsetMask) | o;
+#if TGC_ALLOC_TRACE
+    traceStore(m);
+#endif
+  }
+  bool isOld() const { return word & OldBit; }
+  bool isRoot() const { return word & RootBit; }
+  void setOld(bool v) const { word = v ? word | OldBit : word & ~OldBit; }
+  void setRoot(bool v) const { word = v ? word | RootBit : word & ~RootBit; }
+
+ protected:
+  mutable uint32_t word = RootBit;
+#else
+  void setMeta(ObjMeta* m) {
+    meta = m;
+#if TGC_ALLOC_TRACE
+    traceStore(m);
+#endif
+  }
+  bool isOld() const { return old; }
+  bool isRoot() const { return root; }
+  void setOld(bool v) const { old = v; }
+  void setRoot(bool v) const { root = v; }
 
  protected:
   ObjMeta* meta = nullptr;
-  mutable bool isOld;
-  mutable bool isRoot;
+  mutable bool old = false;
+  mutable bool root = true;
+#endif
 };
 
+template <typename T>
+class gc_ref;
+
 template <typename T>
 class GcPtr : public PtrBase {
  public:
@@ -323,12 +897,19 @@ class GcPtr : public PtrBase {
   template <typename U>
   GcPtr(const GcPtr<U>& r) {
     static_assert(is_base_of_v<T, U>, "invalid pointer cast");
-    reset(r.meta);
+    reset(r.getMeta());
   }
-  GcPtr(const GcPtr& r) { reset(r.meta); }
+  GcPtr(const GcPtr& r) { reset(r.getMeta()); }
+  // the count goes with the reference.
   GcPtr(GcPtr&& r) {
-    reset(r.meta);
-    r = nullptr;
+    setMeta(r.getMeta());
+    r.setMeta(nullptr);
+    writeBarrier();
+  }
+  template <typename U>
+  GcPtr(const gc_ref<U>& r) {
+    static_assert(is_convertible_v<U*, T*>, "invalid pointer cast");
+    reset(r.getMeta());
   }
 
   // Operators
@@ -336,43 +917,83 @@ class GcPtr : public PtrBase {
   template <typename U>
   GcPtr& operator=(const GcPtr<U>& r) {
     static_assert(is_base_of_v<T, U>, "invalid pointer cast");
-    reset(r.meta);
+    reset(r.getMeta());
     return *this;
   }
   GcPtr& operator=(const GcPtr& r) {
-    reset(r.meta);
+    reset(r.getMeta());
     return *this;
   }
   GcPtr& operator=(GcPtr&& r) {
-    reset(r.meta);
-    r = nullptr;
+    if (this == &r)
+      return *this;
+    auto* m = r.getMeta();
+    r.setMeta(nullptr);
+#if TGC_HYBRID_RC
+    release(getMeta());
+#endif
+    // no barrier if it held the reference already.
+    if (m != getMeta()) {
+      setMeta(m);
+      writeBarrier();
+    }
+    return *this;
+  }
+  template <typename U>
+  GcPtr& operator=(const gc_ref<U>& r) {
+    static_assert(is_convertible_v<U*, T*>, "invalid pointer cast");
+    reset(r.getMeta());
     return *this;
   }
   T* operator->() const { return ptr(); }
   T& operator*() const { return *ptr(); }
-  explicit operator bool() const { return meta; }
+  explicit operator bool() const { return getMeta(); }
   bool operator==(const GcPtr& r) const { return ptr() == r.ptr(); }
   bool operator!=(const GcPtr& r) const { return ptr() != r.ptr(); }
   GcPtr& operator=(T* ptr) = delete;
   GcPtr& operator=(nullptr_t) {
-    meta = 0;
+#if TGC_HYBRID_RC
+    release(getMeta());
+#endif
+    setMeta(nullptr);
     return *this;
   }
   bool operator<(const GcPtr& r) const { return *ptr() < *r.ptr(); }
+  // the counts stay, only the barriers of the ones that changed run.
+  friend void swap(GcPtr& a, GcPtr& b) {
+    auto* m = a.getMeta();
+    if (m == b.getMeta())
+      return;
+    a.setMeta(b.getMeta());
+    b.setMeta(m);
+    a.writeBarrier();
+    b.writeBarrier();
+  }
 
   // Methods
 
   void reset(ObjMeta* n) {
-    meta = n;
+#if TGC_HYBRID_RC
+    retain(n);
+    release(getMeta());
+#endif
+    setMeta(n);
     writeBarrier();
   }
 
  protected:
-  T* ptr() const { return meta ? (T*)meta->objPtr() : nullptr; }
+  T* ptr() const {
+    auto* m = getMeta();
+    return m ? (T*)m->objPtr() : nullptr;
+  }
 };
 
+#if TGC_COMPRESSED_PTRS
+static_assert(sizeof(GcPtr<int>) == 4, "should be compressed");
+#else
 static_assert(sizeof(GcPtr<int>) <= sizeof(void*) * 2,
               "too large to pass by value");
+#endif
 
 template <typename T>
 class gc : public GcPtr<T> {
@@ -384,8 +1005,127 @@ class gc : public GcPtr<T> {
   gc(nullptr_t) {}
   gc(ObjMeta* o) : base(o) {}
   explicit gc(T* o) : base(o) {}
+  template <typename U>
+  gc& operator=(const gc_ref<U>& r) {
+    base::operator=(r);
+    return *this;
+  }
+};
+
+// A borrowed gc pointer, for parameters and locals that an owning one
+// outlives. The collector knows nothing of it, so it costs like a raw
+// pointer. Assigning it to a gc<T> makes an owning one again.
+template <typename T>
+class gc_ref {
+ public:
+  gc_ref() {}
+  gc_ref(nullptr_t) {}
+  template <typename U>
+  gc_ref(const GcPtr<U>& p) : meta(p.getMeta()) {
+    static_assert(is_convertible_v<U*, T*>, "invalid pointer cast");
+  }
+  template <typename U>
+  gc_ref(const gc_ref<U>& r) : meta(r.getMeta()) {
+    static_assert(is_convertible_v<U*, T*>, "invalid pointer cast");
+  }
+
+  T* operator->() const { return ptr(); }
+  T& operator*() const { return *ptr(); }
+  explicit operator bool() const { return meta; }
+  bool operator==(const gc_ref& r) const { return meta == r.meta; }
+  bool operator!=(const gc_ref& r) const { return meta != r.meta; }
+  // else ambiguous with the reversed one of GcPtr in C++20.
+  template <typename U>
+  bool operator==(const GcPtr<U>& p) const { return meta == p.getMeta(); }
+  template <typename U>
+  bool operator!=(const GcPtr<U>& p) const { return meta != p.getMeta(); }
+  ObjMeta* getMeta() const { return meta; }
+
+ private:
+  ObjMeta* meta = nullptr;
+
+  T* ptr() const { return meta ? (T*)meta->objPtr() : nullptr; }
+};
+
+// Classes that can not hold gc pointers. Their objects go to the leaf space
+// and are never traced. A gc pointer is not trivially copyable, so neither is
+// a class holding one. Specialize it for other classes without gc pointers.
+template <typename T>
+struct is_gc_leaf
+    : bool_constant<is_trivially_copyable_v<T> || sizeof(T) < sizeof(gc<T>)> {
+};
+template <typename C, typename Tr, typename A>
+struct is_gc_leaf<basic_string<C, Tr, A>> : true_type {};
+template <typename T, typename A>
+struct is_gc_leaf<vector<T, A>> : is_gc_leaf<T> {};
+template <typename T, typename A>
+struct is_gc_leaf<deque<T, A>> : is_gc_leaf<T> {};
+template <typename T, typename A>
+struct is_gc_leaf<list<T, A>> : is_gc_leaf<T> {};
+template <typename T, typename C, typename A>
+struct is_gc_leaf<set<T, C, A>> : is_gc_leaf<T> {};
+template <typename T, typename H, typename E, typename A>
+struct is_gc_leaf<unordered_set<T, H, E, A>> : is_gc_leaf<T> {};
+template <typename K, typename V>
+struct is_gc_leaf<pair<K, V>>
+    : bool_constant<is_gc_leaf<K>::value && is_gc_leaf<V>::value> {};
+template <typename K, typename V, typename C, typename A>
+struct is_gc_leaf<map<K, V, C, A>> : is_gc_leaf<pair<K, V>> {};
+template <typename K, typename V, typename H, typename E, typename A>
+struct is_gc_leaf<unordered_map<K, V, H, E, A>> : is_gc_leaf<pair<K, V>> {};
+
+// Classes whose objects can be saved into a heap image byte for byte, with
+// only their gc pointers relocated. Specialize it for the traced classes and
+// the leaf ones whose other fields hold no pointers nor handles.
+template <typename T>
+struct is_gc_image_safe : bool_constant<is_arithmetic_v<T> || is_enum_v<T>> {
+};
+
+// Classes whose objects can not reach themselves through gc pointers, which
+// TGC_HYBRID_RC frees by reference counting. Leaf classes are, and traced
+// classes whose gc pointers all point to such classes are counted as well.
+// Specialize it for others: a wrong one only leaves its cycles to the gc.
+template <typename T>
+struct is_gc_acyclic : is_gc_leaf<T> {};
+
+// A boxed scalar held in place of the gc pointer, with TGC_IMMEDIATE_BOXES.
+// Nothing is allocated and the collector never sees it: it is not a gc
+// pointer, so tracing skips it and classes holding only such fields are
+// leaves. A null one holds no value. Copies hold their own value, unlike
+// the heap boxes that share it, and compare by value through T&.
+template <typename T>
+class ImmediateBox : public ImmediateBoxBase {
+ public:
+  using pointee = T;
+  using element_type = T;
+
+  ImmediateBox() {}
+  ImmediateBox(nullptr_t) {}
+  ImmediateBox(const T& v) : val(v), has(true) {}
+
+  T* operator->() const { return &val; }
+  T& operator*() const { return val; }
+  explicit operator bool() const { return has; }
+  operator T&() const { return val; }
+  ImmediateBox& operator=(nullptr_t) {
+    val = T();
+    has = false;
+    return *this;
+  }
+
+ private:
+  mutable T val = T();
+  bool has = false;
 };
 
+#define TGC_DECL_IMMEDIATE_BOX(T, GcAliasName)              \
+  template <>                                               \
+  class details::gc<T> : public details::ImmediateBox<T> {  \
+   public:                                                  \
+    using ImmediateBox<T>::ImmediateBox;                    \
+  };                                                        \
+  using GcAliasName = gc<T>;
+
 #define TGC_DECL_AUTO_BOX(T, GcAliasName)                    \
   template <>                                                \
   class details::gc<T> : public details::GcPtr<T> {          \
@@ -399,36 +1139,452 @@ class gc : public GcPtr<T> {
   };                                                         \
   using GcAliasName = gc<T>;
 
+// Describe the gc pointers of a class, so that its layout is known at static
+// init instead of being discovered by constructing it. Put it in the
+// namespace of the class. Fields can be gc pointers, arrays of them or other
+// traced classes. A `gc_trace(T&, Visitor& v)` that calls `v(fields...)` can
+// also be written by hand, e.g. as a friend to reach private fields.
+#define TGC_TRACE(T, ...)                                 \
+  template <typename Visitor>                             \
+  inline void gc_trace(T& o, Visitor& v) {                \
+    v(TGC_FOR_EACH(TGC_TRACE_FIELD, o, __VA_ARGS__));     \
+  }
+
+#define TGC_TRACE_FIELD(o, f) o.f
+#define TGC_EXPAND(x) x
+#define TGC_FE_1(m, o, x) m(o, x)
+#define TGC_FE_2(m, o, x, ...) m(o, x), TGC_EXPAND(TGC_FE_1(m, o, __VA_ARGS__))
+#define TGC_FE_3(m, o, x, ...) m(o, x), TGC_EXPAND(TGC_FE_2(m, o, __VA_ARGS__))
+#define TGC_FE_4(m, o, x, ...) m(o, x), TGC_EXPAND(TGC_FE_3(m, o, __VA_ARGS__))
+#define TGC_FE_5(m, o, x, ...) m(o, x), TGC_EXPAND(TGC_FE_4(m, o, __VA_ARGS__))
+#define TGC_FE_6(m, o, x, ...) m(o, x), TGC_EXPAND(TGC_FE_5(m, o, __VA_ARGS__))
+#define TGC_FE_7(m, o, x, ...) m(o, x), TGC_EXPAND(TGC_FE_6(m, o, __VA_ARGS__))
+#define TGC_FE_8(m, o, x, ...) m(o, x), TGC_EXPAND(TGC_FE_7(m, o, __VA_ARGS__))
+#define TGC_FE_9(m, o, x, ...) m(o, x), TGC_EXPAND(TGC_FE_8(m, o, __VA_ARGS__))
+#define TGC_FE_10(m, o, x, ...) m(o, x), TGC_EXPAND(TGC_FE_9(m, o, __VA_ARGS__))
+#define TGC_FE_11(m, o, x, ...) m(o, x), TGC_EXPAND(TGC_FE_10(m, o, __VA_ARGS__))
+#define TGC_FE_12(m, o, x, ...) m(o, x), TGC_EXPAND(TGC_FE_11(m, o, __VA_ARGS__))
+#define TGC_FE_13(m, o, x, ...) m(o, x), TGC_EXPAND(TGC_FE_12(m, o, __VA_ARGS__))
+#define TGC_FE_14(m, o, x, ...) m(o, x), TGC_EXPAND(TGC_FE_13(m, o, __VA_ARGS__))
+#define TGC_FE_15(m, o, x, ...) m(o, x), TGC_EXPAND(TGC_FE_14(m, o, __VA_ARGS__))
+#define TGC_FE_16(m, o, x, ...) m(o, x), TGC_EXPAND(TGC_FE_15(m, o, __VA_ARGS__))
+#define TGC_FE_N(_1, _2, _3, _4, _5, _6, _7, _8, _9, _10, _11, _12, _13, _14, \
+                 _15, _16, N, ...)                                          \
+  N
+#define TGC_FOR_EACH(m, o, ...)                                               \
+  TGC_EXPAND(TGC_FE_N(__VA_ARGS__, TGC_FE_16, TGC_FE_15, TGC_FE_14, TGC_FE_13, \
+                      TGC_FE_12, TGC_FE_11, TGC_FE_10, TGC_FE_9, TGC_FE_8,     \
+                      TGC_FE_7, TGC_FE_6, TGC_FE_5, TGC_FE_4, TGC_FE_3,        \
+                      TGC_FE_2, TGC_FE_1)(m, o, __VA_ARGS__))
+
+//////////////////////////////////////////////////////////////////////////
+
+/// istring
+
+// The characters of an istring, shared by its copies, and by the equal ones
+// once interned.
+struct IStringRep {
+#if TGC_THREADS
+  atomic<size_t> refs;  // copies may be dropped by any thread
+#else
+  size_t refs;
+#endif
+  size_t len;
+  size_t hash;  // set when interned
+  bool interned;
+
+  char* data() { return (char*)(this + 1); }
+  const char* data() const { return (const char*)(this + 1); }
+  size_t bytes() const { return sizeof(IStringRep) + len + 1; }
+  static IStringRep* make(const char* s, size_t len);
+  void release() {
+    if (!--refs)
+      destroy();
+  }
+  void destroy();
+};
+
+// The buffers of the istrings promoted to the old generation, by content.
+// A promoted istring equal to one in it drops its own buffer for that one.
+class StringPool {
+ public:
+  struct Stats {
+    size_t strings;     // buffers interned
+    size_t bytes;       // held by them
+    size_t savedBytes;  // the copies they would take unshared
+  };
+
+  ~StringPool();
+  // returns the bytes freed.
+  size_t intern(IStringRep*& rep);
+  void erase(IStringRep* rep) { set.erase(rep); }
+  Stats getStats() const;
+
+ private:
+  struct Hash {
+    size_t operator()(const IStringRep* r) const { return r->hash; }
+  };
+  struct Equal {
+    bool operator()(const IStringRep* a, const IStringRep* b) const {
+      return a->len == b->len && !memcmp(a->data(), b->data(), a->len);
+    }
+  };
+  unordered_set<IStringRep*, Hash, Equal> set;
+};
+
+// An immutable string whose characters are shared by its copies. Held by a
+// gc_istring, it is interned when promoted to the old generation, so that
+// the long lived duplicates take the memory of one.
+class istring {
+ public:
+  istring() {}
+  istring(string_view s)
+      : rep(s.size() ? IStringRep::make(s.data(), s.size()) : nullptr) {}
+  istring(const char* s) : istring(string_view(s)) {}
+  istring(const string& s) : istring(string_view(s)) {}
+  istring(const istring& r) : rep(r.rep) {
+    if (rep)
+      rep->refs++;
+  }
+  istring(istring&& r) noexcept : rep(r.rep) { r.rep = nullptr; }
+  istring& operator=(istring r) noexcept {
+    swap(rep, r.rep);
+    return *this;
+  }
+  ~istring() {
+    if (rep)
+      rep->release();
+  }
+
+  const char* data() const { return rep ? rep->data() : ""; }
+  const char* c_str() const { return data(); }
+  size_t size() const { return rep ? rep->len : 0; }
+  bool empty() const { return !rep; }
+  string_view view() const { return {data(), size()}; }
+  operator string_view() const { return view(); }
+  string str() const { return string(view()); }
+
+  friend bool operator==(const istring& a, const istring& b) {
+    return a.rep == b.rep || a.view() == b.view();
+  }
+  friend bool operator!=(const istring& a, const istring& b) {
+    return !(a == b);
+  }
+
+ private:
+  friend class Collector;
+
+  IStringRep* rep = nullptr;
+};
+
+// kept in the generations, for the promotion to intern them.
+template <>
+struct is_gc_leaf<istring> : false_type {};
+template <>
+struct is_gc_acyclic<istring> : true_type {};
+// no gc pointers, known without constructing one.
+template <typename Visitor>
+inline void gc_trace(istring&, Visitor&) {}
+
 //////////////////////////////////////////////////////////////////////////
 
+enum class MemoryPressure { Moderate, Critical };
+
 struct GcCondition {
   virtual ~GcCondition() {}
   virtual bool needMinorGc(Collector* c) = 0;
   virtual bool needFullGc(Collector* c) = 0;
+  // objects freed without a gc, by gc_delete or the reference counts.
+  virtual void onFreed(Collector*, size_t) {}
+  // checked when no full gc is needed, see Collector::mixedCollect.
+  virtual bool needMixedGc(Collector*) { return false; }
+};
+
+struct GcCondition_ObjCnt;
+struct GcCondition_Time;
+#ifdef TGC_GC_CONDITION
+using GcConditionType = TGC_GC_CONDITION;
+#else
+using GcConditionType = GcCondition;
+#endif
+
+// Streams the allocations, the gc pointer writes and the destroyed gc
+// pointers into a binary file, for tgc2_sim to replay them against other
+// gc policies. It needs TGC_ALLOC_TRACE.
+class GcTrace {
+ public:
+  enum class Kind : uint32_t {
+    Alloc,      // id: the header, arg: the bytes from it
+    AllocLeaf,  // the same, in the leaf space
+    Store,      // id: the gc pointer, arg: the header stored or 0
+    Drop,       // id: the gc pointer destroyed
+    MinorGc,
+    FullGc,
+    MixedGc,
+    Free,  // id: the header, before its destructor runs
+  };
+  struct Record {
+    uint64_t time;  // ns since the start
+    uint64_t id;
+    uint64_t arg;
+    uint32_t cls;  // class index of an allocation
+    Kind kind;
+  };
+  // the file starts with it, then the records follow.
+  static constexpr char Magic[8] = "tgc2trc";
+
+  ~GcTrace() { stop(); }
+  bool start(const char* path);
+  // false if the trace could not be written whole, tracing stops at the
+  // first failed write.
+  bool stop();
+  bool isRecording() const { return file; }
+  void alloc(const ObjMeta* m, size_t bytes) {
+    if (file)
+      add(m->isLeaf ? Kind::AllocLeaf : Kind::Alloc, uintptr_t(m), bytes,
+          m->classIndex);
+  }
+  void store(const PtrBase* p, const ObjMeta* m) {
+    if (file)
+      add(Kind::Store, uintptr_t(p), uintptr_t(m), 0);
+  }
+  void drop(const PtrBase* p) {
+    if (file)
+      add(Kind::Drop, uintptr_t(p), 0, 0);
+  }
+  void gc(Kind kind) {
+    if (file)
+      add(kind, 0, 0, 0);
+  }
+  void free(const ObjMeta* m) {
+    if (file)
+      add(Kind::Free, uintptr_t(m), 0, 0);
+  }
+
+ private:
+  void add(Kind kind, uint64_t id, uint64_t arg, uint32_t cls);
+  bool flush();
+
+  FILE* file = nullptr;
+  vector<Record> buf;
+  uint64_t startTime = 0;
+  bool failed = false;
+};
+
+// Records the collections and their phases as begin and end events into a
+// ring buffer, overwriting the oldest ones, to be written out as a timeline
+// on demand. An event is a clock read and a store, nothing is allocated
+// after start, so it can be left on.
+class GcRecorder {
+ public:
+  struct Event {
+    const char* name;
+    uint64_t time;  // ns of the steady clock
+    uint64_t objs;
+    uint64_t bytes;
+    bool begin;
+  };
+
+  void start(size_t capacity = 64 * 1024);
+  void stop() { recording = false; }
+  bool isRecording() const { return recording; }
+  void clear() { count = 0; }
+  void begin(const char* name) {
+#if TGC_RECORDER
+    if (recording)
+      record(name, true, 0, 0);
+#endif
+  }
+  void end(const char* name, size_t objs = 0, size_t bytes = 0) {
+#if TGC_RECORDER
+    if (recording)
+      record(name, false, objs, bytes);
+#endif
+  }
+  // the events kept, from the oldest one.
+  vector<Event> events() const;
+  // for chrome://tracing or ui.perfetto.dev.
+  bool writeChromeTrace(const char* path) const;
+  bool writePerfetto(const char* path) const;
+
+ private:
+  void record(const char* name, bool begin, size_t objs, size_t bytes);
+
+  vector<Event> ring;
+  size_t count = 0;  // all the events recorded, the last ones are kept
+  bool recording = false;
+};
+
+#if TGC_THREADS
+// What a thread using gc objects keeps to itself, so that allocating and
+// writing gc pointers take no lock. It is attached by the first use and
+// detached when the thread exits. The collector takes its new objects and
+// its barrier log when it stops the threads for a gc, see
+// Collector::stopWorld.
+//
+// The gc pointers on the stack of a thread are logged in order, as only the
+// thread writes and destroys them. The others may be written by one thread
+// and destroyed by another, so their entries are numbered to be replayed in
+// the order of all the threads.
+class GcThread {
+  friend class Collector;
+
+ public:
+  // cells of a size class taken from the heap at a time.
+  static constexpr unsigned CacheRefill = 64;
+  // allocations of the thread per lock taken to ask the gc condition.
+  static constexpr unsigned CondBatch = 64;
+  static constexpr size_t LogSize = 1024 * 64;
+
+  // null once the thread is exiting.
+  static GcThread* self() { return current ? current : attach(); }
+
+  // Returns whether the log is full.
+  bool log(uintptr_t e, atomic<uint64_t>& seq) {
+    auto* p = (const char*)(e & ~uintptr_t(1));
+    if (size_t(p - stackLo) < size_t(stackHi - stackLo))
+      stackLog.push_back(e);
+    else
+      sharedLog.emplace_back(seq.fetch_add(1, memory_order_relaxed), e);
+    return stackLog.size() + sharedLog.size() >= LogSize;
+  }
+  // the bytes of the cells cached by the calling thread, not in use yet.
+  static size_t cachedBytes(const Heap& heap);
+
+ private:
+  // freed cells linked through their first word.
+  struct CellCache {
+    char* head = nullptr;
+    unsigned cnt = 0;
+  };
+
+  static GcThread* attach();
+  void detach();
+  char* allocCell(Collector* c, size_t sz);
+  void freeCell(Collector* c, char* p, unsigned sizeClass);
+  // gives all the cells back to the heap.
+  void returnCells(Heap& heap);
+
+  inline static thread_local GcThread* current = nullptr;
+  inline static thread_local bool exited = false;
+
+  char* stackLo = nullptr;
+  char* stackHi = nullptr;
+  vector<CellCache> caches;  // by size class
+  vector<ObjMeta*> fresh;    // not in the new generation yet
+  vector<uintptr_t> stackLog;
+  vector<pair<uint64_t, uintptr_t>> sharedLog;
+  unsigned allocs = 0;  // since the gc condition was asked
+  int blocking = 0;
 };
+#endif
 
 class Collector {
   friend class ClassMeta;
+  friend class ObjMeta;
   friend class PtrBase;
+  friend struct IStringRep;
+  template <typename T>
+  friend class gc_allocator;
+#if TGC_THREADS
+  friend class GcThread;
+#endif
 
-  // using MetaSet = list<ObjMeta*>;
-  using MetaSet = helper::list<ObjMeta, &ObjMeta::gen>;
-
+  Heap heap;
   MetaSet newGen, oldGen;
-  vector<ObjMeta*> creatingObjs;
+  // out of the generations, see freeze.
+  MetaSet frozen;
+  // objects of untraced classes being constructed.
+  static TGC_THREAD_LOCAL vector<ObjMeta*> creatingObjs;
   vector<ObjMeta*> temp;
-  vector<PtrBase*> unrefs;
+  // written and destroyed pointers in order, destroyed ones are tagged.
+  vector<uintptr_t> barrierLog;
   unordered_set<const PtrBase*> roots;
   unordered_set<const PtrBase*> intergenerationalPtrs;
   unordered_set<const PtrBase*> delayIntergenerationalPtrs;
-  GcCondition* gcCond = nullptr;
+  GcConditionType* gcCond = nullptr;
+  GcRecorder recorder;
+  GcTrace trace;
+  StringPool strings;
+  vector<pair<int, function<void(MemoryPressure)>>> pressureHandlers;
+  int pressureHandlerId = 0;
+  bool inPressure = false;
+
+  // gc_region
+  int regionDepth = 0;
+  vector<ObjMeta*> regionObjs;
+  vector<char*> regionPages;
+  char* regionCur = nullptr;
+  char* regionEnd = nullptr;
+  // pointers from outside into the region.
+  unordered_set<const PtrBase*> regionRefs;
+
+  // gc_delete
+  int deleteDepth = 0;
+  vector<ObjMeta*> deleted;
+  // the objects preMark found in their constructor, see ObjMeta::creating.
+  vector<ObjMeta*> constructing;
+
+#if TGC_HYBRID_RC
+  // decrements not applied yet, an object may be in it many times.
+  vector<ObjMeta*> releases;
+  vector<ObjMeta*> dying;
+  // destroyed by the sweep, a full gc frees them after both gens.
+  vector<ObjMeta*> swept;
+  bool flushingReleases = false;
+#endif
+
+#if TGC_MIXED_GC
+  // Old objects are grouped by the 1MB of address their header is in. A
+  // region remembers the pointers into it from the other ones, with the
+  // region of their owner if known, so that it can be collected without
+  // tracing the rest of the old generation.
+  static constexpr size_t OldRegionShift = 20;
+  static constexpr uintptr_t NoRegion = ~uintptr_t(0);
+  struct OldRegion {
+    unordered_map<const PtrBase*, uintptr_t> remset;
+    unordered_set<ObjMeta*> objs;  // its old objects, so a mixed gc takes them
+    size_t bytes = 0;  // of its old objects
+    // since its last sweep, of the objects promoted into it and of the ones
+    // the dead of other regions pointed to.
+    size_t garbage = 0;
+  };
+  unordered_map<uintptr_t, OldRegion> oldRegions;
+  // the region each remembered pointer is filed in.
+  unordered_map<const PtrBase*, uintptr_t> remembered;
+  // may point to old objects once the promotions are done, with the owner
+  // if known.
+  vector<pair<const PtrBase*, const ObjMeta*>> toRemember;
+  // the regions of the running mixed gc, sorted.
+  vector<uintptr_t> collectionSet;
+  size_t mixedGcBudget = size_t(4) << 20;
+  size_t oldGenSizeAfterGc = 0;
+#endif
+
+#if TGC_THREADS
+  // Held by the thread that stops the world until it resumes it.
+  mutex threadLock;
+  condition_variable threadCv;
+  vector<GcThread*> threads;
+  // parked at a safepoint or in a blocking region.
+  size_t stoppedThreads = 0;
+  atomic<bool> stopRequested{false};
+  // numbers the entries of the barrier logs of the threads.
+  atomic<uint64_t> logSeq{0};
+  // of the threads gone since the last gc, replayed with the others.
+  vector<pair<uint64_t, uintptr_t>> orphanLog;
+  // of the world by this thread.
+  inline static thread_local int stopDepth = 0;
+#endif
 
   int freeObjCntOfPrevGc = 0;
   int fullGcCount = 0;
+  int mixedGcCount = 0;
   int newGenGcCount = 0;
-  int scanCountToOldGen = 2;
-  bool trace = false;
+  static constexpr int scanCountToOldGen = TGC_TENURE_SCANS;
   bool full = false;
+  bool mixed = false;
+  bool collecting = false;
 
   static Collector* inst;
 
@@ -438,30 +1594,262 @@ class Collector {
   void minorCollect();
   void collect();
   void dumpStats();
-  void resetCounters() { newGenGcCount = fullGcCount = 0; }
-  size_t getNewGenSize() { return newGen.size(); }
+  void resetCounters() { newGenGcCount = fullGcCount = mixedGcCount = 0; }
+  int getMinorGcCount() const { return newGenGcCount; }
+  int getFullGcCount() const { return fullGcCount; }
+  int getMixedGcCount() const { return mixedGcCount; }
+#if TGC_MIXED_GC
+  // A minor gc that also collects the old regions with the most bytes
+  // promoted into them, or left by the dead of other regions, since their
+  // last sweep, as many as the budget of old bytes allows and at least one.
+  // Objects do not move, the dead ones of the regions are freed in place.
+  void mixedCollect();
+  void setMixedGcBudget(size_t bytes) { mixedGcBudget = bytes; }
+  // old objects added since the last full or mixed gc.
+  size_t getOldGenGrowth() const {
+    return oldGen.size() > oldGenSizeAfterGc ? oldGen.size() - oldGenSizeAfterGc
+                                             : 0;
+  }
+#endif
+#if TGC_THREADS
+  // Parks the calling thread while another one has the world stopped for a
+  // gc, see gc_safepoint.
+  void safepoint() {
+    if (stopRequested.load(memory_order_relaxed))
+      park();
+  }
+  // The calling thread does not touch gc objects until it leaves, so the
+  // gcs need not wait for it, see gc_blocking_region.
+  void enterBlocking();
+  void leaveBlocking();
+  size_t getThreadCount();
+#endif
+  size_t getNewGenSize() {
+#if TGC_THREADS
+    // with the new objects of the threads.
+    StopTheWorld stop(this);
+#endif
+    return newGen.size();
+  }
   size_t getOldGenSize() { return oldGen.size(); }
-  void setGcCondition(GcCondition* c) {
-    delete gcCond;
-    gcCond = c;
+  size_t getFrozenSize() { return frozen.size(); }
+  void setGcCondition(GcConditionType* c);
+  Heap& getHeap() { return heap; }
+  GcRecorder& getRecorder() { return recorder; }
+  GcTrace& getTrace() { return trace; }
+  StringPool::Stats getStringStats() const { return strings.getStats(); }
+  void releaseMemory();
+  // Frees all it can: the handlers drop their caches first, then a full gc
+  // runs and the memory is given back. Allocations do it by themselves when
+  // the heap gets close to its limit, and fail only if it did not help.
+  void handleMemoryPressure(MemoryPressure level);
+  int addMemoryPressureHandler(function<void(MemoryPressure)> h) {
+    pressureHandlers.emplace_back(++pressureHandlerId, move(h));
+    return pressureHandlerId;
+  }
+  void removeMemoryPressureHandler(int id) {
+    for (auto it = pressureHandlers.begin(); it != pressureHandlers.end(); ++it)
+      if (it->first == id) {
+        pressureHandlers.erase(it);
+        break;
+      }
+  }
+  // Moves the objects reachable from root out of the generations, for data
+  // that lives as long as the program: gcs neither walk nor free them. Their
+  // gc pointers are roots, so the objects stored into them later are kept.
+  // Returns how many were frozen, none while a region is open.
+  size_t freeze(ObjMeta* root);
+  // Returns all the frozen objects to the old generation.
+  size_t thaw();
+  // Writes the objects reachable from root into a file, which fails if any
+  // of them is not image safe. Loading it adopts them into the old
+  // generation, with their gc pointers and classes relocated. The classes
+  // should have the same layout in both programs.
+  bool saveImage(const char* path, ObjMeta* root);
+  ObjMeta* loadImage(const char* path, ClassMeta* rootClass);
+#if TGC_HYBRID_RC
+  static constexpr size_t ReleaseBufferSize = 256;
+  void logRelease(ObjMeta* m) { releases.push_back(m); }
+  // Applies the buffered decrements and frees the objects that lost their
+  // last gc pointer. Allocations do it when the buffer is full.
+  void flushReleases();
+  // of objects freed by other means.
+  void dropReleases(ObjMeta* const* metas, size_t n);
+#endif
+  // Objects deleted between them are freed at the end, see DeleteBatch.
+  void beginDelete() {
+#if TGC_THREADS
+    stopWorld();
+#endif
+    deleteDepth++;
+  }
+  void endDelete();
+  void addDeleted(ObjMeta* m) {
+    if (!collecting)  // else the sweep frees them
+      deleted.push_back(m);
+  }
+  void openRegion() {
+#if TGC_THREADS
+    assert(threads.size() <= 1 && "regions are for a single thread");
+#endif
+    regionDepth++;
   }
+  void closeRegion();
+  bool isRegionOpen() const { return regionDepth > 0; }
+  bool inRegion(const void* p) const {
+    return regionDepth && heap.inOpenBumpPage(p);
+  }
+#if TGC_CONSERVATIVE_ROOTS
+  static bool onStack(const void* p) {
+    return size_t((const char*)p - stackLo) < size_t(stackHi - stackLo);
+  }
+#endif
 
  private:
   Collector();
   ~Collector();
 
   void sweep(MetaSet& gen);
-  void promote(ObjMeta* meta);
+#if TGC_HYBRID_RC
+  void freeSwept();
+#endif
+  // destructors may allocate as well.
+  size_t freedSince(size_t usedBefore) const;
+  // returns the bytes freed by interning its strings.
+  size_t promote(ObjMeta* meta);
   ObjMeta* globalFindOwnerMeta(void* obj);
   void tryRegisterToClass(PtrBase* p);
-  void handleUnrefs();
+  // flags the pointers of owner as its own, after a container swap.
+  void adoptPtrs(ObjMeta* owner);
+  void logBarrier(uintptr_t e) {
+#if TGC_THREADS
+    // unless this thread has the world stopped.
+    if (!stopDepth) {
+      auto* t = GcThread::self();
+      if (!t || t->log(e, logSeq))
+        logFull(t, e);
+      return;
+    }
+#endif
+    barrierLog.push_back(e);
+    if (barrierLog.size() >= 1024 * 64)
+      flushBarrierLog();
+  }
+  void flushBarrierLog();
   void handleDelayIntergenerationalPtrs();
+  void markIntergenerationalPtrs();
   void mark(ObjMeta* meta);
   void preMark(ObjMeta* meta);
+  // Call f with each non-null pointer, see IPtrEnumerator::getRun.
+  static size_t findPtrs(const PtrBase* run, size_t n, uint32_t* idx);
+  template <typename F, typename C>
+  static void scanRun(const PtrBase* run, size_t n, F f, C eachChunk);
+  template <typename F>
+  static void forEachPtr(IPtrEnumerator* it, F f);
   void addMeta(ObjMeta* meta);
+  void addMetas(ObjMeta** metas, size_t n);
+  // of an object that failed to construct.
+  void removeMeta(ObjMeta* meta);
+  bool needMinorGc();
+  char* allocCell(size_t sz);
+  size_t allocCells(size_t sz, size_t n, char** out);
+  void freeCell(void* p);
+#if TGC_THREADS
+  // Locks the state shared by the threads, unless this thread has the world
+  // stopped and holds it already.
+  class ThreadLock {
+    Collector* c;
+
+   public:
+    explicit ThreadLock(Collector* c) : c(stopDepth ? nullptr : c) {
+      if (this->c)
+        this->c->threadLock.lock();
+    }
+    ~ThreadLock() {
+      if (c)
+        c->threadLock.unlock();
+    }
+  };
+  struct StopTheWorld {
+    Collector* c;
+    explicit StopTheWorld(Collector* c) : c(c) { c->stopWorld(); }
+    ~StopTheWorld() { c->resumeWorld(); }
+  };
+  // Waits for the other threads to park or block, then takes their new
+  // objects and barrier logs. Nested calls of the thread only count.
+  void stopWorld();
+  void resumeWorld();
+  void park();
+  void gatherThreads();
+  // t is null once the thread is exiting, e is not logged then.
+  void logFull(GcThread* t, uintptr_t e);
+#endif
+  void trimBuffers();
+  char* regionAlloc(size_t sz);
+  void filterRegionRefs();
+  void markFromRegion();
+  bool freeDeleted(ObjMeta* m);
+  void freeDead(vector<ObjMeta*>& dead);
+#if TGC_MIXED_GC
+  static uintptr_t oldRegionOf(const void* p) {
+    return uintptr_t(p) >> OldRegionShift;
+  }
+  bool inCollectionSet(const ObjMeta* m) const {
+    return binary_search(collectionSet.begin(), collectionSet.end(),
+                         oldRegionOf(m));
+  }
+  // the old object p is in, if it can be told.
+  const ObjMeta* findOldOwner(const PtrBase* p) const;
+  // files p into the region it points to, unless it is the one of owner.
+  void remember(const PtrBase* p, const ObjMeta* owner);
+  void forget(const PtrBase* p);
+  void rememberPromoted();
+  void countOldRegions();
+  void leaveOldRegion(ObjMeta* m);
+  void selectCollectionSet();
+  void sweepCollectionSet(vector<ObjMeta*>& objs);
+#endif
+#if TGC_CHECK_DELETE
+  unordered_set<ObjMeta*> findReferenced(const vector<ObjMeta*>& metas);
+#endif
+#if TGC_CONSERVATIVE_ROOTS
+  static char* stackLo;
+  static char* stackHi;
+  template <typename F>
+  static void scanStack(F f);
+  ObjMeta* findMeta(const void* p);
+  void findStackRoots();
+  // found by the stack scan at the start of a gc or when a region closes.
+  vector<ObjMeta*> stackRoots;
+  vector<const void*> stackRefs;
+#endif
 };
 
-struct GcCondition_ObjCnt : GcCondition {
+#if TGC_ALLOC_TRACE
+inline void PtrBase::traceStore(ObjMeta* m) const {
+  Collector::inst->trace.store(this, m);
+}
+#endif
+
+// Pointers inside young objects need no record, unless they may let an
+// object escape from a region.
+inline void PtrBase::writeBarrier() {
+  auto* m = getMeta();
+  // old to old pointers are found by tracing, like the ones of promotion,
+  // unless the old regions remember them.
+  if (m && (isRoot() || isOld() || Collector::inst->isRegionOpen()) &&
+      (TGC_MIXED_GC || !(isOld() && m->isOld)))
+    logWrite(m);
+}
+
+#if TGC_HYBRID_RC
+inline void PtrBase::release(ObjMeta* m) {
+  if (m && m->counted)
+    Collector::inst->logRelease(m);
+}
+#endif
+
+struct GcCondition_ObjCnt final : GcCondition {
   int counter = 0;
   int newGenObjCntToGc = 512;
   size_t oldGenObjCntToFullGc = 1024 * 10;
@@ -469,14 +1857,40 @@ struct GcCondition_ObjCnt : GcCondition {
   bool needMinorGc(Collector* c) override {
     return counter++ % newGenObjCntToGc == 0;
   }
+  // the freed ones do not count, up to the last gc.
+  void onFreed(Collector*, size_t objCnt) override {
+    auto sinceGc = counter % newGenObjCntToGc;
+    if (sinceGc > 1)
+      counter -= (int)min(size_t(sinceGc - 1), objCnt);
+  }
+#if TGC_MIXED_GC
+  // a mixed gc once the old generation grew by oldGenObjCntToFullGc, a full
+  // one for what they leave, like the cycles across the regions.
+  int mixedGcCntToFullGc = 64;
+  int mixedGcCnt = 0;
+
+  bool needMixedGc(Collector* c) override {
+    if (c->getOldGenGrowth() <= oldGenObjCntToFullGc)
+      return false;
+    mixedGcCnt++;
+    return true;
+  }
+  bool needFullGc(Collector* c) override {
+    if (mixedGcCnt < mixedGcCntToFullGc)
+      return false;
+    mixedGcCnt = 0;
+    return true;
+  }
+#else
   bool needFullGc(Collector* c) override {
     return c->getOldGenSize() > oldGenObjCntToFullGc;
   }
+#endif
 };
 
-struct GcCondition_Time : GcCondition {
+struct GcCondition_Time final : GcCondition {
   int gcPeriodMs = 10;
-  clock_t lastGcTime;
+  clock_t lastGcTime = clock();
   int newGenGcCntToFullGc = 1024;
   int newGenGcCnt = 0;
   int counter = 0;
@@ -492,6 +1906,29 @@ struct GcCondition_Time : GcCondition {
     }
     return false;
   }
+  void onFreed(Collector*, size_t objCnt) override {
+    counter -= (int)min(size_t(counter), objCnt);
+  }
+#if TGC_MIXED_GC
+  // mixed gcs take the place of the full ones, which are left for what they
+  // do not collect.
+  int mixedGcCntToFullGc = 64;
+  int mixedGcCnt = 0;
+
+  bool needMixedGc(Collector* c) override {
+    if (newGenGcCnt <= newGenGcCntToFullGc)
+      return false;
+    newGenGcCnt = 0;
+    mixedGcCnt++;
+    return true;
+  }
+  bool needFullGc(Collector* c) override {
+    if (mixedGcCnt < mixedGcCntToFullGc)
+      return false;
+    mixedGcCnt = 0;
+    return true;
+  }
+#else
   bool needFullGc(Collector* c) override {
     if (newGenGcCnt > newGenGcCntToFullGc) {
       newGenGcCnt = 0;
@@ -499,6 +1936,7 @@ struct GcCondition_Time : GcCondition {
     }
     return false;
   }
+#endif
 };
 
 //////////////////////////////////////////////////////////////////////////
@@ -511,9 +1949,122 @@ inline Collector* gc_collector() {
   return Collector::get();
 }
 
+inline void gc_memory_pressure(
+    MemoryPressure level = MemoryPressure::Critical) {
+  Collector::get()->handleMemoryPressure(level);
+}
+
+// See Collector::saveImage, arrays created by gc_new_array are saved whole.
+template <typename T>
+bool gc_save_image(const char* path, const gc<T>& root) {
+  return Collector::get()->saveImage(path, root.getMeta());
+}
+
+// See Collector::freeze, the objects stay even if nothing refers to them.
+template <typename T>
+size_t gc_freeze(const gc<T>& root) {
+  return Collector::get()->freeze(root.getMeta());
+}
+
+inline size_t gc_thaw() {
+  return Collector::get()->thaw();
+}
+
+// Returns null if the file is not a valid image of T for this program.
+template <typename T>
+gc<T> gc_load_image(const char* path) {
+  return Collector::get()->loadImage(path, ClassMeta::get<T>());
+}
+
+// Objects created in the scope are bump allocated in a region instead of
+// the new generation. When the scope closes, the objects still referenced
+// from outside join the heap in place, the others are destroyed and their
+// pages released at once. Nested scopes share the outermost region.
+class gc_region {
+ public:
+  gc_region() { Collector::get()->openRegion(); }
+  ~gc_region() { Collector::get()->closeRegion(); }
+  gc_region(const gc_region&) = delete;
+  gc_region& operator=(const gc_region&) = delete;
+};
+
+// With TGC_THREADS, lets the other threads stop this one for a gc. The
+// allocations do it as well, so a thread only calls it in the loops that
+// run long without allocating.
+inline void gc_safepoint() {
+#if TGC_THREADS
+  Collector::get()->safepoint();
+#endif
+}
+
+// With TGC_THREADS, the thread waits or runs in the scope without touching
+// gc objects, e.g. on a lock, a join or IO, so that the gcs do not wait for
+// it. Leaving it waits for a running gc.
+class gc_blocking_region {
+ public:
+#if TGC_THREADS
+  gc_blocking_region() { Collector::get()->enterBlocking(); }
+  ~gc_blocking_region() { Collector::get()->leaveBlocking(); }
+#else
+  gc_blocking_region() {}
+#endif
+  gc_blocking_region(const gc_blocking_region&) = delete;
+  gc_blocking_region& operator=(const gc_blocking_region&) = delete;
+};
+
+// A gc object whose layout is only known at run time, e.g. a coroutine
+// frame. While it is the current frame, the gc pointers constructed inside it
+// are its sub pointers instead of roots, until they are destroyed.
+class GcFrame {
+  friend class PtrBase;
+  friend class FramePtrEnumerator;
+
+ public:
+  static TGC_THREAD_LOCAL GcFrame* current;
+
+  // allocates a frame of `sz` bytes, it is kept alive until endCreate().
+  static ObjMeta* newMeta(size_t sz);
+  static void endCreate();
+
+  explicit GcFrame(ObjMeta* m);
+  virtual ~GcFrame() {}
+  // entered while its code runs, left when it suspends.
+  void enter() {
+    prev = current;
+    current = this;
+  }
+  void leave() { current = prev; }
+  bool contains(const void* p) const {
+    return (char*)this <= (char*)p && (char*)p < end;
+  }
+  ObjMeta* getMeta() const { return meta; }
+
+ private:
+  void add(PtrBase* p);
+  bool remove(PtrBase* p);
+  static ClassMeta* klass();
+
+  ObjMeta* meta;
+  char* end;
+  GcFrame* prev = nullptr;
+  vector<unsigned> ptrs;  // offsets of the live pointers
+};
+
+// The pointers of a class whose layout is known, by gc_trace or from a
+// former instance, are not matched against the objects being discovered.
+struct KnownLayoutScope {
+  int saved = ClassMeta::isCreatingObj;
+  explicit KnownLayoutScope(bool known) {
+    if (known)
+      ClassMeta::isCreatingObj = 0;
+  }
+  ~KnownLayoutScope() { ClassMeta::isCreatingObj = saved; }
+};
+
 template <typename T, typename... Args>
 ObjMeta* gc_new_meta(size_t len, Args&&... args) {
   auto* cls = ClassMeta::get<T>();
+  KnownLayoutScope known(cls->registered);
   auto* meta = cls->newMeta(len);
 
   size_t i = 0;
@@ -522,9 +2073,8 @@ ObjMeta* gc_new_meta(size_t len, Args&&... args) {
     for (; i < len; i++, p++)
       new (p) T(forward<Args>(args)...);
   } catch (...) {
-    for (auto j = i; j > 0; j--, p--) {
-      p->~T();
-    }
+    for (; i > 0; i--)
+      (--p)->~T();
     cls->endNewMeta(meta, true);
     throw;
   }
@@ -533,11 +2083,24 @@ ObjMeta* gc_new_meta(size_t len, Args&&... args) {
   return meta;
 }
 
+// Objects deleted in its scope are freed when it ends, so that the ones
+// deleted twice or by the destructors of the others are freed only once.
+struct DeleteBatch {
+  DeleteBatch() { Collector::get()->beginDelete(); }
+  ~DeleteBatch() { Collector::get()->endDelete(); }
+};
+
+// Runs the destructor and frees the object at once, like delete: the other
+// gc pointers to it must be gone. TGC_CHECK_DELETE verifies that.
 template <typename T>
 void gc_delete(gc<T>& c) {
-  if (c) {
-    c.getMeta()->destroy();
+  if constexpr (is_gc_immediate_v<gc<T>>)
+    c = nullptr;
+  else if (auto* m = c.getMeta()) {
+    DeleteBatch batch;
+    m->destroy();
     c = nullptr;
+    Collector::get()->addDeleted(m);
   }
 }
 
@@ -563,13 +2126,61 @@ gc<Derive> gc_dynamic_pointer_cast(gc<Base>& from) {
 }
 
 template <typename T, typename... Args>
-gc<T> gc_new(Args&&... args) {
-  return gc_new_meta<T>(1, forward<Args>(args)...);
+gc<T> gc_new(Args&&... args) {
+  if constexpr (is_gc_immediate_v<gc<T>>)
+    return T(forward<Args>(args)...);
+  else
+    return gc_new_meta<T>(1, forward<Args>(args)...);
+}
+
+template <typename T, typename... Args>
+gc<T> gc_new_array(size_t len, Args&&... args) {
+  static_assert(!is_gc_immediate_v<gc<T>>,
+                "immediate boxes hold one value, use gc_new_vector");
+  return gc_new_meta<T>(len, forward<Args>(args)...);
+}
+
+template <typename T, typename... Args>
+vector<gc<T>> gc_new_meta_batch(size_t n, const Args&... args) {
+  vector<gc<T>> ret;
+  ret.reserve(n);
+  auto* cls = ClassMeta::get<T>();
+  if (n && !cls->registered) {
+    // the layout is learnt from the first one.
+    ret.emplace_back(gc_new_meta<T>(1, args...));
+    n--;
+  }
+  if (!n)
+    return ret;
+
+  vector<ObjMeta*> metas(n);
+  KnownLayoutScope known(true);
+  cls->newMetaBatch(n, metas.data());
+  size_t i = 0;
+  try {
+    for (; i < n; i++)
+      new (metas[i]->objPtr()) T(args...);
+  } catch (...) {
+    while (i > 0)
+      ((T*)metas[--i]->objPtr())->~T();
+    cls->endNewMetaBatch(metas.data(), n, true);
+    throw;
+  }
+  cls->endNewMetaBatch(metas.data(), n, false);
+  for (auto* m : metas)
+    ret.emplace_back(m);
+  return ret;
 }
 
+// Create n objects that are collected individually, with one gc check and
+// one pass over the heap. They join the new generation once all of them are
+// constructed, the args are passed to each constructor.
 template <typename T, typename... Args>
-gc<T> gc_new_array(size_t len, Args&&... args) {
-  return gc_new_meta<T>(len, forward<Args>(args)...);
+vector<gc<T>> gc_new_batch(size_t n, const Args&... args) {
+  if constexpr (is_gc_immediate_v<gc<T>>)
+    return vector<gc<T>>(n, T(args...));
+  else
+    return gc_new_meta_batch<T>(n, args...);
 }
 
 template <typename T>
@@ -593,11 +2204,12 @@ class gc_function<R(A...)> {
   gc_function() {}
 
   template <typename F>
-  gc_function(F&& f) : callable(gc_new_meta<Imp<F>>(1, forward<F>(f))) {}
+  gc_function(F&& f)
+      : callable(gc_new_meta<Imp<decay_t<F>>>(1, forward<F>(f))) {}
 
   template <typename F>
   gc_function& operator=(F&& f) {
-    callable = gc_new_meta<Imp<F>>(1, forward<F>(f));
+    callable = gc_new_meta<Imp<decay_t<F>>>(1, forward<F>(f));
     return *this;
   }
 
@@ -619,7 +2231,8 @@ class gc_function<R(A...)> {
   template <typename F>
   struct Imp : Callable {
     F f;
-    Imp(F&& ff) : f(ff) {}
+    template <typename U>
+    Imp(U&& ff) : f(forward<U>(ff)) {}
     R call(A... a) override { return f(a...); }
   };
 
@@ -627,10 +2240,371 @@ class gc_function<R(A...)> {
   gc<Callable> callable;
 };
 
+//////////////////////////////////////////////////////////////////////////
+/// Coroutine
+/// The frame of a gc_task is a gc object. The gc pointers living in it are
+/// its sub pointers instead of roots, so awaiting does not touch the root set
+/// and a suspended task is reclaimed once nothing references it.
+
+#if TGC_COROUTINES
+
+class CoroFrame : public GcFrame {
+ public:
+  coroutine_handle<> handle;
+  gc<CoroFrame> continuation;  // the frame awaiting this one
+
+  using GcFrame::GcFrame;
+  ~CoroFrame() override {
+    if (handle) {
+      enter();
+      handle.destroy();
+      leave();
+    }
+  }
+
+  static size_t headerSize() {
+    return (sizeof(CoroFrame) + Heap::Granularity - 1) &
+           ~(Heap::Granularity - 1);
+  }
+  static void* alloc(size_t sz) {
+    auto* meta = GcFrame::newMeta(headerSize() + sz);
+    return (char*)new (meta->objPtr()) CoroFrame(meta) + headerSize();
+  }
+  static void dealloc(void* p) {
+    auto* f = (CoroFrame*)((char*)p - headerSize());
+    // the coroutine failed to be created, the memory goes with the gc.
+    if (!f->handle && current == f) {
+      f->leave();
+      endCreate();
+    }
+  }
+};
+
+template <typename T>
+class gc_task;
+
+class gc_resumer;
+
+template <typename F>
+struct SuspendRequest {
+  F fn;
+};
+
+template <typename T>
+struct is_gc_task : false_type {};
+template <typename T>
+struct is_gc_task<gc_task<T>> : true_type {};
+
+template <typename T>
+struct is_suspend_request : false_type {};
+template <typename F>
+struct is_suspend_request<SuspendRequest<F>> : true_type {};
+
+struct TaskPromiseBase {
+  CoroFrame* frame = (CoroFrame*)GcFrame::current;
+  exception_ptr error;
+
+  static void* operator new(size_t sz) { return CoroFrame::alloc(sz); }
+  static void operator delete(void* p) { CoroFrame::dealloc(p); }
+
+  struct InitialAwaiter {
+    CoroFrame* frame;
+    bool await_ready() noexcept { return false; }
+    void await_suspend(coroutine_handle<>) noexcept { frame->leave(); }
+    void await_resume() noexcept { frame->enter(); }
+  };
+
+  struct FinalAwaiter {
+    CoroFrame* frame;
+    bool await_ready() noexcept { return false; }
+    coroutine_handle<> await_suspend(coroutine_handle<>) noexcept {
+      frame->leave();
+      // the continuation is kept, it may only be referenced from here.
+      if (auto& c = frame->continuation)
+        return c->handle;
+      return noop_coroutine();
+    }
+    void await_resume() noexcept {}
+  };
+
+  template <typename U>
+  struct TaskAwaiter {
+    CoroFrame* callee;
+    CoroFrame* caller;
+    bool await_ready() { return callee->handle.done(); }
+    // runs the callee in place rather than by symmetric transfer, whose tail
+    // call is not guaranteed in debug builds.
+    bool await_suspend(coroutine_handle<>) {
+      caller->leave();
+      callee->handle.resume();
+      if (callee->handle.done())
+        return false;
+      callee->continuation.reset(caller->getMeta());
+      return true;
+    }
+    U await_resume() {
+      caller->enter();
+      return gc_task<U>::promiseOf(callee).take();
+    }
+  };
+
+  template <typename F>
+  struct SuspendAwaiter {
+    F fn;
+    CoroFrame* frame;
+    bool await_ready() { return false; }
+    void await_suspend(coroutine_handle<>);
+    void await_resume() { frame->enter(); }
+  };
+
+  // other awaitables may keep the handle where the gc can not see it, so the
+  // frame is pinned by a root meanwhile.
+  template <typename A>
+  struct ForeignAwaiter {
+    A inner;
+    CoroFrame* frame;
+    unique_ptr<gc<CoroFrame>> pin;
+
+    bool await_ready() { return inner.await_ready(); }
+    template <typename P>
+    auto await_suspend(coroutine_handle<P> h) {
+      pin.reset(new gc<CoroFrame>(frame->getMeta()));
+      frame->leave();
+      try {
+        return inner.await_suspend(h);
+      } catch (...) {
+        frame->enter();
+        pin.reset();
+        throw;
+      }
+    }
+    decltype(auto) await_resume() {
+      frame->enter();
+      pin.reset();
+      return inner.await_resume();
+    }
+  };
+
+  InitialAwaiter initial_suspend() noexcept { return {frame}; }
+  FinalAwaiter final_suspend() noexcept { return {frame}; }
+  void unhandled_exception() { error = current_exception(); }
+
+  template <typename A>
+  auto await_transform(A&& a) {
+    using D = decay_t<A>;
+    if constexpr (is_gc_task<D>::value)
+      return TaskAwaiter<typename D::value_type>{a.frame.operator->(), frame};
+    else if constexpr (is_suspend_request<D>::value)
+      return SuspendAwaiter<decltype(a.fn)>{move(a.fn), frame};
+    else
+      return ForeignAwaiter<A>{forward<A>(a), frame, nullptr};
+  }
+};
+
+template <typename T>
+struct TaskPromise : TaskPromiseBase {
+  optional<T> value;
+
+  template <typename U>
+  void return_value(U&& v) {
+    value.emplace(forward<U>(v));
+  }
+  T& result() {
+    if (error)
+      rethrow_exception(error);
+    return *value;
+  }
+  T take() { return move(result()); }
+};
+
+template <>
+struct TaskPromise<void> : TaskPromiseBase {
+  void return_void() {}
+  void result() {
+    if (error)
+      rethrow_exception(error);
+  }
+  void take() { result(); }
+};
+
+// A lazily started coroutine, e.g.
+//   gc_task<int> f(gc<A> a) { co_return co_await g(a); }
+// Await it from another gc_task, or resume it from outside. Inside it,
+// `co_await gc_suspend(fn)` passes to `fn` a gc_resumer to resume it later.
+template <typename T = void>
+class gc_task {
+  friend struct TaskPromiseBase;
+
+ public:
+  struct promise_type : TaskPromise<T> {
+    gc_task get_return_object() {
+      // the task may be stored in the frame of the creator.
+      this->frame->leave();
+      this->frame->handle = coroutine_handle<promise_type>::from_promise(*this);
+      gc_task t(this->frame->getMeta());
+      GcFrame::endCreate();
+      return t;
+    }
+  };
+
+  using value_type = T;
+
+  gc_task() {}
+  bool done() const { return frame->handle.done(); }
+  // starts or continues it until its next suspension.
+  void resume() const { frame->handle.resume(); }
+  decltype(auto) result() const {
+    return promiseOf(frame.operator->()).result();
+  }
+  explicit operator bool() const { return (bool)frame; }
+
+  static promise_type& promiseOf(CoroFrame* f) {
+    return coroutine_handle<promise_type>::from_address(f->handle.address())
+        .promise();
+  }
+
+ private:
+  explicit gc_task(ObjMeta* m) : frame(m) {}
+
+  gc<CoroFrame> frame;
+};
+
+// Resumes a task suspended by gc_suspend. The task is alive as long as the
+// resumer is.
+class gc_resumer {
+ public:
+  gc_resumer() {}
+  explicit gc_resumer(CoroFrame* f) : frame(f->getMeta()) {}
+  explicit operator bool() const { return (bool)frame; }
+  void operator()() {
+    auto f = move(frame);
+    f->handle.resume();
+  }
+
+ private:
+  gc<CoroFrame> frame;
+};
+
+template <typename F>
+void TaskPromiseBase::SuspendAwaiter<F>::await_suspend(coroutine_handle<>) {
+  frame->leave();
+  fn(gc_resumer(frame));
+}
+
+template <typename F>
+SuspendRequest<decay_t<F>> gc_suspend(F&& fn) {
+  return {forward<F>(fn)};
+}
+
+#endif
+
 //////////////////////////////////////////////////////////////////////////
 // Wrap STL Containers
 //////////////////////////////////////////////////////////////////////////
 
+//////////////////////////////////////////////////////////////////////////
+/// Allocator
+/// Container storage in the gc heap. The gc pointers a gc_allocator
+/// constructs are sub pointers of the object holding the container from
+/// birth instead of roots, so filling or growing it skips the root set and
+/// the destroyed ones are not logged.
+
+// The element a gc_allocator is constructing or destroying.
+class GcBuffer {
+ public:
+  static TGC_THREAD_LOCAL GcBuffer* current;
+
+  GcBuffer(ObjMeta* o, const void* p, size_t sz)
+      : owner(o), begin((const char*)p), end(begin + sz), prev(current) {
+    current = this;
+  }
+  ~GcBuffer() { current = prev; }
+  bool contains(const void* p) const { return begin <= p && p < end; }
+  void adopt(const PtrBase* p) const { p->adoptBy(owner); }
+
+  ObjMeta* owner;  // none when destroying
+
+ private:
+  const char* begin;
+  const char* end;
+  GcBuffer* prev;
+};
+
+template <typename T>
+class gc_allocator {
+  template <typename U>
+  friend class gc_allocator;
+
+  // zeroed, so that Heap::findObject never takes it for an object.
+  static constexpr size_t Header = Heap::Granularity;
+
+ public:
+  using value_type = T;
+  using is_always_equal = false_type;
+  // the slots go with the storage, see swap.
+  using propagate_on_container_swap = true_type;
+
+  gc_allocator() {}
+  template <typename U>
+  gc_allocator(const gc_allocator<U>&) {}
+
+  T* allocate(size_t n) {
+    Collector::get();
+    auto* p = ClassMeta::callAlloc(Header + n * sizeof(T));
+    memset(p, 0, Header);
+    return (T*)(p + Header);
+  }
+  void deallocate(T* p, size_t) { ClassMeta::callDealloc((char*)p - Header); }
+
+  template <typename U, typename... Args>
+  void construct(U* p, Args&&... args) {
+    if (auto* o = owner()) {
+      GcBuffer b(o, p, sizeof(U));
+      ::new ((void*)p) U(forward<Args>(args)...);
+    } else {
+      ::new ((void*)p) U(forward<Args>(args)...);
+    }
+  }
+  template <typename U>
+  void destroy(U* p) {
+    GcBuffer b(nullptr, p, sizeof(U));
+    p->~U();
+  }
+
+  // moves take the storage only between containers flagged alike.
+  template <typename U>
+  bool operator==(const gc_allocator<U>& r) const {
+    return age() == r.age();
+  }
+  template <typename U>
+  bool operator!=(const gc_allocator<U>& r) const {
+    return age() != r.age();
+  }
+  // Called by the containers once they swapped their storage, the slots are
+  // then flagged for their new owner. Out of a gc object they are roots, which
+  // can not be told apart from here.
+  friend void swap(gc_allocator& a, gc_allocator& b) { a.swapped(b); }
+
+ private:
+  // the container is a member of a gc object, or part of one.
+  ObjMeta* owner() const {
+    return Collector::get()->getHeap().findObject(this);
+  }
+  int age() const {
+    auto* o = owner();
+    return o ? 1 + o->isOld + o->isFrozen() : 0;
+  }
+  void swapped(const gc_allocator& r) const {
+    if (age() == r.age())
+      return;
+    auto *x = owner(), *y = r.owner();
+    assert(x && y && "swap a gc container only with another gc one");
+    auto* c = Collector::get();
+    c->adoptPtrs(x);
+    c->adoptPtrs(y);
+  }
+};
+
 template <typename C>
 struct ContainerPtrEnumerator : IPtrEnumerator {
   C* con;
@@ -644,47 +2618,68 @@ struct ContainerPtrEnumerator : IPtrEnumerator {
 //////////////////////////////////////////////////////////////////////////
 /// Vector
 
-template <typename T>
-struct PtrEnumerator<vector<gc<T>>> : ContainerPtrEnumerator<vector<gc<T>>> {
-  using ContainerPtrEnumerator<vector<gc<T>>>::ContainerPtrEnumerator;
+template <typename T, typename A>
+struct PtrEnumerator<vector<gc<T>, A>>
+    : ContainerPtrEnumerator<vector<gc<T>, A>> {
+  using ContainerPtrEnumerator<vector<gc<T>, A>>::ContainerPtrEnumerator;
 
   const PtrBase* getNext() override {
     return this->hasNext() ? &*this->it++ : nullptr;
   }
+  size_t getRun(const PtrBase*& first) override {
+    static_assert(sizeof(gc<T>) == sizeof(PtrBase), "slots should be dense");
+    first = this->con->data();
+    return this->con->size();
+  }
 };
 
-template <typename T>
-struct PtrEnumerator<vector<T>> : ContainerPtrEnumerator<vector<T>> {
-  using ContainerPtrEnumerator<vector<T>>::ContainerPtrEnumerator;
+template <typename T, typename A>
+struct PtrEnumerator<vector<T, A>> : ContainerPtrEnumerator<vector<T, A>> {
+  using ContainerPtrEnumerator<vector<T, A>>::ContainerPtrEnumerator;
 
   unique_ptr<IPtrEnumerator> ptrIter = nullptr;
 
+  IPtrEnumerator* elems() {
+    if (!ptrIter) {
+      ptrIter.reset(ClassMeta::getRegistered<T>()->enumPtrs(this->con->data(),
+                                                            this->con->size()));
+    }
+    return ptrIter.get();
+  }
   const PtrBase* getNext() override {
     if (sizeof(T) < sizeof(gc<T>)) {
       return nullptr;
     }
-    if (!ptrIter) {
-      ptrIter.reset(ClassMeta::getRegistered<T>()->enumPtrs(this->con->data(),
-                                                            this->con->size()));
+    auto* e = elems();
+    return e ? e->getNext() : nullptr;
+  }
+  size_t getRun(const PtrBase*& first) override {
+    if (sizeof(T) < sizeof(gc<T>)) {
+      return 0;
     }
-    return ptrIter ? ptrIter->getNext() : nullptr;
+    auto* e = elems();
+    return e ? e->getRun(first) : 0;
   }
 };
 
 template <typename T>
-class gc_vector : public gc<vector<gc<T>>> {
+using gc_vector_storage = vector<gc<T>, gc_allocator<gc<T>>>;
+
+template <typename T>
+class gc_vector : public gc<gc_vector_storage<T>> {
  public:
-  using gc<vector<gc<T>>>::gc;
+  using gc<gc_vector_storage<T>>::gc;
   gc<T>& operator[](int idx) { return (*this->ptr())[idx]; }
 };
 
 template <typename T, typename... Args>
 gc_vector<T> gc_new_vector(Args&&... args) {
-  return gc_new_meta<vector<gc<T>>>(1, forward<Args>(args)...);
+  return gc_new_meta<gc_vector_storage<T>>(1, forward<Args>(args)...);
 }
 
 template <typename T>
 void gc_delete(gc_vector<T>& p) {
+  DeleteBatch batch;
   for (auto& i : *p) {
     gc_delete(i);
   }
@@ -695,24 +2690,28 @@ void gc_delete(gc_vector<T>& p) {
 /// Deque
 
 template <typename T>
-class gc_deque : public gc<deque<gc<T>>> {
+using gc_deque_storage = deque<gc<T>, gc_allocator<gc<T>>>;
+
+template <typename T>
+class gc_deque : public gc<gc_deque_storage<T>> {
  public:
-  using gc<deque<gc<T>>>::gc;
+  using gc<gc_deque_storage<T>>::gc;
   gc<T>& operator[](int idx) { return (*this->ptr())[idx]; }
 };
 
-template <typename T>
-struct PtrEnumerator<deque<gc<T>>> : ContainerPtrEnumerator<deque<gc<T>>> {
-  using ContainerPtrEnumerator<deque<gc<T>>>::ContainerPtrEnumerator;
+template <typename T, typename A>
+struct PtrEnumerator<deque<gc<T>, A>>
+    : ContainerPtrEnumerator<deque<gc<T>, A>> {
+  using ContainerPtrEnumerator<deque<gc<T>, A>>::ContainerPtrEnumerator;
 
   const PtrBase* getNext() override {
     return this->hasNext() ? &*this->it++ : nullptr;
   }
 };
 
-template <typename T>
-struct PtrEnumerator<deque<T>> : ContainerPtrEnumerator<deque<T>> {
-  using ContainerPtrEnumerator<deque<T>>::ContainerPtrEnumerator;
+template <typename T, typename A>
+struct PtrEnumerator<deque<T, A>> : ContainerPtrEnumerator<deque<T, A>> {
+  using ContainerPtrEnumerator<deque<T, A>>::ContainerPtrEnumerator;
 
   unique_ptr<IPtrEnumerator> ptrIter = nullptr;
 
@@ -738,11 +2737,12 @@ struct PtrEnumerator<deque<T>> : ContainerPtrEnumerator<deque<T>> {
 
 template <typename T, typename... Args>
 gc_deque<T> gc_new_deque(Args&&... args) {
-  return gc_new_meta<deque<gc<T>>>(1, forward<Args>(args)...);
+  return gc_new_meta<gc_deque_storage<T>>(1, forward<Args>(args)...);
 }
 
 template <typename T>
 void gc_delete(gc_deque<T>& p) {
+  DeleteBatch batch;
   for (auto& i : *p) {
     gc_delete(i);
   }
@@ -797,6 +2797,7 @@ gc_list<T> gc_new_list(Args&&... args) {
 
 template <typename T>
 void gc_delete(gc_list<T>& p) {
+  DeleteBatch batch;
   for (auto& i : *p) {
     gc_delete(i);
   }
@@ -808,15 +2809,20 @@ void gc_delete(gc_list<T>& p) {
 /// TODO: NOT support using gc object as key...
 
 template <typename K, typename V>
-class gc_map : public gc<map<K, gc<V>>> {
+using gc_map_storage =
+    map<K, gc<V>, less<K>, gc_allocator<pair<const K, gc<V>>>>;
+
+template <typename K, typename V>
+class gc_map : public gc<gc_map_storage<K, V>> {
  public:
-  using gc<map<K, gc<V>>>::gc;
+  using gc<gc_map_storage<K, V>>::gc;
   gc<V>& operator[](const K& k) { return (*this->ptr())[k]; }
 };
 
-template <typename K, typename V>
-struct PtrEnumerator<map<K, gc<V>>> : ContainerPtrEnumerator<map<K, gc<V>>> {
-  using ContainerPtrEnumerator<map<K, gc<V>>>::ContainerPtrEnumerator;
+template <typename K, typename V, typename C, typename A>
+struct PtrEnumerator<map<K, gc<V>, C, A>>
+    : ContainerPtrEnumerator<map<K, gc<V>, C, A>> {
+  using ContainerPtrEnumerator<map<K, gc<V>, C, A>>::ContainerPtrEnumerator;
 
   const PtrBase* getNext() override {
     if (!this->hasNext())
@@ -827,9 +2833,9 @@ struct PtrEnumerator<map<K, gc<V>>> : ContainerPtrEnumerator<map<K, gc<V>>> {
   }
 };
 
-template <typename K, typename V>
-struct PtrEnumerator<map<K, V>> : ContainerPtrEnumerator<map<K, V>> {
-  using ContainerPtrEnumerator<map<K, V>>::ContainerPtrEnumerator;
+template <typename K, typename V, typename C, typename A>
+struct PtrEnumerator<map<K, V, C, A>> : ContainerPtrEnumerator<map<K, V, C, A>> {
+  using ContainerPtrEnumerator<map<K, V, C, A>>::ContainerPtrEnumerator;
 
   unique_ptr<IPtrEnumerator> ptrIter;
 
@@ -857,11 +2863,12 @@ struct PtrEnumerator<map<K, V>> : ContainerPtrEnumerator<map<K, V>> {
 
 template <typename K, typename V, typename... Args>
 gc_map<K, V> gc_new_map(Args&&... args) {
-  return gc_new_meta<map<K, gc<V>>>(1, forward<Args>(args)...);
+  return gc_new_meta<gc_map_storage<K, V>>(1, forward<Args>(args)...);
 }
 
 template <typename K, typename V>
 void gc_delete(gc_map<K, V>& p) {
+  DeleteBatch batch;
   for (auto& i : *p) {
     gc_delete(i->value);
   }
@@ -928,6 +2935,7 @@ gc_unordered_map<K, V> gc_new_unordered_map(Args&&... args) {
 }
 template <typename K, typename V>
 void gc_delete(gc_unordered_map<K, V>& p) {
+  DeleteBatch batch;
   for (auto& i : *p) {
     gc_delete(i.second);
   }
@@ -982,6 +2990,7 @@ gc_set<V> gc_new_set(Args&&... args) {
 
 template <typename T>
 void gc_delete(gc_set<T>& p) {
+  DeleteBatch batch;
   for (auto i : *p) {
     gc_delete(i);
   }
@@ -1038,26 +3047,395 @@ gc_unordered_set<V> gc_new_unordered_set(Args&&... args) {
 
 template <typename T>
 void gc_delete(gc_unordered_set<T>& p) {
+  DeleteBatch batch;
   for (auto i : *p) {
     gc_delete(i);
   }
   p->clear();
 }
 
+//////////////////////////////////////////////////////////////////////////
+/// FlatHashMap
+/// Open addressing over one slot array, so the whole table is scanned
+/// linearly. gc objects can be used as keys, they are hashed by identity.
+
+template <typename K>
+struct FlatHash {
+  size_t operator()(const K& k) const {
+    if constexpr (is_base_of_v<PtrBase, K>)
+      return (size_t)k.getMeta();
+    else
+      return hash<K>()(k);
+  }
+};
+
+template <typename K>
+struct FlatEqual {
+  bool operator()(const K& a, const K& b) const {
+    if constexpr (is_base_of_v<PtrBase, K>)
+      return a.getMeta() == b.getMeta();
+    else
+      return a == b;
+  }
+};
+
+template <typename K, typename V>
+class gc_flat_hash_map;
+
+// When the table is a gc object of its own (see gc_new_flat_hash_map), the
+// pointers in the slots are never roots and are not known to the collector
+// while the table is young, so they can be moved around without barriers.
+template <typename K, typename V>
+class flat_hash_map {
+  friend struct PtrEnumerator<flat_hash_map>;
+  template <typename K2, typename V2, typename... Args>
+  friend gc_flat_hash_map<K2, V2> gc_new_flat_hash_map(Args&&... args);
+
+ public:
+  using key_type = K;
+  using mapped_type = gc<V>;
+  using value_type = pair<K, gc<V>>;
+
+  template <typename E>
+  class Iter {
+    friend class flat_hash_map;
+    const signed char* ctrl;
+    const signed char* end;
+    E* slot;
+
+    Iter(const signed char* c, const signed char* e, E* s)
+        : ctrl(c), end(e), slot(s) {
+      skip();
+    }
+    void skip() {
+      for (; ctrl != end && *ctrl < 0; ctrl++, slot++) {
+      }
+    }
+
+   public:
+    E& operator*() const { return *slot; }
+    E* operator->() const { return slot; }
+    Iter& operator++() {
+      ctrl++, slot++;
+      skip();
+      return *this;
+    }
+    Iter operator++(int) {
+      auto r = *this;
+      ++*this;
+      return r;
+    }
+    bool operator==(const Iter& r) const { return ctrl == r.ctrl; }
+    bool operator!=(const Iter& r) const { return ctrl != r.ctrl; }
+  };
+  using iterator = Iter<value_type>;
+  using const_iterator = Iter<const value_type>;
+
+  flat_hash_map() {}
+  flat_hash_map(const flat_hash_map& r) { *this = r; }
+  flat_hash_map& operator=(const flat_hash_map& r) {
+    if (this != &r) {
+      clear();
+      reserve(r.len);
+      for (auto& i : r)
+        insert(i);
+    }
+    return *this;
+  }
+  ~flat_hash_map() {
+    clear();
+    ::operator delete(slots);
+  }
+
+  iterator begin() { return {ctrl, ctrl + cap, slots}; }
+  iterator end() { return {ctrl + cap, ctrl + cap, slots + cap}; }
+  const_iterator begin() const { return {ctrl, ctrl + cap, slots}; }
+  const_iterator end() const { return {ctrl + cap, ctrl + cap, slots + cap}; }
+  size_t size() const { return len; }
+  bool empty() const { return !len; }
+
+  iterator find(const K& k) {
+    auto i = lookup(k);
+    return i == NoSlot ? end() : at(i);
+  }
+  size_t count(const K& k) const { return lookup(k) != NoSlot; }
+
+  gc<V>& operator[](const K& k) {
+    auto [i, isNew] = prepare(k);
+    if (isNew)
+      construct(i, k);
+    return slots[i].second;
+  }
+
+  pair<iterator, bool> insert(const value_type& v) {
+    auto [i, isNew] = prepare(v.first);
+    if (isNew) {
+      construct(i, v.first);
+      slots[i].second = v.second;
+    }
+    return {at(i), isNew};
+  }
+
+  size_t erase(const K& k) {
+    auto i = lookup(k);
+    if (i == NoSlot)
+      return 0;
+    eraseAt(i);
+    return 1;
+  }
+  iterator erase(iterator it) {
+    auto i = size_t(it.slot - slots);
+    eraseAt(i);
+    return at(i);
+  }
+
+  void clear() {
+    for (size_t i = 0; i < cap; i++) {
+      if (ctrl[i] >= 0)
+        destroy(slots[i]);
+      ctrl[i] = Empty;
+    }
+    len = tombs = 0;
+  }
+
+  void reserve(size_t n) {
+    size_t c = 16;
+    while (c * 7 / 8 < n)
+      c *= 2;
+    if (c > cap)
+      rehash(c);
+  }
+
+ private:
+  static constexpr signed char Empty = -128;
+  static constexpr signed char Deleted = -2;
+  static constexpr size_t NoSlot = size_t(-1);
+  static constexpr bool GcKey = is_base_of_v<PtrBase, K>;
+  // not with immediate boxes.
+  static constexpr bool GcValue = is_base_of_v<PtrBase, gc<V>>;
+
+  value_type* slots = nullptr;
+  signed char* ctrl = nullptr;
+  size_t cap = 0, len = 0, tombs = 0;
+  ObjMeta* owner = nullptr;
+
+  static size_t hashOf(const K& k) {
+    // spread the bits, identity hashes are common.
+    auto h = uint64_t(FlatHash<K>()(k)) * 0x9E3779B97F4A7C15ull;
+    return size_t(h ^ (h >> 32));
+  }
+
+  iterator at(size_t i) { return {ctrl + i, ctrl + cap, slots + i}; }
+
+  size_t lookup(const K& k) const {
+    if (!len)
+      return NoSlot;
+    auto h = hashOf(k);
+    auto tag = (signed char)(h & 0x7f);
+    auto mask = cap - 1;
+    for (auto i = (h >> 7) & mask;; i = (i + 1) & mask) {
+      if (ctrl[i] == tag && FlatEqual<K>()(slots[i].first, k))
+        return i;
+      if (ctrl[i] == Empty)
+        return NoSlot;
+    }
+  }
+
+  // the slot of k, or a free one for it.
+  pair<size_t, bool> prepare(const K& k) {
+    if ((len + tombs + 1) * 8 > cap * 7)
+      rehash(len * 2 + 2 > cap ? max(cap * 2, size_t(16)) : cap);
+    auto h = hashOf(k);
+    auto tag = (signed char)(h & 0x7f);
+    auto mask = cap - 1;
+    auto slot = NoSlot;
+    for (auto i = (h >> 7) & mask;; i = (i + 1) & mask) {
+      if (ctrl[i] == tag && FlatEqual<K>()(slots[i].first, k))
+        return {i, false};
+      if (ctrl[i] == Deleted && slot == NoSlot)
+        slot = i;
+      if (ctrl[i] == Empty)
+        return {slot == NoSlot ? i : slot, true};
+    }
+  }
+
+  template <typename P>
+  void adopt(const P& p) {
+    if constexpr (is_base_of_v<PtrBase, P>)
+      if (owner)
+        p.adoptBy(owner);
+  }
+
+  // pointers are adopted before they are assigned, so that the barrier
+  // knows they are not roots.
+  template <typename KK>
+  void construct(size_t i, KK&& k) {
+    auto* s = &slots[i];
+    if constexpr (GcKey) {
+      new (s) value_type();
+      adopt(s->first);
+      s->first = k;
+    } else {
+      new (s) value_type(piecewise_construct, forward_as_tuple(forward<KK>(k)),
+                         forward_as_tuple());
+    }
+    adopt(s->second);
+    if (ctrl[i] == Deleted)
+      tombs--;
+    ctrl[i] = (signed char)(hashOf(s->first) & 0x7f);
+    len++;
+  }
+
+  void destroy(value_type& s) {
+    if constexpr (!GcValue) {
+      s.~value_type();
+    }
+    // pointers written in an open region are logged for escape detection.
+    else if (owner && !s.second.isOld() && !s.second.isRoot() &&
+             !Collector::get()->isRegionOpen()) {
+      // the collector has no record of them.
+#if TGC_HYBRID_RC
+      PtrBase::release(s.second.getMeta());
+      if constexpr (GcKey)
+        PtrBase::release(s.first.getMeta());
+#endif
+      if constexpr (!GcKey)
+        s.first.~K();
+    } else {
+      s.~value_type();
+    }
+  }
+
+  void eraseAt(size_t i) {
+    destroy(slots[i]);
+    // no probe sequence passes an empty slot, so it can be reused directly.
+    auto next = ctrl[(i + 1) & (cap - 1)];
+    ctrl[i] = next == Empty ? Empty : Deleted;
+    if (ctrl[i] == Deleted)
+      tombs++;
+    len--;
+  }
+
+  void rehash(size_t newCap) {
+    auto* oldSlots = slots;
+    auto* oldCtrl = ctrl;
+    auto oldCap = cap;
+
+    slots = (value_type*)::operator new(newCap * (sizeof(value_type) + 1));
+    ctrl = (signed char*)(slots + newCap);
+    fill_n(ctrl, newCap, Empty);
+    cap = newCap;
+    len = tombs = 0;
+
+    auto mask = cap - 1;
+    for (size_t j = 0; j < oldCap; j++) {
+      if (oldCtrl[j] < 0)
+        continue;
+      auto& o = oldSlots[j];
+      auto i = (hashOf(o.first) >> 7) & mask;
+      while (ctrl[i] != Empty)
+        i = (i + 1) & mask;
+      construct(i, move(o.first));
+      slots[i].second = o.second;
+      destroy(o);
+    }
+    ::operator delete(oldSlots);
+  }
+};
+
+template <typename K, typename V>
+struct PtrEnumerator<flat_hash_map<K, V>> : IPtrEnumerator {
+  using Map = flat_hash_map<K, V>;
+  static constexpr bool GcKey = Map::GcKey;
+  static constexpr bool GcValue = Map::GcValue;
+
+  Map* con;
+  size_t idx = 0;
+  bool valueNext = false;
+
+  PtrEnumerator(ClassMeta*, char* o, size_t) : con((Map*)o) {}
+
+  const PtrBase* getNext() override {
+    if constexpr (GcKey && GcValue) {
+      if (valueNext) {
+        valueNext = false;
+        return &con->slots[idx++].second;
+      }
+    }
+    for (; idx < con->cap; idx++) {
+      if (con->ctrl[idx] < 0)
+        continue;
+      if constexpr (GcKey && GcValue) {
+        valueNext = true;
+        return &con->slots[idx].first;
+      } else if constexpr (GcKey) {
+        return &con->slots[idx++].first;
+      } else if constexpr (GcValue) {
+        return &con->slots[idx++].second;
+      } else {
+        break;
+      }
+    }
+    return nullptr;
+  }
+};
+
+template <typename K, typename V>
+class gc_flat_hash_map : public gc<flat_hash_map<K, V>> {
+ public:
+  using gc<flat_hash_map<K, V>>::gc;
+  gc<V>& operator[](const K& k) { return (*this->ptr())[k]; }
+};
+
+template <typename K, typename V, typename... Args>
+gc_flat_hash_map<K, V> gc_new_flat_hash_map(Args&&... args) {
+  gc_flat_hash_map<K, V> r = gc_new_meta<flat_hash_map<K, V>>(1);
+  r->owner = r.getMeta();
+  if constexpr (sizeof...(Args) > 0)
+    *r = flat_hash_map<K, V>(forward<Args>(args)...);
+  return r;
+}
+
+template <typename K, typename V>
+void gc_delete(gc_flat_hash_map<K, V>& p) {
+  DeleteBatch batch;
+  for (auto& i : *p) {
+    gc_delete(i.second);
+  }
+  p->clear();
+}
+
 }  // namespace details
 
 //////////////////////////////////////////////////////////////////////////
 // Public APIs
 
 using details::gc;
+using details::gc_allocator;
+using details::gc_blocking_region;
 using details::gc_collect;
 using details::gc_collector;
 using details::gc_dynamic_pointer_cast;
+using details::gc_freeze;
 using details::gc_from;
 using details::gc_function;
+using details::gc_load_image;
+using details::gc_memory_pressure;
 using details::gc_new;
 using details::gc_new_array;
+using details::gc_new_batch;
+using details::gc_ref;
+using details::gc_region;
+using details::gc_safepoint;
+using details::gc_save_image;
 using details::gc_static_pointer_cast;
+using details::gc_thaw;
+using details::MemoryPressure;
+#if TGC_COROUTINES
+using details::gc_resumer;
+using details::gc_suspend;
+using details::gc_task;
+#endif
 
 using details::gc_new_vector;
 using details::gc_vector;
@@ -1080,16 +3458,40 @@ using details::gc_unordered_map;
 using details::gc_new_unordered_set;
 using details::gc_unordered_set;
 
+using details::gc_flat_hash_map;
+using details::gc_new_flat_hash_map;
+
+// gc<char> stays a heap pointer, for the byte buffers of gc_new_array.
 TGC_DECL_AUTO_BOX(char, gc_char);
 TGC_DECL_AUTO_BOX(unsigned char, gc_uchar);
-TGC_DECL_AUTO_BOX(short, gc_short);
-TGC_DECL_AUTO_BOX(unsigned short, gc_ushort);
-TGC_DECL_AUTO_BOX(int, gc_int);
-TGC_DECL_AUTO_BOX(unsigned int, gc_uint);
-TGC_DECL_AUTO_BOX(float, gc_float);
-TGC_DECL_AUTO_BOX(double, gc_double);
-TGC_DECL_AUTO_BOX(long, gc_long);
-TGC_DECL_AUTO_BOX(unsigned long, gc_ulong);
+#if TGC_IMMEDIATE_BOXES
+#define TGC_DECL_SCALAR_BOX TGC_DECL_IMMEDIATE_BOX
+#else
+#define TGC_DECL_SCALAR_BOX TGC_DECL_AUTO_BOX
+#endif
+TGC_DECL_SCALAR_BOX(short, gc_short);
+TGC_DECL_SCALAR_BOX(unsigned short, gc_ushort);
+TGC_DECL_SCALAR_BOX(int, gc_int);
+TGC_DECL_SCALAR_BOX(unsigned int, gc_uint);
+TGC_DECL_SCALAR_BOX(float, gc_float);
+TGC_DECL_SCALAR_BOX(double, gc_double);
+TGC_DECL_SCALAR_BOX(long, gc_long);
+TGC_DECL_SCALAR_BOX(unsigned long, gc_ulong);
 TGC_DECL_AUTO_BOX(std::string, gc_string);
 
+template <>
+class details::gc<details::istring> : public details::GcPtr<details::istring> {
+ public:
+  using GcPtr<details::istring>::GcPtr;
+  gc(const details::istring& s) : GcPtr(details::gc_new_meta<istring>(1, s)) {}
+  gc(string_view s) : gc(details::istring(s)) {}
+  gc(const char* s) : gc(details::istring(s)) {}
+  gc(const string& s) : gc(details::istring(s)) {}
+  gc() {}
+  gc(nullptr_t) {}
+  operator const details::istring&() const { return operator*(); }
+};
+using gc_istring = details::gc<details::istring>;
+using details::istring;
+
 }  // namespace tgc2
@@ -0,0 +1,441 @@
+// Replays a trace written by GcTrace against other gc policies, and reports
+// the pauses and the peak heap each of them would give.
+//
+//   tgc2_sim trace.bin [--trigger=objcnt:N:M | --trigger=time:MS:K]
+//                      [--tenure=N] [--granule=N] [--no-leaf]
+//
+// objcnt:N:M is GcCondition_ObjCnt: a minor gc every N allocations, a full
+// one once the old generation holds M objects. time:MS:K is GcCondition_Time:
+// a minor gc every MS milliseconds, a full one every K minor ones. The tenure
+// is the minor gcs an object survives before its promotion. Sizes are rounded
+// to the granule, and --no-leaf keeps the leaf objects in the generations.
+// Without a trigger nor a tenure, a grid of them is tried.
+//
+// The work of a pause is the objects and gc pointers it visits plus the
+// objects it sweeps one by one. Each allocation is an object of its own,
+// alive until the simulated policy finds it unreachable: the frees of the
+// trace only tell when the program reused its address. The objects
+// allocated before the trace started are not known, nor the pointers to
+// them.
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "tgc2.h"
+
+using namespace std;
+using tgc2::details::GcTrace;
+using Kind = GcTrace::Kind;
+using Record = GcTrace::Record;
+
+namespace {
+
+struct Policy {
+  bool byTime = false;
+  uint64_t minorEvery = 512;   // allocations, or ms by time
+  uint64_t fullAfter = 10240;  // old objects, or minor gcs by time
+  unsigned tenure = 2;
+  uint64_t granule = 16;
+  bool leaf = true;
+
+  string name() const {
+    char s[64];
+    snprintf(s, sizeof(s), "%s:%llu:%llu tenure %u",
+             byTime ? "time" : "objcnt", (unsigned long long)minorEvery,
+             (unsigned long long)fullAfter, tenure);
+    return s;
+  }
+};
+
+struct Pauses {
+  uint64_t count = 0;
+  uint64_t work = 0;
+  uint64_t maxWork = 0;
+
+  void add(uint64_t w) {
+    count++;
+    work += w;
+    maxWork = max(maxWork, w);
+  }
+  uint64_t avgWork() const { return count ? work / count : 0; }
+};
+
+struct Slot {
+  uint64_t addr;    // of the gc pointer
+  uint64_t target;  // a node, 0 for null or one not known
+};
+
+// An allocation of the trace. It lives on until the simulated policy
+// collects it, even after the program freed it and reused its address.
+struct Obj {
+  uint64_t addr = 0;  // its header, 0 once the program freed it
+  uint64_t size = 0;
+  bool leaf = false;
+  bool old = false;
+  bool marked = false;
+  unsigned scans = 0;
+  vector<Slot> slots;  // the gc pointers in it
+};
+
+struct SlotRef {
+  uint64_t owner;  // a node, 0 for the roots
+  size_t index;    // in the slots of the owner
+};
+
+class Sim {
+ public:
+  explicit Sim(const Policy& p) : policy(p) { nodes[0]; }
+
+  void replay(const vector<Record>& records) {
+    for (auto& r : records) {
+      switch (r.kind) {
+        case Kind::Alloc:
+        case Kind::AllocLeaf:
+          alloc(r);
+          break;
+        case Kind::Store:
+          store(r.id, r.arg);
+          break;
+        case Kind::Drop:
+          drop(r.id);
+          break;
+        case Kind::Free:
+          if (auto it = byAddr.find(r.id); it != byAddr.end())
+            unbind(it);
+          break;
+        default:
+          break;
+      }
+    }
+  }
+
+  void report() const {
+    printf("%-28s %6llu %9llu %9llu %6llu %9llu %9llu %9lluK\n",
+           policy.name().c_str(), (unsigned long long)minor.count,
+           (unsigned long long)minor.avgWork(),
+           (unsigned long long)minor.maxWork, (unsigned long long)full.count,
+           (unsigned long long)full.avgWork(),
+           (unsigned long long)full.maxWork,
+           (unsigned long long)(peakBytes / 1024));
+  }
+
+ private:
+  Policy policy;
+  // by a sequence of their own, the node 0 holds the roots.
+  unordered_map<uint64_t, Obj> nodes;
+  uint64_t lastNode = 0;
+  // the nodes the program still has, by header, ordered to find the owner
+  // of a slot.
+  map<uint64_t, uint64_t> byAddr;
+  unordered_map<uint64_t, SlotRef> slotAt;
+  unordered_set<uint64_t> young, old;
+  uint64_t heapBytes = 0;
+  uint64_t peakBytes = 0;
+  uint64_t oldCnt = 0;
+  Pauses minor, full;
+
+  // the trigger
+  uint64_t counter = 0;
+  uint64_t lastGcTime = 0;
+  uint64_t minorCnt = 0;
+
+  bool inGen(const Obj& o) const { return !o.leaf || !policy.leaf; }
+  uint64_t cellSize(const Obj& o) const {
+    return (o.size + policy.granule - 1) / policy.granule * policy.granule;
+  }
+
+  bool needMinorGc(uint64_t now) {
+    if (!policy.byTime)
+      return counter++ % policy.minorEvery == 0;
+    if (counter++ > 1024 * 10 &&
+        now - lastGcTime > policy.minorEvery * 1000000) {
+      counter = 0;
+      lastGcTime = now;
+      minorCnt++;
+      return true;
+    }
+    return false;
+  }
+  bool needFullGc() {
+    if (!policy.byTime)
+      return oldCnt > policy.fullAfter;
+    if (minorCnt > policy.fullAfter) {
+      minorCnt = 0;
+      return true;
+    }
+    return false;
+  }
+
+  void alloc(const Record& r) {
+    if (needMinorGc(r.time))
+      needFullGc() ? collect(true) : collect(false);
+    // freed by the program without a record, e.g. by the bitmaps of the
+    // leaf space.
+    auto it = byAddr.lower_bound(r.id);
+    if (it != byAddr.begin() &&
+        prev(it)->first + nodes[prev(it)->second].size > r.id)
+      --it;
+    while (it != byAddr.end() && it->first < r.id + r.arg)
+      it = unbind(it);
+
+    auto id = ++lastNode;
+    auto& o = nodes[id];
+    o.addr = r.id;
+    o.size = r.arg;
+    o.leaf = r.kind == Kind::AllocLeaf;
+    byAddr[r.id] = id;
+    young.insert(id);
+    heapBytes += cellSize(o);
+    peakBytes = max(peakBytes, heapBytes);
+  }
+
+  // The program is done with the node, but it stays until the policy finds
+  // it dead. Its slots keep their targets, and the drops of its destructor
+  // no longer find them.
+  using AddrIt = map<uint64_t, uint64_t>::iterator;
+
+  AddrIt unbind(AddrIt it) {
+    auto& o = nodes[it->second];
+    for (auto& s : o.slots) {
+      auto ref = slotAt.find(s.addr);
+      if (ref != slotAt.end() && ref->second.owner == it->second)
+        slotAt.erase(ref);
+    }
+    o.addr = 0;
+    return byAddr.erase(it);
+  }
+
+  void free(uint64_t id) {
+    auto& o = nodes[id];
+    if (o.addr)
+      unbind(byAddr.find(o.addr));
+    young.erase(id);
+    old.erase(id);
+    heapBytes -= cellSize(o);
+    if (o.old && inGen(o))
+      oldCnt--;
+    nodes.erase(id);
+  }
+
+  void store(uint64_t p, uint64_t header) {
+    auto t = byAddr.find(header);
+    auto target = t != byAddr.end() ? t->second : 0;
+    auto it = slotAt.find(p);
+    if (it != slotAt.end()) {
+      nodes[it->second.owner].slots[it->second.index].target = target;
+      return;
+    }
+    uint64_t owner = 0;
+    auto o = byAddr.upper_bound(p);
+    if (o != byAddr.begin() &&
+        p < prev(o)->first + nodes[prev(o)->second].size)
+      owner = prev(o)->second;
+    auto& list = nodes[owner].slots;
+    slotAt[p] = {owner, list.size()};
+    list.push_back({p, target});
+  }
+
+  void drop(uint64_t p) {
+    auto it = slotAt.find(p);
+    if (it == slotAt.end())
+      return;
+    auto ref = it->second;
+    slotAt.erase(it);
+    auto& list = nodes[ref.owner].slots;
+    if (ref.index + 1 < list.size()) {
+      list[ref.index] = list.back();
+      auto moved = slotAt.find(list[ref.index].addr);
+      if (moved != slotAt.end() && moved->second.owner == ref.owner)
+        moved->second.index = ref.index;
+    }
+    list.pop_back();
+  }
+
+  void promote(uint64_t id, Obj& o) {
+    o.old = true;
+    young.erase(id);
+    old.insert(id);
+    if (inGen(o))
+      oldCnt++;
+  }
+
+  // minor gcs leave the old objects alone and start from the pointers of
+  // the old ones to young ones, as the barrier remembers them.
+  void collect(bool isFull) {
+    uint64_t work = 0;
+    vector<Obj*> stack;
+    auto push = [&](uint64_t target) {
+      auto it = target ? nodes.find(target) : nodes.end();
+      if (it == nodes.end())
+        return;
+      auto& o = it->second;
+      if (o.marked || (!isFull && o.old))
+        return;
+      o.marked = true;
+      stack.push_back(&o);
+    };
+    for (auto& s : nodes[0].slots) {
+      work++;
+      push(s.target);
+    }
+    if (!isFull) {
+      for (auto id : old) {
+        for (auto& s : nodes[id].slots) {
+          if (young.count(s.target)) {
+            work++;
+            push(s.target);
+          }
+        }
+      }
+    }
+    while (stack.size()) {
+      auto* o = stack.back();
+      stack.pop_back();
+      work++;
+      for (auto& s : o->slots) {
+        work++;
+        push(s.target);
+      }
+    }
+
+    vector<uint64_t> dead;
+    auto sweep = [&](uint64_t id, Obj& o) {
+      // the leaf space is swept by bitmap.
+      if (inGen(o))
+        work++;
+      if (!o.marked) {
+        dead.push_back(id);
+        return;
+      }
+      o.marked = false;
+      if (!isFull && ++o.scans >= policy.tenure)
+        promote(id, o);
+    };
+    if (isFull) {
+      for (auto& [id, o] : nodes)
+        if (id)
+          sweep(id, o);
+    } else {
+      for (auto id : vector<uint64_t>(young.begin(), young.end()))
+        sweep(id, nodes[id]);
+    }
+    for (auto id : dead)
+      free(id);
+    (isFull ? full : minor).add(work);
+  }
+};
+
+bool readTrace(const char* path, vector<Record>& records) {
+  auto* f = fopen(path, "rb");
+  if (!f)
+    return false;
+  char magic[sizeof(GcTrace::Magic)];
+  auto ok = fread(magic, sizeof(magic), 1, f) == 1 &&
+            !memcmp(magic, GcTrace::Magic, sizeof(magic));
+  Record r;
+  while (ok && fread(&r, sizeof(r), 1, f) == 1)
+    records.push_back(r);
+  fclose(f);
+  return ok;
+}
+
+bool parseTrigger(const char* s, Policy& p) {
+  unsigned long long a, b;
+  if (sscanf(s, "objcnt:%llu:%llu", &a, &b) == 2 && a)
+    p.byTime = false;
+  else if (sscanf(s, "time:%llu:%llu", &a, &b) == 2)
+    p.byTime = true;
+  else
+    return false;
+  p.minorEvery = a;
+  p.fullAfter = b;
+  return true;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    fprintf(stderr,
+            "usage: %s trace.bin [--trigger=objcnt:N:M|time:MS:K] "
+            "[--tenure=N] [--granule=N] [--no-leaf]\n",
+            argv[0]);
+    return 1;
+  }
+  Policy base;
+  bool trigger = false, tenure = false;
+  for (int i = 2; i < argc; i++) {
+    auto* a = argv[i];
+    if (!strncmp(a, "--trigger=", 10) && parseTrigger(a + 10, base)) {
+      trigger = true;
+    } else if (!strncmp(a, "--tenure=", 9) && atoi(a + 9) > 0) {
+      base.tenure = atoi(a + 9);
+      tenure = true;
+    } else if (!strncmp(a, "--granule=", 10) && atoi(a + 10) > 0) {
+      base.granule = atoi(a + 10);
+    } else if (!strcmp(a, "--no-leaf")) {
+      base.leaf = false;
+    } else {
+      fprintf(stderr, "unknown option %s\n", a);
+      return 1;
+    }
+  }
+
+  vector<Record> records;
+  if (!readTrace(argv[1], records)) {
+    fprintf(stderr, "%s is not a trace of GcTrace\n", argv[1]);
+    return 1;
+  }
+  size_t allocs = 0, stores = 0, minors = 0, fulls = 0;
+  for (auto& r : records) {
+    allocs += r.kind == Kind::Alloc || r.kind == Kind::AllocLeaf;
+    stores += r.kind == Kind::Store;
+    minors += r.kind == Kind::MinorGc;
+    fulls += r.kind == Kind::FullGc;
+  }
+  printf("%zu allocations, %zu pointer writes in %.1fms, recorded %zu minor "
+         "and %zu full gcs\n",
+         allocs, stores, records.size() ? records.back().time / 1e6 : 0.0,
+         minors, fulls);
+
+  vector<Policy> policies;
+  const char* triggers[] = {"objcnt:256:10240", "objcnt:512:10240",
+                            "objcnt:2048:10240", "objcnt:512:100000",
+                            "time:10:1024"};
+  for (auto* t : triggers) {
+    if (trigger)
+      break;
+    auto p = base;
+    parseTrigger(t, p);
+    policies.push_back(p);
+  }
+  if (trigger)
+    policies.push_back(base);
+  if (!tenure) {
+    vector<Policy> tenures;
+    for (auto& p : policies) {
+      for (unsigned t : {1, 2, 4}) {
+        auto q = p;
+        q.tenure = t;
+        tenures.push_back(q);
+      }
+    }
+    policies.swap(tenures);
+  }
+
+  printf("%-28s %6s %9s %9s %6s %9s %9s %10s\n", "policy", "minor", "avg work",
+         "max work", "full", "avg work", "max work", "peak heap");
+  for (auto& p : policies) {
+    Sim sim(p);
+    sim.replay(records);
+    sim.report();
+  }
+  return 0;
+}